@@ -7,9 +7,9 @@ set(CMAKE_AUTOMOC ON)
 set(CMAKE_AUTORCC ON)
 set(CMAKE_AUTOUIC ON)
 
-find_package(Qt6 COMPONENTS Widgets)
+find_package(Qt6 COMPONENTS Widgets Sql)
 if (NOT Qt6_FOUND)
-  find_package(Qt5 5.15 REQUIRED COMPONENTS Widgets)
+  find_package(Qt5 5.15 REQUIRED COMPONENTS Widgets Sql)
 endif()
 
 if (CMAKE_CXX_COMPILER_ID MATCHES "(Clang|GNU)")
@@ -28,8 +28,82 @@ add_executable(PristmaticOutpost
   main.cpp
   menuwindow.cpp
   prismaticoutpost.cpp
+  script.cpp
+  scriptactor.cpp
+  scriptcache.cpp
+  scriptcompiler.cpp
+  scriptdatum.cpp
   scripteditor.cpp
+  scriptexecutor.cpp
+  scripthashtable.cpp
+  scriptheap.cpp
+  scriptlexer.cpp
+  scriptoptimizer.cpp
+  scriptprimitives.cpp
+  scriptprofiler.cpp
+  scriptreader.cpp
+  scriptsimd.cpp
+  scriptvalue.cpp
+  scriptvector.cpp
+  scriptvm.cpp
   toolwindow.cpp
 )
 
-target_link_libraries(PristmaticOutpost Qt::Widgets)
+target_link_libraries(PristmaticOutpost Qt::Widgets Qt::Sql)
+
+set(SCRIPT_SOURCES
+  script.cpp
+  scriptactor.cpp
+  scriptcompiler.cpp
+  scriptdatum.cpp
+  scripthashtable.cpp
+  scriptheap.cpp
+  scriptlexer.cpp
+  scriptoptimizer.cpp
+  scriptprimitives.cpp
+  scriptprofiler.cpp
+  scriptreader.cpp
+  scriptsimd.cpp
+  scriptvalue.cpp
+  scriptvector.cpp
+  scriptvm.cpp
+)
+
+add_executable(bench_tailcall benchmarks/bench_tailcall.cpp ${SCRIPT_SOURCES})
+target_include_directories(bench_tailcall PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(bench_tailcall Qt::Core)
+
+add_executable(bench_primitives benchmarks/bench_primitives.cpp ${SCRIPT_SOURCES})
+target_include_directories(bench_primitives PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(bench_primitives Qt::Core)
+
+add_executable(bench_vectors benchmarks/bench_vectors.cpp ${SCRIPT_SOURCES})
+target_include_directories(bench_vectors PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(bench_vectors Qt::Core)
+
+add_executable(bench_script benchmarks/bench_script.cpp ${SCRIPT_SOURCES})
+target_include_directories(bench_script PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(bench_script Qt::Core)
+if (WIN32)
+  target_link_libraries(bench_script psapi)
+endif()
+
+add_executable(bench_database benchmarks/bench_database.cpp databasemanager.cpp)
+target_include_directories(bench_database PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(bench_database Qt::Core Qt::Sql)
+
+add_executable(batchrunner
+  batch/batchrunner.cpp
+  databasemanager.cpp
+  scriptcache.cpp
+  scriptexecutor.cpp
+  ${SCRIPT_SOURCES}
+)
+target_include_directories(batchrunner PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(batchrunner Qt::Core Qt::Sql)
+
+enable_testing()
+add_executable(test_actors tests/test_actors.cpp ${SCRIPT_SOURCES})
+target_include_directories(test_actors PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(test_actors Qt::Core)
+add_test(NAME actors COMMAND test_actors)
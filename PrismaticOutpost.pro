@@ -24,14 +24,46 @@ SOURCES += \
     main.cpp \
     prismaticoutpost.cpp \
     script.cpp \
+    scriptactor.cpp \
+    scriptcache.cpp \
+    scriptcompiler.cpp \
+    scriptdatum.cpp \
     scripteditor.cpp \
+    scriptexecutor.cpp \
+    scripthashtable.cpp \
+    scriptheap.cpp \
+    scriptlexer.cpp \
+    scriptoptimizer.cpp \
+    scriptprimitives.cpp \
+    scriptprofiler.cpp \
+    scriptreader.cpp \
+    scriptsimd.cpp \
+    scriptvalue.cpp \
+    scriptvector.cpp \
+    scriptvm.cpp \
     toolwindow.cpp
 
 HEADERS += \
     databasemanager.h \
     prismaticoutpost.h \
     script.h \
+    scriptactor.h \
+    scriptcache.h \
+    scriptcompiler.h \
+    scriptdatum.h \
     scripteditor.h \
+    scriptexecutor.h \
+    scripthashtable.h \
+    scriptheap.h \
+    scriptlexer.h \
+    scriptoptimizer.h \
+    scriptprimitives.h \
+    scriptprofiler.h \
+    scriptreader.h \
+    scriptsimd.h \
+    scriptvalue.h \
+    scriptvector.h \
+    scriptvm.h \
     toolwindow.h
 
 TRANSLATIONS += \
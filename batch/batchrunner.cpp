@@ -0,0 +1,264 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// batchrunner.cpp
+//
+// Runs script files without a display. Files and directories given on the
+// command line are collected up front; each script is loaded through a
+// ScriptCache on this thread and run on a ScriptExecutor worker, with at
+// most --jobs running at once. A line is printed per script as it
+// completes, with its status, wall time and CPU time, and a summary at the
+// end. The exit code is 0 only if every script finished.
+//
+// With --profile each run gets its own Profiler and tracks allocation
+// sites. When it completes, its collapsed stacks are written next to the
+// script as <name>.collapsed, and the report with the heap summary as
+// <name>.profile.
+#include "databasemanager.h"
+#include "script.h"
+#include "scriptcache.h"
+#include "scriptexecutor.h"
+#include "scriptprofiler.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QQueue>
+#include <QScopedPointer>
+#include <QTextStream>
+#include <QThread>
+
+namespace {
+
+class BatchRunner : public QObject
+{
+public:
+    BatchRunner(const QStringList &scripts, int jobs, int timeout, Script::ExecutionMode executionMode,
+                QTextStream &output)
+        : queue(scripts.begin(), scripts.end()),
+          maxRunning(jobs),
+          timeoutMs(timeout),
+          mode(executionMode),
+          out(output)
+    {
+        executor.setMaxThreads(jobs);
+    }
+
+    void setDatabase(DatabaseManager *manager) { cache.setDatabase(manager); }
+    void setProfileMode(Profiler::Mode mode)
+    {
+        profiling = true;
+        profileMode = mode;
+    }
+
+    void start()
+    {
+        clock.start();
+        out << "status\twall ms\tcpu ms\tscript\tdetail" << Qt::endl;
+        submitNext();
+    }
+
+    int getFailures() const { return failures; }
+
+private:
+    QQueue<QString> queue;
+    int maxRunning;
+    int timeoutMs;
+    Script::ExecutionMode mode;
+    bool profiling = false;
+    Profiler::Mode profileMode = Profiler::Sampling;
+    QTextStream &out;
+    ScriptCache cache;
+    ScriptExecutor executor;
+    QElapsedTimer clock;
+    int running = 0;
+    int finished = 0;
+    int failures = 0;
+    qint64 totalCpuNs = 0;
+    // Error of a failed run. failed() and completed() are emitted back to
+    // back, so no other run's signals come in between.
+    QString detail;
+
+    // Loading happens here, so parsing the next script overlaps with the
+    // ones already running
+    void submitNext()
+    {
+        while (running < maxRunning && !queue.isEmpty()) {
+            QString path = queue.dequeue();
+            QSharedPointer<Script> script;
+            try {
+                script = cache.acquire(path);
+            }
+            catch (const std::exception &e) {
+                report("parse-error", 0, 0, path, e.what());
+                continue;
+            }
+            if (!script) {
+                report("unreadable", 0, 0, path, QString());
+                continue;
+            }
+            Profiler *profiler = nullptr;
+            if (profiling) {
+                profiler = new Profiler(profileMode);
+                profiler->setSourceName(QFileInfo(path).fileName());
+            }
+            script->setProfiler(profiler);
+            // Profiled runs also attribute their allocations to functions
+            script->setAllocationSiteTracking(profiler != nullptr);
+            script->setExecutionMode(mode);
+            ScriptRun *run = executor.submit(path, script, profiler, timeoutMs);
+            running++;
+            QObject::connect(run, &ScriptRun::completed, this, [this, run, path, script, profiler] {
+                static const char *const statuses[] = { "queued", "running", "ok", "failed", "cancelled", "timeout" };
+                if (profiler) {
+                    QScopedPointer<Profiler> finished(profiler);
+                    QString heapReport = script->heapReport();
+                    script->setProfiler(nullptr);
+                    script->setAllocationSiteTracking(false);
+                    if (run->getState() != ScriptRun::Cancelled) {
+                        writeProfile(path, *profiler, heapReport);
+                    }
+                }
+                report(statuses[run->getState()], run->getWallTimeNs(), run->getCpuTimeNs(), path, detail);
+                detail.clear();
+                cache.release(path, script);
+                running--;
+                submitNext();
+            });
+            QObject::connect(run, &ScriptRun::failed, this, [this](const QString &error) {
+                detail = error;
+            });
+        }
+        if (running == 0 && queue.isEmpty()) {
+            out << QString("%1 scripts, %2 failed, %3 ms wall, %4 ms cpu")
+                       .arg(finished).arg(failures)
+                       .arg(clock.elapsed())
+                       .arg(totalCpuNs / 1000000) << Qt::endl;
+            QCoreApplication::exit(failures == 0 ? 0 : 1);
+        }
+    }
+
+    void writeProfile(const QString &path, const Profiler &profiler, const QString &heapReport)
+    {
+        QFileInfo info(path);
+        QString base = info.absolutePath() + "/" + info.completeBaseName();
+        if (!profiler.writeCollapsedStacks(base + ".collapsed")) {
+            qWarning() << "Failed to write" << base + ".collapsed";
+        }
+        QFile file(base + ".profile");
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+            qWarning() << "Failed to write" << file.fileName();
+            return;
+        }
+        QTextStream stream(&file);
+        stream << profiler.report() << "\n\nHeap\n" << heapReport;
+    }
+
+    void report(const char *status, qint64 wallNs, qint64 cpuNs, const QString &path, QString text)
+    {
+        finished++;
+        if (qstrcmp(status, "ok") != 0) {
+            failures++;
+        }
+        totalCpuNs += cpuNs;
+        // Keeps the output one line per script
+        text.replace('\t', ' ').replace('\n', ' ');
+        out << status << "\t"
+            << QString::number(wallNs / 1e6, 'f', 3) << "\t"
+            << QString::number(cpuNs / 1e6, 'f', 3) << "\t"
+            << path << "\t"
+            << text << Qt::endl;
+    }
+};
+
+// Files are taken as given; directories are searched recursively for
+// files matching filter, in name order
+QStringList collectScripts(const QStringList &arguments, const QString &filter)
+{
+    QStringList scripts;
+    for (const QString &argument : arguments) {
+        QFileInfo info(argument);
+        if (!info.isDir()) {
+            scripts << info.absoluteFilePath();
+            continue;
+        }
+        QStringList found;
+        QDirIterator it(info.absoluteFilePath(), QStringList() << filter, QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+            found << it.next();
+        }
+        found.sort();
+        scripts << found;
+    }
+    return scripts;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("batchrunner");
+    QTextStream out(stdout);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Runs PrismaticOutpost scripts in parallel without a display.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("paths", "Script files, or directories to search for scripts.", "paths...");
+    QCommandLineOption jobsOption({ "j", "jobs" }, "Number of scripts to run at once.", "count",
+                                  QString::number(QThread::idealThreadCount()));
+    QCommandLineOption timeoutOption({ "t", "timeout" }, "Interrupt scripts running longer than this.", "ms", "0");
+    QCommandLineOption databaseOption({ "d", "database" },
+                                      "Database to keep parsed scripts in between batches.", "file");
+    QCommandLineOption filterOption("filter", "File name pattern for directories.", "pattern", "*.scm");
+    QCommandLineOption treeOption("tree", "Use the tree-walking evaluator instead of bytecode.");
+    QCommandLineOption profileOption("profile",
+                                     "Profile each script, writing <name>.collapsed and <name>.profile next to it.",
+                                     "sampling|exact");
+    parser.addOptions({ jobsOption, timeoutOption, databaseOption, filterOption, treeOption, profileOption });
+    parser.process(app);
+
+    QString profileMode = parser.value(profileOption);
+    if (parser.isSet(profileOption) && profileMode != "sampling" && profileMode != "exact") {
+        qCritical() << "--profile must be sampling or exact, not" << profileMode;
+        return 2;
+    }
+
+    QStringList scripts = collectScripts(parser.positionalArguments(), parser.value(filterOption));
+    if (scripts.isEmpty()) {
+        parser.showHelp(1);
+    }
+
+    DatabaseManager database;
+    bool useDatabase = parser.isSet(databaseOption);
+    if (useDatabase && !database.openDatabase(parser.value(databaseOption))) {
+        qCritical() << "Failed to open database" << parser.value(databaseOption);
+        return 2;
+    }
+
+    BatchRunner runner(scripts, qMax(1, parser.value(jobsOption).toInt()), parser.value(timeoutOption).toInt(),
+                       parser.isSet(treeOption) ? Script::TreeWalking : Script::Bytecode, out);
+    if (useDatabase) {
+        runner.setDatabase(&database);
+    }
+    if (parser.isSet(profileOption)) {
+        runner.setProfileMode(profileMode == "exact" ? Profiler::Exact : Profiler::Sampling);
+    }
+    QMetaObject::invokeMethod(&runner, [&runner] { runner.start(); }, Qt::QueuedConnection);
+    return app.exec();
+}
@@ -0,0 +1,20 @@
+QT       += core sql
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = batchrunner
+
+include(../benchmarks/script.pri)
+
+SOURCES += \
+    $$PWD/../databasemanager.cpp \
+    $$PWD/../scriptcache.cpp \
+    $$PWD/../scriptexecutor.cpp \
+    batchrunner.cpp
+
+HEADERS += \
+    $$PWD/../databasemanager.h \
+    $$PWD/../scriptcache.h \
+    $$PWD/../scriptexecutor.h
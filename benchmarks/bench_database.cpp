@@ -0,0 +1,158 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// bench_database.cpp
+//
+// Measures the per-call cost of the DatabaseManager node store against the
+// same SQL prepared afresh on every call, which is how each call used to
+// work. Both run on one database holding the given number of keys (100000
+// by default), spread over a hundred parents; children and removes are
+// index range scans. Writes run inside a transaction so the figures are
+// not dominated by syncing to disk. A last pass reads through the node
+// cache.
+#include "databasemanager.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+namespace {
+
+const int Parents = 100;
+
+QString keyAt(qint64 i) {
+    return QString("bench.parent%1.key%2").arg(i % Parents).arg(i);
+}
+
+// The statements as they were issued before DatabaseManager kept them
+// prepared
+QVariant unpreparedGetValue(const QString &key) {
+    QSqlQuery query;
+    query.prepare("SELECT value FROM nodes WHERE key = :key");
+    query.bindValue(":key", key);
+    if (query.exec() && query.next()) {
+        return query.value(0);
+    }
+    return QVariant();
+}
+
+bool unpreparedSetValue(const QString &key, const QVariant &value) {
+    QSqlQuery query;
+    query.prepare("INSERT OR REPLACE INTO nodes (key, parent, value) "
+                  "VALUES (:key, :parent, :value)");
+    query.bindValue(":key", key);
+    query.bindValue(":parent", key.section('.', 0, -2));
+    query.bindValue(":value", value);
+    return query.exec();
+}
+
+bool unpreparedRemoveValue(const QString &key) {
+    QSqlQuery query;
+    query.prepare("DELETE FROM nodes WHERE key = :key "
+                  "OR (key >= :key_first AND key < :key_last)");
+    query.bindValue(":key", key);
+    query.bindValue(":key_first", key + '.');
+    query.bindValue(":key_last", key + '/');
+    return query.exec();
+}
+
+QStringList unpreparedGetChildKeys(const QString &parentKey) {
+    QStringList children;
+    QSqlQuery query;
+    query.prepare("SELECT key FROM nodes WHERE parent = :parent");
+    query.bindValue(":parent", parentKey);
+    if (query.exec()) {
+        while (query.next()) {
+            children << query.value(0).toString();
+        }
+    }
+    return children;
+}
+
+template <typename F>
+double nsPerOp(qint64 operations, F operation) {
+    QElapsedTimer timer;
+    timer.start();
+    for (qint64 i = 0; i < operations; ++i) {
+        operation(i);
+    }
+    return double(timer.nsecsElapsed()) / operations;
+}
+
+template <typename F>
+double nsPerWrite(qint64 operations, F operation) {
+    QSqlDatabase db = QSqlDatabase::database();
+    db.transaction();
+    double result = nsPerOp(operations, operation);
+    db.commit();
+    return result;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    qint64 keys = 100000;
+    if (argc > 1) {
+        keys = qMax(qint64(Parents), QString(argv[1]).toLongLong());
+    }
+    // Children and removes read or write a whole subtree, so they run fewer
+    // times
+    const qint64 scans = Parents;
+
+    QTemporaryDir dir;
+    DatabaseManager database;
+    if (!dir.isValid() || !database.openDatabase(dir.filePath("bench.db"))) {
+        return 1;
+    }
+
+    out << "operation\tpath\tns/op" << Qt::endl;
+    auto report = [&out](const char *operation, double unprepared, double prepared) {
+        out << operation << "\tunprepared\t" << unprepared << Qt::endl;
+        out << operation << "\tprepared\t" << prepared << Qt::endl;
+    };
+
+    // The unprepared pass fills the table and the prepared pass overwrites it,
+    // so both see the same number of rows
+    report("setValue",
+           nsPerWrite(keys, [](qint64 i) { unpreparedSetValue(keyAt(i), i); }),
+           nsPerWrite(keys, [&database](qint64 i) { database.setValue(keyAt(i), i); }));
+    report("getValue",
+           nsPerOp(keys, [](qint64 i) { unpreparedGetValue(keyAt(i)); }),
+           nsPerOp(keys, [&database](qint64 i) { database.getValue(keyAt(i)); }));
+    report("getChildKeys",
+           nsPerOp(scans, [](qint64 i) { unpreparedGetChildKeys(QString("bench.parent%1").arg(i)); }),
+           nsPerOp(scans, [&database](qint64 i) { database.getChildKeys(QString("bench.parent%1").arg(i)); }));
+    // Each pass removes different keys that have no children
+    report("removeValue",
+           nsPerWrite(scans, [](qint64 i) { unpreparedRemoveValue(keyAt(i)); }),
+           nsPerWrite(scans, [&database](qint64 i) { database.removeValue(keyAt(scans + i)); }));
+
+    // Reads again with the node cache on, after one pass has filled it
+    database.setCacheBudget(qint64(1) << 30);
+    nsPerOp(keys, [&database](qint64 i) { database.getValue(keyAt(i)); });
+    out << "getValue\tnode cache\t"
+        << nsPerOp(keys, [&database](qint64 i) { database.getValue(keyAt(i)); }) << Qt::endl;
+    NodeCache::Statistics statistics = database.getCacheStatistics();
+    out << "# node cache: " << statistics.hits << " hits, " << statistics.misses << " misses, "
+        << statistics.entries << " entries, " << statistics.bytes << " bytes" << Qt::endl;
+
+    database.closeDatabase();
+    return 0;
+}
@@ -0,0 +1,14 @@
+QT       += core sql
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = bench_database
+
+SOURCES += \
+    $$PWD/../databasemanager.cpp \
+    bench_database.cpp
+
+HEADERS += \
+    $$PWD/../databasemanager.h
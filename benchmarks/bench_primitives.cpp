@@ -0,0 +1,82 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// bench_primitives.cpp
+//
+// Compares calling a native primitive with calling a closure that does the
+// same work through the primitive. Each case runs inside the same tail loop,
+// and the cost of an empty loop is subtracted, so the figures are the cost
+// of the call alone.
+#include "script.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+static qint64 timeLoop(Script& script, const QString& loop, qint64 iterations) {
+    QElapsedTimer timer;
+    timer.start();
+    script.evaluate(QString("(%1 %2)").arg(loop).arg(iterations));
+    return timer.nsecsElapsed();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    qint64 iterations = 1000000;
+    if (argc > 1) {
+        iterations = QString(argv[1]).toLongLong();
+    }
+
+    const char* setup = R"(
+        (define add (lambda (a b) (+ a b)))
+        (define car-of (lambda (l) (car l)))
+        (define data (list 1 2 3))
+        (define empty-loop (lambda (n) (if (= n 0) 0 (empty-loop (- n 1)))))
+        (define primitive-add (lambda (n) (if (= n 0) 0 (begin (+ n 1) (primitive-add (- n 1))))))
+        (define closure-add (lambda (n) (if (= n 0) 0 (begin (add n 1) (closure-add (- n 1))))))
+        (define primitive-car (lambda (n) (if (= n 0) 0 (begin (car data) (primitive-car (- n 1))))))
+        (define closure-car (lambda (n) (if (= n 0) 0 (begin (car-of data) (closure-car (- n 1))))))
+    )";
+
+    struct Case {
+        const char* name;
+        const char* loop;
+    };
+    const Case cases[] = {
+        { "+ primitive", "primitive-add" },
+        { "+ closure", "closure-add" },
+        { "car primitive", "primitive-car" },
+        { "car closure", "closure-car" },
+    };
+
+    out << "mode\tcase\tns/call" << Qt::endl;
+    for (auto mode : { Script::Bytecode, Script::TreeWalking }) {
+        Script script;
+        script.setExecutionMode(mode);
+        script.evaluate(setup);
+
+        // Warm up, then measure the loop overhead that every case shares
+        timeLoop(script, "empty-loop", iterations);
+        qint64 baseline = timeLoop(script, "empty-loop", iterations);
+        for (const auto& c : cases) {
+            qint64 elapsed = timeLoop(script, c.loop, iterations);
+            out << (mode == Script::Bytecode ? "vm" : "tree") << "\t"
+                << c.name << "\t"
+                << double(elapsed - baseline) / iterations << Qt::endl;
+        }
+    }
+    return 0;
+}
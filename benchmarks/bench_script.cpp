@@ -0,0 +1,234 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// bench_script.cpp
+//
+// Runs classic Gabriel-style workloads and the class/new patterns through
+// the lexer, the parser and both execution modes, and prints the results as
+// JSON so runs from different releases can be compared. Each result gives
+// the time and heap allocations per operation; peak_rss_kib is the peak
+// resident size of the process when the result was taken. An optional
+// argument scales the number of operations.
+#include "script.h"
+#include "scriptlexer.h"
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+struct Workload {
+    const char* name;
+    // Evaluated once per script; defines what run uses
+    const char* setup;
+    // One operation
+    const char* run;
+    const char* expected;
+    int operations;
+};
+
+const Workload workloads[] = {
+    { "fib",
+      "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))",
+      "(fib 20)", "6765", 10 },
+    { "tak",
+      "(define tak (lambda (x y z) (if (not (< y x)) z"
+      "  (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)))))",
+      "(tak 18 12 6)", "7", 10 },
+    { "nqueens",
+      "(define queens-ok? (lambda (row dist placed)"
+      "  (cond ((null? placed) #t)"
+      "        ((= (car placed) (+ row dist)) #f)"
+      "        ((= (car placed) (- row dist)) #f)"
+      "        ((= (car placed) row) #f)"
+      "        (else (queens-ok? row (+ dist 1) (cdr placed))))))"
+      "(define queens-count (lambda (row n placed)"
+      "  (if (> row n) 0"
+      "      (+ (if (queens-ok? row 1 placed) (queens-place n (cons row placed)) 0)"
+      "         (queens-count (+ row 1) n placed)))))"
+      "(define queens-place (lambda (n placed)"
+      "  (if (= (length placed) n) 1 (queens-count 1 n placed))))",
+      "(queens-place 8 (quote ()))", "92", 5 },
+    { "deriv",
+      "(define deriv (lambda (e)"
+      "  (cond ((number? e) 0)"
+      "        ((symbol? e) (if (eq? e (quote x)) 1 0))"
+      "        ((eq? (car e) (quote +)) (cons (quote +) (deriv-all (cdr e))))"
+      "        ((eq? (car e) (quote *)) (list (quote *) e (cons (quote +) (deriv-terms (cdr e)))))"
+      "        (else (quote error)))))"
+      "(define deriv-all (lambda (es)"
+      "  (if (null? es) (quote ()) (cons (deriv (car es)) (deriv-all (cdr es))))))"
+      "(define deriv-terms (lambda (es)"
+      "  (if (null? es) (quote ())"
+      "      (cons (list (quote /) (deriv (car es)) (car es)) (deriv-terms (cdr es))))))"
+      "(define deriv-loop (lambda (n)"
+      "  (if (= n 0) #t"
+      "      (begin (deriv (quote (+ (* 3 x x) (* a x x) (* b x) 5))) (deriv-loop (- n 1))))))",
+      "(deriv-loop 1000)", "#t", 10 },
+    { "strings",
+      "(define build (lambda (n acc)"
+      "  (if (= n 0) acc (build (- n 1) (string-append acc (number->string n))))))",
+      "(string-length (build 2000 \"\"))", "6893", 10 },
+    { "closures",
+      "(define make-adder (lambda (n) (lambda (x) (+ x n))))"
+      "(define compose (lambda (f g) (lambda (x) (f (g x)))))"
+      "(define closure-loop (lambda (n acc)"
+      "  (if (= n 0) acc (closure-loop (- n 1) ((compose (make-adder n) (make-adder 1)) acc)))))",
+      "(closure-loop 20000 0)", "200030000", 10 },
+    { "objects",
+      "(define Point (class"
+      "  init (lambda (self x y) (begin (slot-set! self (quote x) x) (slot-set! self (quote y) y) self))"
+      "  sum (lambda (self) (+ (slot-ref self (quote x)) (slot-ref self (quote y))))))"
+      "(define point-loop (lambda (n acc)"
+      "  (if (= n 0) acc (point-loop (- n 1) (+ acc (((new Point) init n 1) sum))))))",
+      "(point-loop 10000 0)", "50015000", 10 },
+};
+
+qint64 peakResidentKiB() {
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return -1;
+    }
+    return qint64(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+#if defined(Q_OS_MACOS)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Heap counters at the start of a measurement
+struct Sample {
+    QElapsedTimer timer;
+    qint64 allocations;
+    qint64 bytes;
+    qint64 collections;
+
+    explicit Sample(const Heap* heap)
+        : allocations(heap->getAllocationCount()),
+          bytes(heap->getBytesAllocated()),
+          collections(heap->getCollectionCount()) {
+        timer.start();
+    }
+
+    QJsonObject result(const QString& name, const QString& phase, const Heap* heap, qint64 operations) const {
+        qint64 elapsed = timer.nsecsElapsed();
+        QJsonObject result;
+        result["name"] = name;
+        result["phase"] = phase;
+        result["operations"] = operations;
+        result["ns_per_op"] = double(elapsed) / operations;
+        result["allocations_per_op"] = double(heap->getAllocationCount() - allocations) / operations;
+        result["bytes_per_op"] = double(heap->getBytesAllocated() - bytes) / operations;
+        result["collections"] = heap->getCollectionCount() - collections;
+        result["peak_rss_kib"] = peakResidentKiB();
+        return result;
+    }
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    int scale = 1;
+    if (argc > 1) {
+        scale = qMax(1, QString(argv[1]).toInt());
+    }
+
+    QJsonArray results;
+
+    // The front end runs over every workload's source repeated
+    QString source;
+    for (const auto& workload : workloads) {
+        source += QString(workload.setup) + "\n" + workload.run + "\n";
+    }
+    source = source.repeated(50);
+    const int frontEndOperations = 20 * scale;
+    {
+        Script script;
+        Sample sample(script.getHeap());
+        qint64 tokens = 0;
+        for (int i = 0; i < frontEndOperations; ++i) {
+            Lexer lexer(source);
+            while (lexer.next().type != Token::End) {
+                tokens++;
+            }
+        }
+        QJsonObject result = sample.result("source", "lex", script.getHeap(), frontEndOperations);
+        result["tokens_per_op"] = double(tokens) / frontEndOperations;
+        results.append(result);
+    }
+    for (auto passes : { Optimizer::Passes(), Optimizer::Passes(Optimizer::AllPasses) }) {
+        Script script;
+        script.setOptimizerPasses(passes);
+        Sample sample(script.getHeap());
+        for (int i = 0; i < frontEndOperations; ++i) {
+            script.load(source);
+            script.getHeap()->collectIfNeeded();
+        }
+        QString phase = passes.testFlag(Optimizer::ConstantFolding) ? "parse+optimize" : "parse";
+        results.append(sample.result("source", phase, script.getHeap(), frontEndOperations));
+    }
+
+    for (const auto& workload : workloads) {
+        for (auto mode : { Script::Bytecode, Script::TreeWalking }) {
+            Script script;
+            script.setExecutionMode(mode);
+            script.evaluate(workload.setup);
+            // Warms up the compiled code and the inline caches
+            QString first = script.evaluate(workload.run).toString();
+            if (first != workload.expected) {
+                qCritical() << workload.name << "returned" << first << "instead of" << workload.expected;
+                return 1;
+            }
+            int operations = workload.operations * scale;
+            Sample sample(script.getHeap());
+            for (int i = 0; i < operations; ++i) {
+                script.evaluate(workload.run);
+            }
+            results.append(sample.result(workload.name, mode == Script::Bytecode ? "vm" : "tree",
+                                         script.getHeap(), operations));
+        }
+    }
+
+    QJsonObject report;
+    report["benchmark"] = "bench_script";
+    report["qt"] = qVersion();
+    report["scale"] = scale;
+    report["results"] = results;
+    report["peak_rss_kib"] = peakResidentKiB();
+    out << QJsonDocument(report).toJson(QJsonDocument::Indented);
+    return 0;
+}
@@ -0,0 +1,15 @@
+QT       += core
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = bench_script
+
+include(script.pri)
+
+SOURCES += \
+    bench_script.cpp
+
+# Peak working set size on Windows
+win32: LIBS += -lpsapi
@@ -0,0 +1,60 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// bench_tailcall.cpp
+//
+// Runs a counting loop written as tail recursion at increasing iteration
+// counts, in both execution modes. Time per iteration and heap size should
+// stay flat as the count grows, and the largest run must complete without
+// exhausting the C++ stack.
+#include "script.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    qint64 maxIterations = 1000000;
+    if (argc > 1) {
+        maxIterations = QString(argv[1]).toLongLong();
+    }
+
+    out << "mode\titerations\tms\tns/iteration\theap KiB" << Qt::endl;
+    for (auto mode : { Script::Bytecode, Script::TreeWalking }) {
+        Script script;
+        script.setExecutionMode(mode);
+        script.evaluate("(define count (lambda (n acc) (if (= n 0) acc (count (- n 1) (+ acc 1)))))");
+
+        for (qint64 iterations = 1000; iterations <= maxIterations; iterations *= 10) {
+            QElapsedTimer timer;
+            timer.start();
+            Value result = script.evaluate(QString("(count %1 0)").arg(iterations));
+            qint64 elapsed = timer.nsecsElapsed();
+
+            if (!result.isFixnum() || result.asFixnum() != iterations) {
+                qCritical() << "Tail loop returned" << result.toString() << "instead of" << iterations;
+                return 1;
+            }
+            out << (mode == Script::Bytecode ? "vm" : "tree") << "\t"
+                << iterations << "\t"
+                << elapsed / 1000000.0 << "\t"
+                << double(elapsed) / iterations << "\t"
+                << script.getHeap()->getBytesInUse() / 1024 << Qt::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,12 @@
+QT       += core
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = bench_tailcall
+
+include(script.pri)
+
+SOURCES += \
+    bench_tailcall.cpp
@@ -0,0 +1,123 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// bench_vectors.cpp
+//
+// Measures the homogeneous vector kernels. The first table runs each kernel
+// directly at every SIMD level the CPU supports; the second compares a dot
+// product written over lists in the script language with f64vector-dot.
+#include "script.h"
+#include "scriptsimd.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QVector>
+#include <functional>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    qsizetype length = 1000000;
+    if (argc > 1) {
+        length = QString(argv[1]).toLongLong();
+    }
+    const int repeats = 20;
+
+    QVector<double> a(length), b(length), f64Result(length);
+    QVector<qint32> x(length), y(length), s32Result(length);
+    for (qsizetype i = 0; i < length; ++i) {
+        a[i] = double(i % 1000) * 0.25;
+        b[i] = double(i % 7) - 3.0;
+        x[i] = qint32(i % 1000);
+        y[i] = qint32(i % 7) - 3;
+    }
+
+    struct Kernel {
+        const char* name;
+        std::function<void()> run;
+    };
+    volatile double sink = 0;
+    const Kernel kernels[] = {
+        { "f64 add", [&] { Simd::binaryF64(Simd::BinaryOp::Add, a.data(), b.data(), f64Result.data(), length); } },
+        { "f64 mul", [&] { Simd::binaryF64(Simd::BinaryOp::Multiply, a.data(), b.data(), f64Result.data(), length); } },
+        { "f64 sum", [&] { sink = Simd::reduceF64(Simd::ReduceOp::Sum, a.data(), length); } },
+        { "f64 max", [&] { sink = Simd::reduceF64(Simd::ReduceOp::Max, a.data(), length); } },
+        { "f64 dot", [&] { sink = Simd::dotF64(a.data(), b.data(), length); } },
+        { "f64 <", [&] { Simd::compareF64(Simd::CompareOp::Less, a.data(), b.data(), s32Result.data(), length); } },
+        { "s32 add", [&] { Simd::binaryS32(Simd::BinaryOp::Add, x.data(), y.data(), s32Result.data(), length); } },
+        { "s32 mul", [&] { Simd::binaryS32(Simd::BinaryOp::Multiply, x.data(), y.data(), s32Result.data(), length); } },
+        { "s32 sum", [&] { sink = Simd::reduceS32(Simd::ReduceOp::Sum, x.data(), length); } },
+        { "s32 dot", [&] { sink = Simd::dotS32(x.data(), y.data(), length); } },
+    };
+
+    const Simd::Level supported = Simd::level();
+    out << "level\tkernel\tns/element" << Qt::endl;
+    for (auto level : { Simd::Level::Scalar, Simd::Level::Sse2, Simd::Level::Avx2 }) {
+        if (level > supported) {
+            break;
+        }
+        Simd::setLevel(level);
+        for (const auto& kernel : kernels) {
+            kernel.run();
+            QElapsedTimer timer;
+            timer.start();
+            for (int r = 0; r < repeats; ++r) {
+                kernel.run();
+            }
+            out << Simd::levelName(level) << "\t" << kernel.name << "\t"
+                << double(timer.nsecsElapsed()) / (double(repeats) * length) << Qt::endl;
+        }
+    }
+    Simd::setLevel(supported);
+
+    // The script comparison uses a smaller array, since the list version
+    // boxes every element in a Value and walks it one call per element
+    const qsizetype scriptLength = qMin<qsizetype>(length, 100000);
+    const char* setup = R"(
+        (define fill (lambda (v i n) (if (= i n) v (begin (f64vector-set! v i (* i 0.25)) (fill v (+ i 1) n)))))
+        (define list-dot (lambda (a b i n acc)
+            (if (= i n) acc (list-dot a b (+ i 1) n (+ acc (* (list-ref a i) (list-ref b i)))))))
+    )";
+
+    out << Qt::endl << "mode\tcase\tns/element" << Qt::endl;
+    for (auto mode : { Script::Bytecode, Script::TreeWalking }) {
+        Script script;
+        script.setExecutionMode(mode);
+        script.evaluate(setup);
+        script.evaluate(QString("(define va (fill (make-f64vector %1) 0 %1))").arg(scriptLength));
+        script.evaluate("(define la (f64vector->list va))");
+
+        struct Case {
+            const char* name;
+            const char* expression;
+        };
+        const Case cases[] = {
+            { "list dot", "(list-dot la la 0 (length la) 0)" },
+            { "f64vector-dot", "(f64vector-dot va va)" },
+        };
+        for (const auto& c : cases) {
+            script.evaluate(c.expression);
+            QElapsedTimer timer;
+            timer.start();
+            for (int r = 0; r < repeats; ++r) {
+                script.evaluate(c.expression);
+            }
+            out << (mode == Script::Bytecode ? "vm" : "tree") << "\t" << c.name << "\t"
+                << double(timer.nsecsElapsed()) / (double(repeats) * scriptLength) << Qt::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+# Script interpreter sources shared by the benchmark programs and the batch runner
+INCLUDEPATH += $$PWD/..
+
+SOURCES += \
+    $$PWD/../script.cpp \
+    $$PWD/../scriptactor.cpp \
+    $$PWD/../scriptcompiler.cpp \
+    $$PWD/../scriptdatum.cpp \
+    $$PWD/../scripthashtable.cpp \
+    $$PWD/../scriptheap.cpp \
+    $$PWD/../scriptlexer.cpp \
+    $$PWD/../scriptoptimizer.cpp \
+    $$PWD/../scriptprimitives.cpp \
+    $$PWD/../scriptprofiler.cpp \
+    $$PWD/../scriptreader.cpp \
+    $$PWD/../scriptsimd.cpp \
+    $$PWD/../scriptvalue.cpp \
+    $$PWD/../scriptvector.cpp \
+    $$PWD/../scriptvm.cpp
+
+HEADERS += \
+    $$PWD/../script.h \
+    $$PWD/../scriptactor.h \
+    $$PWD/../scriptcompiler.h \
+    $$PWD/../scriptdatum.h \
+    $$PWD/../scripthashtable.h \
+    $$PWD/../scriptheap.h \
+    $$PWD/../scriptlexer.h \
+    $$PWD/../scriptoptimizer.h \
+    $$PWD/../scriptprimitives.h \
+    $$PWD/../scriptprofiler.h \
+    $$PWD/../scriptreader.h \
+    $$PWD/../scriptsimd.h \
+    $$PWD/../scriptvalue.h \
+    $$PWD/../scriptvector.h \
+    $$PWD/../scriptvm.h
@@ -14,12 +14,28 @@
  */
 // databasemanager.cpp
 #include "databasemanager.h"
-#include <QSqlQuery>
 #include <QSqlError>
 #include <QDebug>
 
+// Schema migrations in order. A database records the number it has applied
+// as its user_version, and opening it applies the rest. Released migrations
+// must never change; changes to the schema go in a new one.
+static const char *const migrations[] = {
+    // 1: the node table
+    "CREATE TABLE IF NOT EXISTS nodes "
+    "(key TEXT PRIMARY KEY, parent TEXT, value BLOB)",
+    // 2: getChildKeys looks children up by parent
+    "CREATE INDEX IF NOT EXISTS nodes_parent ON nodes (parent)",
+};
+
+// How long queued writes wait for more to join them before being committed
+static const int DefaultWriteBehindDelay = 250;
+
 DatabaseManager::DatabaseManager(QObject *parent) : QObject(parent)
 {
+    flushTimer.setSingleShot(true);
+    flushTimer.setInterval(DefaultWriteBehindDelay);
+    connect(&flushTimer, &QTimer::timeout, this, &DatabaseManager::flush);
 }
 
 DatabaseManager::~DatabaseManager()
@@ -29,6 +45,7 @@ DatabaseManager::~DatabaseManager()
 
 bool DatabaseManager::openDatabase(const QString &path)
 {
+    releaseStatements();
     db = QSqlDatabase::addDatabase("QSQLITE");
     db.setDatabaseName(path);
 
@@ -37,68 +54,538 @@ bool DatabaseManager::openDatabase(const QString &path)
         return false;
     }
 
-    return initTables();
+    // Readers no longer block the writer, and a commit appends to the log
+    // instead of rewriting pages in place
+    QSqlQuery journalMode(db);
+    if (!journalMode.exec("PRAGMA journal_mode=WAL") || !journalMode.next()
+        || journalMode.value(0).toString().compare("wal", Qt::CaseInsensitive) != 0) {
+        qDebug() << "Warning: database is not in WAL mode";
+    }
+    journalMode.finish();
+    setSynchronous(Synchronous::Normal);
+
+    return migrateSchema() && prepareStatements();
 }
 
 void DatabaseManager::closeDatabase()
 {
+    if (db.isOpen()) {
+        flush();
+        if (transactionDepth > 0) {
+            rollbackConnection();
+        }
+    }
+    flushTimer.stop();
+    cache.clear();
+    pendingValues.clear();
+    pendingRemoves.clear();
+    transactionDepth = 0;
+    releaseStatements();
     db.close();
 }
 
-bool DatabaseManager::initTables()
+bool DatabaseManager::setSynchronous(Synchronous level)
 {
-    QSqlQuery query;
-    return query.exec("CREATE TABLE IF NOT EXISTS nodes "
-                      "(key TEXT PRIMARY KEY, parent TEXT, value BLOB)");
+    const char *name = level == Synchronous::Off ? "OFF"
+                       : level == Synchronous::Normal ? "NORMAL"
+                                                      : "FULL";
+    QSqlQuery query(db);
+    if (!query.exec(QString("PRAGMA synchronous=%1").arg(name))) {
+        qDebug() << "Error: setting synchronous mode failed:" << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool DatabaseManager::migrateSchema()
+{
+    QSqlQuery query(db);
+    if (!query.exec("PRAGMA user_version") || !query.next()) {
+        qDebug() << "Error: reading schema version failed:" << query.lastError().text();
+        return false;
+    }
+    const int current = query.value(0).toInt();
+    query.finish();
+
+    const int latest = int(sizeof(migrations) / sizeof(migrations[0]));
+    if (current > latest) {
+        qDebug() << "Error: database schema version" << current << "is newer than the supported" << latest;
+        return false;
+    }
+
+    // Each migration commits together with its version number, so a
+    // failure leaves the database at the last one that succeeded
+    for (int version = current + 1; version <= latest; ++version) {
+        if (!db.transaction()) {
+            qDebug() << "Error: starting migration failed:" << db.lastError().text();
+            return false;
+        }
+        if (!query.exec(migrations[version - 1])
+            || !query.exec(QString("PRAGMA user_version=%1").arg(version))
+            || !db.commit()) {
+            qDebug() << "Error: schema migration" << version << "failed:" << query.lastError().text();
+            db.rollback();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool DatabaseManager::prepareStatements()
+{
+    selectValueQuery = QSqlQuery(db);
+    replaceValueQuery = QSqlQuery(db);
+    removeValueQuery = QSqlQuery(db);
+    childKeysQuery = QSqlQuery(db);
+    subtreeQuery = QSqlQuery(db);
+
+    if (!selectValueQuery.prepare("SELECT value FROM nodes WHERE key = :key")
+        || !replaceValueQuery.prepare("INSERT OR REPLACE INTO nodes (key, parent, value) "
+                                      "VALUES (:key, :parent, :value)")
+        || !removeValueQuery.prepare("DELETE FROM nodes WHERE key = :key "
+                                     "OR (key >= :key_first AND key < :key_last)")
+        || !childKeysQuery.prepare("SELECT key FROM nodes WHERE parent = :parent")
+        || !subtreeQuery.prepare("SELECT key, parent, value FROM nodes WHERE key = :key "
+                                 "OR (key >= :key_first AND key < :key_last) ORDER BY rowid")) {
+        qDebug() << "Error: preparing statements failed:" << db.lastError().text();
+        return false;
+    }
+
+    return true;
+}
+
+void DatabaseManager::releaseStatements()
+{
+    // A connection cannot be closed while statements are still open on it
+    selectValueQuery = QSqlQuery();
+    replaceValueQuery = QSqlQuery();
+    removeValueQuery = QSqlQuery();
+    childKeysQuery = QSqlQuery();
+    subtreeQuery = QSqlQuery();
 }
 
 QVariant DatabaseManager::getValue(const QString &key)
 {
-    QSqlQuery query;
-    query.prepare("SELECT value FROM nodes WHERE key = :key");
-    query.bindValue(":key", key);
+    auto pending = pendingValues.constFind(key);
+    if (pending != pendingValues.constEnd()) {
+        return pending.value();
+    }
+    if (isPendingRemove(key)) {
+        return QVariant();
+    }
+
+    QVariant value;
+    if (cache.findValue(key, value)) {
+        return value;
+    }
+
+    selectValueQuery.bindValue(":key", key);
 
-    if (query.exec() && query.next()) {
-        return query.value(0);
+    if (selectValueQuery.exec()) {
+        if (selectValueQuery.next()) {
+            value = selectValueQuery.value(0);
+        }
+        cache.storeValue(key, value);
     }
 
-    return QVariant();
+    // Resets the statement, so it does not hold a read lock until the next call
+    selectValueQuery.finish();
+    return value;
 }
 
 bool DatabaseManager::setValue(const QString &key, const QVariant &value)
 {
-    QSqlQuery query;
-    query.prepare("INSERT OR REPLACE INTO nodes (key, parent, value) "
-                  "VALUES (:key, :parent, :value)");
-    query.bindValue(":key", key);
-    query.bindValue(":parent", key.section('.', 0, -2));
-    query.bindValue(":value", value);
-
-    return query.exec();
+    flush();
+    return writeValue(key, value);
 }
 
 bool DatabaseManager::removeValue(const QString &key)
 {
-    QSqlQuery query;
-    query.prepare("DELETE FROM nodes WHERE key = :key OR key LIKE :key_prefix");
-    query.bindValue(":key", key);
-    query.bindValue(":key_prefix", key + ".%");
+    flush();
+    return deleteValue(key);
+}
 
-    return query.exec();
+bool DatabaseManager::writeValue(const QString &key, const QVariant &value)
+{
+    replaceValueQuery.bindValue(":key", key);
+    replaceValueQuery.bindValue(":parent", key.section('.', 0, -2));
+    replaceValueQuery.bindValue(":value", value);
+
+    if (!replaceValueQuery.exec()) {
+        return false;
+    }
+    cache.valueWritten(key, value);
+    return true;
+}
+
+bool DatabaseManager::deleteValue(const QString &key)
+{
+    // The subtree is every key from "key." up to but excluding "key/", the
+    // next character after '.', which the primary key index finds as a range
+    removeValueQuery.bindValue(":key", key);
+    removeValueQuery.bindValue(":key_first", key + '.');
+    removeValueQuery.bindValue(":key_last", key + '/');
+
+    if (!removeValueQuery.exec()) {
+        return false;
+    }
+    cache.subtreeRemoved(key);
+    return true;
 }
 
 QStringList DatabaseManager::getChildKeys(const QString &parentKey)
 {
+    flush();
+
     QStringList children;
-    QSqlQuery query;
-    query.prepare("SELECT key FROM nodes WHERE parent = :parent");
-    query.bindValue(":parent", parentKey);
+    if (cache.findChildKeys(parentKey, children)) {
+        return children;
+    }
 
-    if (query.exec()) {
-        while (query.next()) {
-            children << query.value(0).toString();
+    childKeysQuery.bindValue(":parent", parentKey);
+
+    if (childKeysQuery.exec()) {
+        while (childKeysQuery.next()) {
+            children << childKeysQuery.value(0).toString();
         }
+        cache.storeChildKeys(parentKey, children);
     }
 
+    childKeysQuery.finish();
     return children;
 }
+
+DatabaseSubtree DatabaseManager::getSubtree(const QString &key)
+{
+    flush();
+
+    DatabaseSubtree subtree;
+    subtreeQuery.bindValue(":key", key);
+    subtreeQuery.bindValue(":key_first", key + '.');
+    subtreeQuery.bindValue(":key_last", key + '/');
+
+    // Rows come in the order they were written, which keeps children in
+    // the order getChildKeys() gives them
+    if (subtreeQuery.exec()) {
+        while (subtreeQuery.next()) {
+            const QString childKey = subtreeQuery.value(0).toString();
+            subtree.nodes[childKey].value = subtreeQuery.value(2);
+            if (childKey != key) {
+                subtree.nodes[subtreeQuery.value(1).toString()].childKeys << childKey;
+            }
+        }
+    }
+
+    subtreeQuery.finish();
+    return subtree;
+}
+
+bool DatabaseManager::transaction()
+{
+    if (transactionDepth++ > 0) {
+        return true;
+    }
+    rollbackRequested = false;
+    if (!db.transaction()) {
+        qDebug() << "Error: starting transaction failed:" << db.lastError().text();
+        transactionDepth = 0;
+        return false;
+    }
+    return true;
+}
+
+bool DatabaseManager::commit()
+{
+    if (transactionDepth == 0) {
+        return false;
+    }
+    if (--transactionDepth > 0) {
+        return !rollbackRequested;
+    }
+    if (rollbackRequested) {
+        rollbackConnection();
+        return false;
+    }
+    if (!db.commit()) {
+        qDebug() << "Error: committing transaction failed:" << db.lastError().text();
+        rollbackConnection();
+        return false;
+    }
+    return true;
+}
+
+void DatabaseManager::rollback()
+{
+    if (transactionDepth == 0) {
+        return;
+    }
+    if (--transactionDepth > 0) {
+        rollbackRequested = true;
+        return;
+    }
+    rollbackConnection();
+}
+
+void DatabaseManager::rollbackConnection()
+{
+    // The cache has already seen the writes being undone
+    db.rollback();
+    cache.clear();
+}
+
+void DatabaseManager::queueValue(const QString &key, const QVariant &value)
+{
+    pendingValues.insert(key, value);
+    scheduleFlush();
+}
+
+void DatabaseManager::queueRemove(const QString &key)
+{
+    // Values queued for the key or below it would be deleted anyway
+    const QString prefix = key + '.';
+    auto it = pendingValues.lowerBound(prefix);
+    while (it != pendingValues.end() && it.key().startsWith(prefix)) {
+        it = pendingValues.erase(it);
+    }
+    pendingValues.remove(key);
+    pendingRemoves.insert(key);
+    scheduleFlush();
+}
+
+void DatabaseManager::scheduleFlush()
+{
+    if (pendingValues.size() + pendingRemoves.size() >= MaxPendingWrites) {
+        flush();
+    }
+    else if (!flushTimer.isActive()) {
+        // Not restarted by later writes, so a steady stream of them is
+        // still committed every delay
+        flushTimer.start();
+    }
+}
+
+bool DatabaseManager::flush()
+{
+    flushTimer.stop();
+    if (pendingValues.isEmpty() && pendingRemoves.isEmpty()) {
+        return true;
+    }
+
+    const QSet<QString> removes = pendingRemoves;
+    const QMap<QString, QVariant> values = pendingValues;
+    pendingRemoves.clear();
+    pendingValues.clear();
+
+    bool ok = transaction();
+    for (const QString &key : removes) {
+        ok = ok && deleteValue(key);
+    }
+    for (auto it = values.constBegin(); ok && it != values.constEnd(); ++it) {
+        ok = writeValue(it.key(), it.value());
+    }
+    if (!ok) {
+        qDebug() << "Error: writing queued changes failed:" << db.lastError().text();
+        rollback();
+        return false;
+    }
+    return commit();
+}
+
+bool DatabaseManager::isPendingRemove(const QString &key) const
+{
+    if (pendingRemoves.isEmpty()) {
+        return false;
+    }
+    // A remove covers the key and everything below it
+    QString prefix = key;
+    for (;;) {
+        if (pendingRemoves.contains(prefix)) {
+            return true;
+        }
+        int dot = prefix.lastIndexOf('.');
+        if (dot < 0) {
+            return false;
+        }
+        prefix.truncate(dot);
+    }
+}
+
+void NodeCache::setBudget(qint64 bytes)
+{
+    budget = qMax(qint64(0), bytes);
+    if (budget == 0) {
+        clear();
+    }
+    else {
+        evict();
+    }
+}
+
+bool NodeCache::findValue(const QString &key, QVariant &value)
+{
+    if (!isEnabled()) {
+        return false;
+    }
+    auto it = entries.find(key);
+    if (it == entries.end() || !it->hasValue) {
+        statistics.misses++;
+        return false;
+    }
+    statistics.hits++;
+    recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, it->use);
+    value = it->value;
+    return true;
+}
+
+bool NodeCache::findChildKeys(const QString &key, QStringList &childKeys)
+{
+    if (!isEnabled()) {
+        return false;
+    }
+    auto it = entries.find(key);
+    if (it == entries.end() || !it->hasChildKeys) {
+        statistics.misses++;
+        return false;
+    }
+    statistics.hits++;
+    recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, it->use);
+    childKeys = it->childKeys;
+    return true;
+}
+
+void NodeCache::storeValue(const QString &key, const QVariant &value)
+{
+    if (!isEnabled()) {
+        return;
+    }
+    auto it = touch(key);
+    it->value = value;
+    it->hasValue = true;
+    account(it);
+    evict();
+}
+
+void NodeCache::storeChildKeys(const QString &key, const QStringList &childKeys)
+{
+    if (!isEnabled()) {
+        return;
+    }
+    auto it = touch(key);
+    it->childKeys = childKeys;
+    it->hasChildKeys = true;
+    account(it);
+    evict();
+}
+
+void NodeCache::valueWritten(const QString &key, const QVariant &value)
+{
+    if (!isEnabled()) {
+        return;
+    }
+    // A replaced row is written again at the end of the table, so the key
+    // moves to the end of its parent's children like it does in the store
+    auto parent = entries.find(key.section('.', 0, -2));
+    if (parent != entries.end() && parent->hasChildKeys) {
+        parent->childKeys.removeOne(key);
+        parent->childKeys << key;
+        account(parent);
+    }
+    storeValue(key, value);
+}
+
+void NodeCache::subtreeRemoved(const QString &key)
+{
+    if (!isEnabled()) {
+        return;
+    }
+    const QString prefix = key + '.';
+    auto it = entries.lowerBound(prefix);
+    while (it != entries.end() && it.key().startsWith(prefix)) {
+        auto next = it;
+        ++next;
+        erase(it);
+        it = next;
+    }
+    auto parent = entries.find(key.section('.', 0, -2));
+    if (parent != entries.end() && parent->hasChildKeys && parent->childKeys.removeOne(key)) {
+        account(parent);
+    }
+    // Now known to be absent, with no children
+    auto removed = touch(key);
+    removed->value = QVariant();
+    removed->hasValue = true;
+    removed->childKeys.clear();
+    removed->hasChildKeys = true;
+    account(removed);
+    evict();
+}
+
+void NodeCache::clear()
+{
+    entries.clear();
+    recentlyUsed.clear();
+    bytes = 0;
+}
+
+NodeCache::Statistics NodeCache::getStatistics() const
+{
+    Statistics result = statistics;
+    result.entries = entries.size();
+    result.bytes = bytes;
+    return result;
+}
+
+NodeCache::Iterator NodeCache::touch(const QString &key)
+{
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        recentlyUsed.push_front(key);
+        it = entries.insert(key, Entry());
+        it->use = recentlyUsed.begin();
+    }
+    else {
+        recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, it->use);
+    }
+    return it;
+}
+
+// Estimates the memory an entry holds: the key, its copy in the use list,
+// the value and the child keys, plus a fixed overhead for the nodes
+void NodeCache::account(Iterator it)
+{
+    static const qint64 entryOverhead = 128;
+    qint64 size = entryOverhead + it.key().size() * 2 * qint64(sizeof(QChar));
+    const QVariant &value = it->value;
+    if (value.userType() == QMetaType::QString) {
+        size += value.toString().size() * qint64(sizeof(QChar));
+    }
+    else if (value.userType() == QMetaType::QByteArray) {
+        size += value.toByteArray().size();
+    }
+    else if (value.userType() == QMetaType::QStringList) {
+        for (const QString &item : value.toStringList()) {
+            size += qint64(sizeof(QString)) + item.size() * qint64(sizeof(QChar));
+        }
+    }
+    for (const QString &childKey : it->childKeys) {
+        size += qint64(sizeof(QString)) + childKey.size() * qint64(sizeof(QChar));
+    }
+    bytes += size - it->size;
+    it->size = size;
+}
+
+void NodeCache::erase(Iterator it)
+{
+    bytes -= it->size;
+    recentlyUsed.erase(it->use);
+    entries.erase(it);
+}
+
+void NodeCache::evict()
+{
+    while (bytes > budget && !recentlyUsed.empty()) {
+        erase(entries.find(recentlyUsed.back()));
+        statistics.evictions++;
+    }
+}
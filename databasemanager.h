@@ -18,26 +18,144 @@
 
 #include <QObject>
 #include <QSqlDatabase>
+#include <QSqlQuery>
 #include <QVariant>
 #include <QFileInfo>
 #include <QDir>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QTimer>
+
+#include <list>
+
+// Everything stored under one key, read by DatabaseManager::getSubtree() in
+// a single query. Answers getValue() and getChildKeys() for keys inside it
+// the way DatabaseManager would, without going back to the database.
+class DatabaseSubtree
+{
+public:
+    QVariant getValue(const QString &key) const { return nodes.value(key).value; }
+    QStringList getChildKeys(const QString &parentKey) const { return nodes.value(parentKey).childKeys; }
+    bool isEmpty() const { return nodes.isEmpty(); }
+
+private:
+    friend class DatabaseManager;
+
+    // Keys without a row of their own still get a node if they have children
+    struct Node {
+        QVariant value;
+        QStringList childKeys;
+    };
+    QHash<QString, Node> nodes;
+};
+
+// In-memory mirror of the parts of the node store that have been read,
+// keyed like the store itself: each cached key can hold its value, including
+// the fact that it has none, and its list of child keys. DatabaseManager
+// writes through it, so it stays exact as long as its connection is the
+// only writer. Entries beyond the memory budget are evicted least recently
+// used first.
+class NodeCache
+{
+public:
+    struct Statistics {
+        qint64 hits = 0;
+        qint64 misses = 0;
+        qint64 evictions = 0;
+        qint64 entries = 0;
+        qint64 bytes = 0;
+    };
+
+    // A budget of 0 turns the cache off and empties it
+    void setBudget(qint64 bytes);
+    bool isEnabled() const { return budget > 0; }
+
+    // Return true and fill in the result when it is cached
+    bool findValue(const QString &key, QVariant &value);
+    bool findChildKeys(const QString &key, QStringList &childKeys);
+    // Remember what a read from the database returned
+    void storeValue(const QString &key, const QVariant &value);
+    void storeChildKeys(const QString &key, const QStringList &childKeys);
+    // Mirror a write that reached the database
+    void valueWritten(const QString &key, const QVariant &value);
+    void subtreeRemoved(const QString &key);
+    void clear();
+
+    Statistics getStatistics() const;
+
+private:
+    struct Entry {
+        QVariant value;
+        QStringList childKeys;
+        bool hasValue = false;
+        bool hasChildKeys = false;
+        qint64 size = 0;
+        std::list<QString>::iterator use;
+    };
+    using Iterator = QMap<QString, Entry>::iterator;
+
+    QMap<QString, Entry> entries;
+    // Most recently used first
+    std::list<QString> recentlyUsed;
+    qint64 budget = 0;
+    qint64 bytes = 0;
+    Statistics statistics;
+
+    Iterator touch(const QString &key);
+    void account(Iterator it);
+    void erase(Iterator it);
+    void evict();
+};
 
 class DatabaseManager : public QObject
 {
     Q_OBJECT
 
 public:
+    // How hard SQLite works to make each commit durable. The database runs
+    // in WAL mode, where Normal may lose the last commits on power loss but
+    // never corrupts the file, and skips the fsync on every commit.
+    enum class Synchronous { Off, Normal, Full };
+
+    // Queued writes are committed once this many are waiting, even if the
+    // write-behind delay has not passed yet
+    static const int MaxPendingWrites = 1000;
+
     explicit DatabaseManager(QObject *parent = nullptr);
     ~DatabaseManager();
 
     bool openDatabase(const QString &path);
     void closeDatabase();
+    bool setSynchronous(Synchronous level);
+    // Serves repeated reads from a NodeCache limited to bytes of memory;
+    // 0, the default, reads everything from the database
+    void setCacheBudget(qint64 bytes) { cache.setBudget(bytes); }
+    NodeCache::Statistics getCacheStatistics() const { return cache.getStatistics(); }
 
     QVariant getValue(const QString &key);
     bool setValue(const QString &key, const QVariant &value);
     bool removeValue(const QString &key);
 
     QStringList getChildKeys(const QString &parentKey);
+    // The key and every key below it, in one index range scan
+    DatabaseSubtree getSubtree(const QString &key);
+
+    // Explicit transactions. They nest, and only the outermost commit()
+    // writes; a rollback() at any depth makes the outermost end roll back.
+    bool transaction();
+    bool commit();
+    void rollback();
+
+    // Write-behind queue. Queued writes to the same key coalesce, and the
+    // queue is committed as one transaction once the write-behind delay
+    // passes, MaxPendingWrites are waiting, or flush() is called. getValue()
+    // sees queued writes. getChildKeys() and the direct setValue() and
+    // removeValue() flush first, so they never read or overtake the queue.
+    void queueValue(const QString &key, const QVariant &value);
+    void queueRemove(const QString &key);
+    bool flush();
+    void setWriteBehindDelay(int milliseconds) { flushTimer.setInterval(milliseconds); }
 
     QString getDatabaseDirectory() const {
         return QFileInfo(db.databaseName()).dir().absolutePath();
@@ -46,7 +164,33 @@ public:
 private:
     QSqlDatabase db;
 
-    bool initTables();
+    // Prepared once per connection and rebound on every call, so SQLite
+    // does not parse and plan the SQL again for each key
+    QSqlQuery selectValueQuery;
+    QSqlQuery replaceValueQuery;
+    QSqlQuery removeValueQuery;
+    QSqlQuery childKeysQuery;
+    QSqlQuery subtreeQuery;
+
+    int transactionDepth = 0;
+    bool rollbackRequested = false;
+
+    // Removes are applied before values when the queue is flushed. A remove
+    // drops the values queued under it, so any value still queued was
+    // written after the removes that cover it.
+    QMap<QString, QVariant> pendingValues;
+    QSet<QString> pendingRemoves;
+    QTimer flushTimer;
+    NodeCache cache;
+
+    bool migrateSchema();
+    bool prepareStatements();
+    void releaseStatements();
+    void rollbackConnection();
+    bool isPendingRemove(const QString &key) const;
+    void scheduleFlush();
+    bool writeValue(const QString &key, const QVariant &value);
+    bool deleteValue(const QString &key);
 };
 
 #endif // DATABASEMANAGER_H
@@ -15,6 +15,8 @@
 // pristmaticoutpost.cpp
 #include "prismaticoutpost.h"
 #include "scripteditor.h"
+#include "script.h"
+#include "scriptprofiler.h"
 
 #include <QWindow>
 #include <QMdiSubWindow>
@@ -22,6 +24,10 @@
 #include <QScreen>
 #include <QGuiApplication>
 #include <QStringLiteral>
+#include <QFileInfo>
+#include <QFontDatabase>
+#include <QPlainTextEdit>
+#include <QStatusBar>
 
 PrismaticOutpost::PrismaticOutpost(QWidget *parent)
     : QMainWindow(parent)
@@ -33,6 +39,10 @@ PrismaticOutpost::PrismaticOutpost(QWidget *parent)
     if (!dbManager.openDatabase("prismaticoutpost.db")) {
         qDebug() << "Failed to open database";
     }
+    else {
+        dbManager.setCacheBudget(4 * 1024 * 1024);
+        scriptCache.setDatabase(&dbManager);
+    }
 
     loadConfiguration();
 
@@ -67,6 +77,10 @@ void PrismaticOutpost::createActions()
     QMenu *fileMenu = menuBar()->addMenu(tr("&File"));
     QAction *newToolWindowAction = fileMenu->addAction(tr("New Tool Window"));
     connect(newToolWindowAction, &QAction::triggered, this, &PrismaticOutpost::createNewToolWindow);
+
+    QMenu *scriptsMenu = menuBar()->addMenu(tr("&Scripts"));
+    QAction *cancelScriptsAction = scriptsMenu->addAction(tr("Cancel Running Scripts"));
+    connect(cancelScriptsAction, &QAction::triggered, &scriptExecutor, &ScriptExecutor::cancelAll);
 }
 
 void PrismaticOutpost::createNewToolWindow()
@@ -91,51 +105,52 @@ void PrismaticOutpost::createNewToolWindow()
             toolWindows[name] = toolWindow;
             connect(toolWindow, &ToolWindow::itemClicked, this, &PrismaticOutpost::executeScript);
             connect(toolWindow, &ToolWindow::editScriptRequested, this, &PrismaticOutpost::openScriptEditor);
+            connect(toolWindow, &ToolWindow::profileScriptRequested, this, &PrismaticOutpost::profileScript);
         }
     }
 }
 
 void PrismaticOutpost::saveConfiguration()
 {
-    // Save ToolWindows
+    // Writes go through the write-behind queue, so a burst of
+    // configurationChanged signals is committed once, in one transaction
     for (auto it = toolWindows.begin(); it != toolWindows.end(); ++it) {
         QString key = "toolwindows." + it.key();
-        dbManager.setValue(key, it.value()->getItemNames());
+        dbManager.queueValue(key, it.value()->getItemNames());
 
         // Save layout type
         QString layoutKey = key + ".layout";
-        dbManager.setValue(layoutKey, static_cast<int>(static_cast<ToolWindow*>(it.value())->getLayoutType()));
+        dbManager.queueValue(layoutKey, static_cast<int>(static_cast<ToolWindow*>(it.value())->getLayoutType()));
 
         // Save script paths
         QString itemsKey = key + ".items";
         for (const QString &itemName : it.value()->getRemovedItemNames()) {
             QString removedItemKey = itemsKey + "." + itemName;
-            dbManager.removeValue(removedItemKey);
+            dbManager.queueRemove(removedItemKey);
         }
 
         for (const QString &itemName : it.value()->getItemNames()) {
             QString itemKey = itemsKey + "." + itemName;
             QString scriptPath = it.value()->getScriptPath(itemName);
-            dbManager.setValue(itemKey, scriptPath);
+            dbManager.queueValue(itemKey, scriptPath);
         }
-
-
     }
 }
 
 void PrismaticOutpost::loadConfiguration()
 {
-    // Load ToolWindows
-    QStringList toolWindowKeys = dbManager.getChildKeys("toolwindows");
+    // Load ToolWindows, reading the whole configuration in one query
+    const DatabaseSubtree configuration = dbManager.getSubtree("toolwindows");
+    QStringList toolWindowKeys = configuration.getChildKeys("toolwindows");
     for (const QString &key : toolWindowKeys) {
         QString name = key.section('.', -1);
 
         // Load layout type
         QString layoutKey = "toolwindows." + name + ".layout";
-        ToolWindow::LayoutType layoutType = static_cast<ToolWindow::LayoutType>(dbManager.getValue(layoutKey).toInt());
+        ToolWindow::LayoutType layoutType = static_cast<ToolWindow::LayoutType>(configuration.getValue(layoutKey).toInt());
 
         QString scriptKey = "toolwindows." + name + ".items";
-        QStringList itemKeys = dbManager.getChildKeys(scriptKey).toVector();
+        QStringList itemKeys = configuration.getChildKeys(scriptKey);
 
         ToolWindow *toolWindow = new ToolWindow(name, layoutType, this);
         connect(toolWindow, &ToolWindow::configurationChanged, this, &PrismaticOutpost::saveConfiguration);
@@ -145,7 +160,7 @@ void PrismaticOutpost::loadConfiguration()
         for (const auto &itemKey : itemKeys) {
 
             // Key path for this specific button key
-            QString scriptPath = dbManager.getValue(itemKey).toString();
+            QString scriptPath = configuration.getValue(itemKey).toString();
 
             // Get the button label
             QString buttonLabel = itemKey.section('.', -1);
@@ -156,6 +171,7 @@ void PrismaticOutpost::loadConfiguration()
 
         connect(toolWindow, &ToolWindow::itemClicked, this, &PrismaticOutpost::executeScript);
         connect(toolWindow, &ToolWindow::editScriptRequested, this, &PrismaticOutpost::openScriptEditor);
+        connect(toolWindow, &ToolWindow::profileScriptRequested, this, &PrismaticOutpost::profileScript);
     }
 }
 
@@ -190,23 +206,112 @@ QString PrismaticOutpost::getScriptPath(const QString &itemName, ToolWindow *win
 
 void PrismaticOutpost::executeScript(const QString &itemName, const QString &scriptPath)
 {
-    if (scriptPath.isEmpty()) {
-        qDebug() << "No script associated with item:" << itemName;
+    startScript(itemName, scriptPath, nullptr);
+}
+
+void PrismaticOutpost::profileScript(const QString &itemName, const QString &scriptPath)
+{
+    QStringList modeOptions;
+    modeOptions << tr("Sampling") << tr("Exact call counts");
+    bool ok;
+    QString modeChoice = QInputDialog::getItem(this, tr("Profile Script"),
+                                               tr("Profiler mode:"), modeOptions, 0, false, &ok);
+    if (!ok || modeChoice.isEmpty()) {
         return;
     }
 
-    QFile file(scriptPath);
-    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-        qDebug() << "Failed to open script file:" << scriptPath;
+    QFileInfo scriptInfo(scriptPath);
+    Profiler *profiler = new Profiler(modeChoice == tr("Sampling") ? Profiler::Sampling : Profiler::Exact);
+    profiler->setSourceName(scriptInfo.fileName());
+    ScriptRun *run = startScript(itemName, scriptPath, profiler);
+    if (!run) {
+        delete profiler;
         return;
     }
+    connect(run, &ScriptRun::completed, this, [this, run, profiler, itemName, scriptInfo]() {
+        QScopedPointer<Profiler> finished(profiler);
+        QSharedPointer<Script> script = run->getScript();
+        QString heapReport = script->heapReport();
+        // The cached script outlives the profiler deleted with this scope
+        script->setProfiler(nullptr);
+        script->setAllocationSiteTracking(false);
+        if (run->getState() == ScriptRun::Cancelled) {
+            return;
+        }
+        showProfile(itemName, scriptInfo, *profiler, heapReport);
+    });
+}
+
+void PrismaticOutpost::showProfile(const QString &itemName, const QFileInfo &scriptInfo, Profiler &profiler,
+                                   const QString &heapReport)
+{
+    // Collapsed stacks go next to the script, for flamegraph.pl and friends
+    QString collapsedPath = scriptInfo.absolutePath() + "/" + scriptInfo.completeBaseName() + ".collapsed";
+    QString report = profiler.report();
+    if (profiler.writeCollapsedStacks(collapsedPath)) {
+        report += "\n" + tr("Collapsed stacks written to %1").arg(collapsedPath);
+    }
+    report += "\n\n" + tr("Heap") + "\n" + heapReport;
+
+    QPlainTextEdit *reportView = new QPlainTextEdit();
+    reportView->setReadOnly(true);
+    reportView->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    reportView->setPlainText(report);
+    QMdiSubWindow *subWindow = mdiArea->addSubWindow(reportView);
+    subWindow->setAttribute(Qt::WA_DeleteOnClose);
+    subWindow->setWindowTitle(tr("Profile: %1").arg(itemName));
+    subWindow->resize(600, 400);
+    subWindow->show();
+}
+
+ScriptRun *PrismaticOutpost::startScript(const QString &itemName, const QString &scriptPath, Profiler *profiler)
+{
+    if (scriptPath.isEmpty()) {
+        qDebug() << "No script associated with item:" << itemName;
+        return nullptr;
+    }
 
-    QString scriptContent = file.readAll();
-    file.close();
+    QSharedPointer<Script> script;
+    try {
+        script = scriptCache.acquire(scriptPath);
+    }
+    catch (const std::exception &e) {
+        qDebug() << "Script failed to parse:" << e.what();
+        return nullptr;
+    }
+    if (!script) {
+        qDebug() << "Failed to open script file:" << scriptPath;
+        return nullptr;
+    }
 
-    // TODO: Implement script execution logic here
-    // This could involve passing the script content to an interpreter
-    // or executing it in some other way depending on your requirements
     qDebug() << "Executing script for item:" << itemName;
-    qDebug() << "Script content:" << scriptContent;
+    script->setProfiler(profiler);
+    // Profiled runs also attribute their allocations to functions
+    script->setAllocationSiteTracking(profiler != nullptr);
+    ScriptRun *run = scriptExecutor.submit(itemName, script, profiler);
+    connect(run, &ScriptRun::progress, this, [this, itemName](int done, int total) {
+        statusBar()->showMessage(tr("Running %1: %2 of %3").arg(itemName).arg(done).arg(total));
+    });
+    connect(run, &ScriptRun::finished, this, [this, itemName](const QString &result) {
+        if (!result.isEmpty()) {
+            qDebug() << "Script result:" << result;
+        }
+        statusBar()->showMessage(tr("%1 finished").arg(itemName), 5000);
+    });
+    connect(run, &ScriptRun::failed, this, [this, itemName](const QString &error) {
+        qDebug() << "Script failed:" << error;
+        statusBar()->showMessage(tr("%1 failed: %2").arg(itemName, error), 5000);
+    });
+    connect(run, &ScriptRun::cancelled, this, [this, itemName]() {
+        statusBar()->showMessage(tr("%1 cancelled").arg(itemName), 5000);
+    });
+    connect(run, &ScriptRun::timedOut, this, [this, itemName]() {
+        statusBar()->showMessage(tr("%1 timed out").arg(itemName), 5000);
+    });
+    // Queued, so other completed handlers can still look at the script
+    // before another run checks it out
+    connect(run, &ScriptRun::completed, this, [this, scriptPath, script]() {
+        scriptCache.release(scriptPath, script);
+    }, Qt::QueuedConnection);
+    return run;
 }
@@ -24,8 +24,12 @@
 #include <QAction>
 #include "toolwindow.h"
 #include "databasemanager.h"
+#include "scriptcache.h"
+#include "scriptexecutor.h"
 
 class ScriptEditor;
+class Profiler;
+class QFileInfo;
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class PrismaticOutpost; }
@@ -43,6 +47,7 @@ private slots:
     void createNewToolWindow();
     void openScriptEditor(const QString &itemName, const QString &scriptPath);
     void executeScript(const QString &itemName, const QString &scriptPath);
+    void profileScript(const QString &itemName, const QString &scriptPath);
     void saveConfiguration();
     void loadConfiguration();
 
@@ -52,12 +57,18 @@ private:
     QMdiArea *mdiArea;
     QMap<QString, ToolWindow*> toolWindows;
     DatabaseManager dbManager;
+    ScriptCache scriptCache;
+    // Declared after the cache so running scripts are stopped first
+    ScriptExecutor scriptExecutor;
 
     void centerOnScreen();
     void setupMdiArea();
     void createActions();
     void setupDatabase();
     QString getScriptPath(const QString &itemName, ToolWindow *window);
+    void showProfile(const QString &itemName, const QFileInfo &scriptInfo, Profiler &profiler,
+                     const QString &heapReport);
+    ScriptRun *startScript(const QString &itemName, const QString &scriptPath, Profiler *profiler);
 };
 
 #endif // PRISMATICOUTPOST_H
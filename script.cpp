@@ -1,277 +1,779 @@
 #include "script.h"
+#include "scriptactor.h"
+#include "scriptcompiler.h"
+#include "scripthashtable.h"
+#include "scriptlexer.h"
+#include "scriptprimitives.h"
+#include "scriptprofiler.h"
+#include "scriptreader.h"
+#include "scriptvector.h"
+#include "scriptvm.h"
 #include <QDebug>
 #include <QTextStream>
 #include <QCoreApplication>
 #include <QtMath>
 
-Number::Number(double val) : value(val) {}
+Value makeList(const QVector<Value>& elements, int line) {
+    if (elements.isEmpty()) {
+        return Value::nil();
+    }
+    return Value(Heap::create<List>(elements, line));
+}
+
+static QString escapeString(const QString& str) {
+    QString result;
+    for (QChar c : str) {
+        switch (c.unicode()) {
+        case '"': result += "\\\""; break;
+        case '\\': result += "\\\\"; break;
+        case '\n': result += "\\n"; break;
+        case '\r': result += "\\r"; break;
+        case '\t': result += "\\t"; break;
+        default: result += c;
+        }
+    }
+    return result;
+}
+
+static QString unescapeString(QStringView text) {
+    QString result;
+    result.reserve(text.size());
+    for (qsizetype i = 0; i < text.size(); ++i) {
+        QChar c = text[i];
+        if (c == '\\' && i + 1 < text.size()) {
+            c = text[++i];
+            switch (c.unicode()) {
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            default: break;
+            }
+        }
+        result += c;
+    }
+    return result;
+}
+
+String* String::concatenate(const String* a, const String* b) {
+    if (a->length + b->length < RopeThreshold) {
+        return Heap::create<String>(a->getValue() + b->getValue());
+    }
+    // Appending a short piece to a rope whose last leaf is short merges the
+    // two, so building a string a few characters at a time still ends up
+    // with leaves of useful size
+    if (a->left && !a->right->left && a->right->length + b->length < RopeThreshold) {
+        const String* leaf = Heap::create<String>(a->right->value + b->getValue());
+        return Heap::create<String>(a->left, leaf);
+    }
+    return Heap::create<String>(a, b);
+}
+
+void String::flatten() const {
+    // Copy the leaves in order. Appending in a loop builds ropes as deep as
+    // the number of appends, so walk them with an explicit stack.
+    QString result;
+    result.reserve(length);
+    QVector<const String*> pending{right, left};
+    while (!pending.isEmpty()) {
+        const String* node = pending.takeLast();
+        if (node->left) {
+            pending.append(node->right);
+            pending.append(node->left);
+        }
+        else {
+            result += node->value;
+        }
+    }
+    value = result;
+    left = nullptr;
+    right = nullptr;
+}
+
+void String::trace(Heap& heap) const {
+    heap.mark(left);
+    heap.mark(right);
+}
+
+QString String::toString() const {
+    return "\"" + escapeString(getValue()) + "\"";
+}
+
+void Primitive::arityError(int argc) const {
+    QString expected = maxArgs == minArgs ? QString::number(minArgs)
+                       : maxArgs == Variadic ? QString("at least %1").arg(minArgs)
+                                             : QString("%1 to %2").arg(minArgs).arg(maxArgs);
+    qCritical() << "Incorrect number of arguments for" << name << "- expected" << expected << "got" << argc;
+    throw std::runtime_error(QString("Incorrect number of arguments for %1: expected %2, got %3")
+                                 .arg(name, expected).arg(argc).toStdString());
+}
+
+void List::trace(Heap& heap) const {
+    for (const auto& element : elements) {
+        heap.mark(element);
+    }
+}
 
 QString List::toString() const {
     QString result = "(";
     for (int i = 0; i < elements.size(); ++i) {
         if (i > 0) result += " ";
-        result += elements[i]->toString();
+        result += elements[i].toString();
     }
     return result + ")";
 }
 
-void Class::addMethod(const QString& name, QSharedPointer<Expression> method) {
-    methods[name] = method;
+Shape::Shape(Shape* p, int symbol) : parent(p) {
+    if (parent) {
+        names = parent->names;
+        slotIndex = parent->slotIndex;
+        slotIndex.insert(symbol, names.size());
+        names.append(symbol);
+    }
+}
+
+void Shape::trace(Heap& heap) const {
+    heap.mark(parent);
+    for (const Shape* next : transitions) {
+        heap.mark(next);
+    }
+}
+
+Shape* Shape::withSlot(int symbol) {
+    auto it = transitions.constFind(symbol);
+    if (it != transitions.constEnd()) {
+        return it.value();
+    }
+    Shape* next = Heap::create<Shape>(this, symbol);
+    transitions.insert(symbol, next);
+    return next;
+}
+
+void Class::addMethod(int symbol, const Value& method) {
+    methods[symbol] = method;
 }
 
 QString Class::toString() const {
     return "<class>";
 }
 
-QSharedPointer<Expression> Class::evaluate(QSharedPointer<Environment>) {
-    return QSharedPointer<Class>::create(*this);
+void Class::trace(Heap& heap) const {
+    heap.mark(rootShape);
+    for (const auto& method : methods) {
+        heap.mark(method);
+    }
 }
 
-QSharedPointer<Expression> Class::getMethod(const QString& name) const {
-    auto it = methods.find(name);
-    if (it != methods.end()) {
+Value Class::getMethod(int symbol) const {
+    auto it = methods.constFind(symbol);
+    if (it != methods.constEnd()) {
         return it.value();
     }
+    QString name = SymbolTable::name(symbol);
     qCritical() << "Method not found:" << name;
     throw std::runtime_error(QString("Method not found: %1").arg(name).toStdString());
 }
 
-QSharedPointer<Expression> Instance::getAttribute(const QString& name) const {
-    auto it = attributes.find(name);
-    if (it != attributes.end()) {
-        return it.value();
+void Instance::setAttribute(int symbol, const Value& value) {
+    int slot = shape->slotOf(symbol);
+    if (slot >= 0) {
+        slotValues[slot] = value;
+        return;
     }
-    return cls->getMethod(name);
+    shape = shape->withSlot(symbol);
+    slotValues.append(value);
 }
 
-void Environment::define(const QString& name, QSharedPointer<Expression> value) {
-    bindings[name] = value;
+Value Instance::lookup(int symbol) const {
+    int slot = shape->slotOf(symbol);
+    if (slot >= 0) {
+        return slotValues[slot];
+    }
+    return cls->getMethod(symbol);
 }
 
-QSharedPointer<Expression> Environment::lookup(const QString& name) const {
-    auto it = bindings.find(name);
-    if (it != bindings.end()) {
-        return it.value();
+void Instance::trace(Heap& heap) const {
+    heap.mark(cls);
+    heap.mark(shape);
+    for (const auto& value : slotValues) {
+        heap.mark(value);
     }
-    if (parent) {
-        return parent->lookup(name);
+}
+
+void Function::trace(Heap& heap) const {
+    heap.mark(body);
+    heap.mark(code);
+    heap.mark(closure);
+}
+
+void Environment::trace(Heap& heap) const {
+    for (const auto& value : values) {
+        heap.mark(value);
     }
-    qCritical() << "Undefined symbol:" << name;
-    throw std::runtime_error(QString("Undefined symbol: %1").arg(name).toStdString());
+    heap.mark(parent);
 }
 
-QSharedPointer<Expression> Symbol::evaluate(QSharedPointer<Environment> env) {
-    return env->lookup(name);
+void Environment::define(int symbol, const Value& value) {
+    if (!parent) {
+        defineGlobal(symbol, value);
+        return;
+    }
+    int index = names.indexOf(symbol);
+    if (index < 0) {
+        names.append(symbol);
+        values.append(value);
+    }
+    else {
+        values[index] = value;
+    }
 }
 
-QSharedPointer<Expression> List::evaluate(QSharedPointer<Environment> env) {
-    if (elements.isEmpty()) {
-        qCritical() << "Cannot evaluate empty list";
-        throw std::runtime_error("Cannot evaluate empty list");
+Value Environment::lookup(int symbol) const {
+    for (const Environment* env = this; env->parent; env = env->parent) {
+        int index = env->names.indexOf(symbol);
+        if (index >= 0) {
+            return env->values[index];
+        }
+    }
+    return lookupGlobal(symbol);
+}
+
+void Environment::undefinedSymbol(int symbol) {
+    QString name = SymbolTable::name(symbol);
+    qCritical() << "Undefined symbol:" << name;
+    throw std::runtime_error(QString("Undefined symbol: %1").arg(name).toStdString());
+}
+
+Value evaluateExpression(const Value& expr, Environment* env) {
+    Heap* heap = Heap::current();
+    Heap::PinScope pins(heap);
+    Profiler::TailScope profile(Profiler::current());
+    int exprPin = heap->pin(expr);
+    int envPin = heap->pin(env);
+    Value current = expr;
+    for (;;) {
+        if (current.isSymbol()) {
+            return env->lookup(current.asSymbol());
+        }
+        if (!current.is(ExpressionKind::List)) {
+            // Everything else evaluates to itself
+            return current;
+        }
+        Value next;
+        if (!current.as<List>()->evaluate(env, next)) {
+            return next;
+        }
+        // A tail call or tail branch: keep going in this C++ frame
+        heap->repin(exprPin, next);
+        heap->repin(envPin, env);
+        heap->collectIfNeeded();
+        current = next;
     }
+}
 
-    auto first = elements[0]->evaluate(env);
-    if (auto symbol = qSharedPointerDynamicCast<Symbol>(elements[0])) {
-        if (symbol->getName() == "define") {
+bool List::evaluate(Environment*& env, Value& result) const {
+    // Special forms are recognised before the head is evaluated, otherwise
+    // `define` and friends would be looked up as ordinary variables
+    if (elements[0].isSymbol()) {
+        int form = elements[0].asSymbol();
+        if (form == SymbolTable::Define) {
             if (elements.size() != 3) {
                 qCritical() << "Incorrect number of arguments for define";
                 throw std::runtime_error("Incorrect number of arguments for define");
             }
-            auto name = qSharedPointerDynamicCast<Symbol>(elements[1]);
-            if (!name) {
+            if (!elements[1].isSymbol()) {
                 qCritical() << "First argument to define must be a symbol";
                 throw std::runtime_error("First argument to define must be a symbol");
             }
-            auto value = elements[2]->evaluate(env);
-            env->define(name->getName(), value);
-            return value;
+            result = evaluateExpression(elements[2], env);
+            if (result.is(ExpressionKind::Function)) {
+                result.as<Function>()->nameIfAnonymous(elements[1].asSymbol());
+            }
+            env->define(elements[1].asSymbol(), result);
+            return false;
         }
-        else if (symbol->getName() == "lambda") {
+        else if (form == SymbolTable::Lambda) {
             if (elements.size() != 3) {
                 qCritical() << "Incorrect number of arguments for lambda";
                 throw std::runtime_error("Incorrect number of arguments for lambda");
             }
-            auto params = qSharedPointerDynamicCast<List>(elements[1]);
-            if (!params) {
+            if (!elements[1].is(ExpressionKind::List) && !elements[1].isNil()) {
                 qCritical() << "Second argument to lambda must be a list of parameters";
                 throw std::runtime_error("Second argument to lambda must be a list of parameters");
             }
-            QVector<QString> paramNames;
-            for (const auto& param : params->getElements()) {
-                auto paramSymbol = qSharedPointerDynamicCast<Symbol>(param);
-                if (!paramSymbol) {
-                    qCritical() << "Lambda parameters must be symbols";
-                    throw std::runtime_error("Lambda parameters must be symbols");
+            QVector<int> paramNames;
+            if (!elements[1].isNil()) {
+                for (const auto& param : elements[1].as<List>()->getElements()) {
+                    if (!param.isSymbol()) {
+                        qCritical() << "Lambda parameters must be symbols";
+                        throw std::runtime_error("Lambda parameters must be symbols");
+                    }
+                    paramNames.append(param.asSymbol());
                 }
-                paramNames.append(paramSymbol->getName());
             }
-            return QSharedPointer<Function>::create(paramNames, elements[2], env);
+            result = Value(Heap::create<Function>(paramNames, elements[2], env, line));
+            return false;
         }
-        else if (symbol->getName() == "class") {
+        else if (form == SymbolTable::Class) {
             if (elements.size() < 2) {
                 qCritical() << "Incorrect number of arguments for class";
                 throw std::runtime_error("Incorrect number of arguments for class");
             }
-            auto cls = QSharedPointer<Class>::create();
+            Heap::PinScope pins(Heap::current());
+            auto cls = Heap::create<Class>();
+            Heap::current()->pin(cls);
             for (int i = 1; i < elements.size(); i += 2) {
-                auto methodName = qSharedPointerDynamicCast<Symbol>(elements[i]);
-                if (!methodName || i + 1 >= elements.size()) {
+                if (!elements[i].isSymbol() || i + 1 >= elements.size()) {
                     qCritical() << "Invalid class definition";
                     throw std::runtime_error("Invalid class definition");
                 }
-                auto methodBody = elements[i + 1]->evaluate(env);
-                cls->addMethod(methodName->getName(), methodBody);
+                auto methodBody = evaluateExpression(elements[i + 1], env);
+                if (methodBody.is(ExpressionKind::Function)) {
+                    methodBody.as<Function>()->nameIfAnonymous(elements[i].asSymbol());
+                }
+                cls->addMethod(elements[i].asSymbol(), methodBody);
             }
-            return cls;
+            result = Value(cls);
+            return false;
         }
-        else if (symbol->getName() == "new") {
+        else if (form == SymbolTable::New) {
             if (elements.size() != 2) {
                 qCritical() << "Incorrect number of arguments for new";
                 throw std::runtime_error("Incorrect number of arguments for new");
             }
-            auto cls = qSharedPointerDynamicCast<Class>(elements[1]->evaluate(env));
-            if (!cls) {
+            auto cls = evaluateExpression(elements[1], env);
+            if (!cls.is(ExpressionKind::Class)) {
                 qCritical() << "First argument to new must be a class";
                 throw std::runtime_error("First argument to new must be a class");
             }
-            return QSharedPointer<Instance>::create(cls);
+            result = Value(Heap::create<Instance>(cls.as<Class>()));
+            return false;
+        }
+        else if (form == SymbolTable::Quote) {
+            if (elements.size() != 2) {
+                qCritical() << "Incorrect number of arguments for quote";
+                throw std::runtime_error("Incorrect number of arguments for quote");
+            }
+            result = elements[1];
+            return false;
+        }
+        else if (form == SymbolTable::If) {
+            if (elements.size() != 3 && elements.size() != 4) {
+                qCritical() << "Incorrect number of arguments for if";
+                throw std::runtime_error("Incorrect number of arguments for if");
+            }
+            if (evaluateExpression(elements[1], env).isTruthy()) {
+                result = elements[2];
+                return true;
+            }
+            if (elements.size() == 4) {
+                result = elements[3];
+                return true;
+            }
+            result = Value::nil();
+            return false;
+        }
+        else if (form == SymbolTable::Begin) {
+            if (elements.size() < 2) {
+                qCritical() << "Incorrect number of arguments for begin";
+                throw std::runtime_error("Incorrect number of arguments for begin");
+            }
+            for (int i = 1; i < elements.size() - 1; ++i) {
+                evaluateExpression(elements[i], env);
+            }
+            result = elements.last();
+            return true;
+        }
+        else if (form == SymbolTable::Cond) {
+            for (int i = 1; i < elements.size(); ++i) {
+                if (!elements[i].is(ExpressionKind::List) || elements[i].as<List>()->getElements().size() < 2) {
+                    qCritical() << "Each cond clause must be a test followed by expressions";
+                    throw std::runtime_error("Each cond clause must be a test followed by expressions");
+                }
+                const auto& clause = elements[i].as<List>()->getElements();
+                bool isElse = clause[0].isSymbol() && clause[0].asSymbol() == SymbolTable::Else;
+                if (isElse && i != elements.size() - 1) {
+                    qCritical() << "else must be the last cond clause";
+                    throw std::runtime_error("else must be the last cond clause");
+                }
+                if (isElse || evaluateExpression(clause[0], env).isTruthy()) {
+                    for (int j = 1; j < clause.size() - 1; ++j) {
+                        evaluateExpression(clause[j], env);
+                    }
+                    result = clause.last();
+                    return true;
+                }
+            }
+            result = Value::nil();
+            return false;
+        }
+        else if (form == SymbolTable::Let) {
+            if (elements.size() < 3 || (!elements[1].is(ExpressionKind::List) && !elements[1].isNil())) {
+                qCritical() << "let needs a list of bindings and a body";
+                throw std::runtime_error("let needs a list of bindings and a body");
+            }
+            Heap* heap = Heap::current();
+            Heap::PinScope pins(heap);
+            QVector<int> names;
+            QVector<Value> values;
+            if (!elements[1].isNil()) {
+                for (const auto& binding : elements[1].as<List>()->getElements()) {
+                    if (!binding.is(ExpressionKind::List) || binding.as<List>()->getElements().size() != 2
+                        || !binding.as<List>()->getElements()[0].isSymbol()) {
+                        qCritical() << "Each let binding must be a symbol and an expression";
+                        throw std::runtime_error("Each let binding must be a symbol and an expression");
+                    }
+                    const auto& parts = binding.as<List>()->getElements();
+                    names.append(parts[0].asSymbol());
+                    values.append(evaluateExpression(parts[1], env));
+                    heap->pin(values.last());
+                }
+            }
+            // The initialisers are evaluated in the outer environment
+            env = Heap::create<Environment>(env);
+            heap->pin(env);
+            for (int i = 0; i < names.size(); ++i) {
+                env->define(names[i], values[i]);
+            }
+            for (int i = 2; i < elements.size() - 1; ++i) {
+                evaluateExpression(elements[i], env);
+            }
+            result = elements.last();
+            return true;
         }
     }
 
-    QVector<QSharedPointer<Expression>> evaluatedArgs;
-    for (int i = 1; i < elements.size(); ++i) {
-        evaluatedArgs.append(elements[i]->evaluate(env));
-    }
+    // Evaluated values only live in this C++ frame, so they are pinned
+    // until the call has been set up
+    Heap* heap = Heap::current();
+    Heap::PinScope pins(heap);
+    auto first = evaluateExpression(elements[0], env);
+    heap->pin(first);
 
-    if (auto function = qSharedPointerDynamicCast<Function>(first)) {
-        return function->apply(evaluatedArgs);
-    }
-    else if (auto instance = qSharedPointerDynamicCast<Instance>(first)) {
-        if (evaluatedArgs.isEmpty()) {
+    if (first.is(ExpressionKind::Instance)) {
+        if (elements.size() < 2) {
             qCritical() << "Method name must be provided when calling instance method";
             throw std::runtime_error("Method name must be provided when calling instance method");
         }
-        auto methodName = qSharedPointerDynamicCast<Symbol>(elements[1]);
-        if (!methodName) {
+        if (!elements[1].isSymbol()) {
             qCritical() << "Method name must be a symbol";
             throw std::runtime_error("Method name must be a symbol");
         }
-        auto method = instance->getAttribute(methodName->getName());
-        if (auto methodFunction = qSharedPointerDynamicCast<Function>(method)) {
-            QVector<QSharedPointer<Expression>> methodArgs = { instance };
-            methodArgs.append(evaluatedArgs.mid(1));
-            return methodFunction->apply(methodArgs);
+        auto method = first.as<Instance>()->lookup(elements[1].asSymbol());
+        if (!method.is(ExpressionKind::Function)) {
+            qCritical() << "Invalid method call";
+            throw std::runtime_error("Invalid method call");
+        }
+        heap->pin(method);
+        QVector<Value> methodArgs = { first };
+        for (int i = 2; i < elements.size(); ++i) {
+            methodArgs.append(evaluateExpression(elements[i], env));
+            heap->pin(methodArgs.last());
         }
-        qCritical() << "Invalid method call";
-        throw std::runtime_error("Invalid method call");
+        return method.as<Function>()->prepareCall(methodArgs.constData(), methodArgs.size(), env, result);
+    }
+
+    QVector<Value> evaluatedArgs;
+    evaluatedArgs.reserve(elements.size() - 1);
+    for (int i = 1; i < elements.size(); ++i) {
+        evaluatedArgs.append(evaluateExpression(elements[i], env));
+        heap->pin(evaluatedArgs.last());
+    }
+
+    if (first.is(ExpressionKind::Function)) {
+        return first.as<Function>()->prepareCall(evaluatedArgs.constData(), evaluatedArgs.size(), env, result);
+    }
+    else if (first.is(ExpressionKind::Primitive)) {
+        Profiler::CallScope profile(Profiler::current(), first.as<Primitive>());
+        result = first.as<Primitive>()->apply(evaluatedArgs.constData(), evaluatedArgs.size());
+        return false;
     }
     qCritical() << "Invalid function call";
     throw std::runtime_error("Invalid function call");
 }
 
-QSharedPointer<Expression> Function::apply(const QVector<QSharedPointer<Expression>>& args) {
-    if (args.size() != parameters.size()) {
+Environment* Function::bindArguments(const Value* args, int argc) const {
+    int expected = code ? code->parameterCount : parameters.size();
+    if (argc != expected) {
         qCritical() << "Incorrect number of arguments";
         throw std::runtime_error("Incorrect number of arguments");
     }
-    auto env = QSharedPointer<Environment>::create(closure);
+    if (code) {
+        // Parameters occupy the first slots of the frame, locals follow
+        auto env = Heap::create<Environment>(closure, code->frameSize);
+        for (int i = 0; i < argc; ++i) {
+            env->local(0, i) = args[i];
+        }
+        return env;
+    }
+    auto env = Heap::create<Environment>(closure);
     for (int i = 0; i < parameters.size(); ++i) {
         env->define(parameters[i], args[i]);
     }
-    return body->evaluate(env);
+    return env;
 }
 
-Script::Script(QObject *parent) : QObject(parent) {}
+int Function::getName() const {
+    return code ? code->name : name;
+}
 
-QVector<QString> Script::tokenize(const QString& str) {
-    QVector<QString> tokens;
-    QString token;
-    bool inString = false;
-    for (QChar c : str) {
-        if (c == '"') {
-            inString = !inString;
-            token += c;
-        }
-        else if (inString) {
-            token += c;
-        }
-        else if (c == '(' || c == ')') {
-            if (!token.isEmpty()) {
-                tokens.append(token);
-                token.clear();
-            }
-            tokens.append(QString(c));
-        }
-        else if (c.isSpace()) {
-            if (!token.isEmpty()) {
-                tokens.append(token);
-                token.clear();
-            }
-        }
-        else {
-            token += c;
-        }
+int Function::getLine() const {
+    return code ? code->line : line;
+}
+
+Value Function::apply(const Value* args, int argc) {
+    auto env = bindArguments(args, argc);
+    Profiler::CallScope profile(Profiler::current(), this);
+    if (code) {
+        VirtualMachine machine;
+        return machine.execute(*code, env);
+    }
+    return evaluateExpression(body, env);
+}
+
+bool Function::prepareCall(const Value* args, int argc, Environment*& env, Value& result) {
+    if (code) {
+        result = apply(args, argc);
+        return false;
     }
-    if (!token.isEmpty()) {
-        tokens.append(token);
+    env = bindArguments(args, argc);
+    if (Profiler* profiler = Profiler::current()) {
+        profiler->enterTail(this);
     }
-    return tokens;
+    result = body;
+    return true;
+}
+
+Script::Script(QObject *parent)
+    : QObject(parent),
+      heap(new Heap)
+{
+    Heap::Scope scope(heap.data());
+    globalEnv = Heap::create<Environment>();
+    vm.reset(new VirtualMachine);
+    executionMode = Bytecode;
+    profiler = nullptr;
+    optimizerPasses = Optimizer::AllPasses;
+    actor.reset(new Actor(heap.data()));
+    heap->addRoots(this);
+    defineBuiltins();
+}
+
+Script::~Script() {
+    actor->detach();
+    heap->removeRoots(this);
+}
+
+void Script::traceRoots(Heap& target) const {
+    target.mark(globalEnv);
+    for (const auto& form : forms) {
+        target.mark(form);
+    }
+    for (CodeBlock* code : compiledForms) {
+        target.mark(code);
+    }
+}
+
+void Script::defineBuiltins() {
+    definePrimitives(globalEnv);
+    defineVectorPrimitives(globalEnv);
+    defineActorPrimitives(globalEnv);
+    defineReaderPrimitives(globalEnv);
+    defineHashTablePrimitives(globalEnv);
 }
 
-QSharedPointer<Expression> Script::parse(QVector<QString>::iterator& it, QVector<QString>::iterator end) {
-    if (it == end) {
+Value Script::parse(Lexer& lexer) {
+    Token token = lexer.next();
+    switch (token.type) {
+    case Token::End:
         qCritical() << "Unexpected end of input";
         throw std::runtime_error("Unexpected end of input");
+    case Token::RightParen: {
+        QString where = lexer.describeLocation(token.offset);
+        qCritical() << "Unexpected ')' at" << where;
+        throw std::runtime_error(QString("Unexpected ')' at %1").arg(where).toStdString());
     }
-
-    QString token = *it++;
-    if (token == "(") {
-        QVector<QSharedPointer<Expression>> elements;
-        while (it != end && *it != ")") {
-            elements.append(parse(it, end));
-        }
-        if (it == end) {
-            qCritical() << "Mismatched parentheses";
-            throw std::runtime_error("Mismatched parentheses");
+    case Token::LeftParen: {
+        int line = lexer.line(token.offset);
+        QVector<Value> elements;
+        while (lexer.peek().type != Token::RightParen) {
+            if (lexer.peek().type == Token::End) {
+                QString where = lexer.describeLocation(token.offset);
+                qCritical() << "Mismatched parentheses: '(' at" << where << "is never closed";
+                throw std::runtime_error(QString("Mismatched parentheses: '(' at %1 is never closed").arg(where).toStdString());
+            }
+            elements.append(parse(lexer));
         }
-        ++it; // consume the ')'
-        return QSharedPointer<List>::create(elements);
+        lexer.next(); // consume the ')'
+        return makeList(elements, line);
     }
-    else if (token == ")") {
-        qCritical() << "Unexpected ')'";
-        throw std::runtime_error("Unexpected ')'");
+    case Token::String:
+        return Value(Heap::create<String>(unescapeString(token.text)));
+    case Token::Atom:
+        break;
     }
-    else if (token.startsWith('"') && token.endsWith('"')) {
-        // Handle string literals
-        return QSharedPointer<Symbol>::create(token.mid(1, token.length() - 2));
+
+    QStringView text = token.text;
+    if (text == u"#t" || text == u"#f") {
+        return Value::boolean(text == u"#t");
+    }
+    else if (text.startsWith(u"#\\") && text.size() > 2) {
+        QStringView name = text.mid(2);
+        if (name == u"space") return Value::character(' ');
+        if (name == u"newline") return Value::character('\n');
+        if (name == u"tab") return Value::character('\t');
+        return Value::character(name[0].unicode());
     }
     else {
         // Try to parse as number, otherwise treat as symbol
         bool ok;
-        double value = token.toDouble(&ok);
+        qint64 integer = text.toLongLong(&ok);
         if (ok) {
-            return QSharedPointer<Number>::create(value);
+            return Value::fromNumber(integer);
+        }
+        double value = text.toDouble(&ok);
+        if (ok) {
+            return Value::fromFlonum(value);
         }
         else {
-            return QSharedPointer<Symbol>::create(token);
+            return Value::symbol(SymbolTable::intern(text.toString()));
         }
     }
 }
 
-void Script::repl() {
-    auto globalEnv = QSharedPointer<Environment>::create();
-
-    // Define built-in functions
-    globalEnv->define("+", QSharedPointer<Function>::create(
-                               QVector<QString>{"a", "b"},
-                               QSharedPointer<List>::create(QVector<QSharedPointer<Expression>>{
-                                   QSharedPointer<Symbol>::create("+"),
-                                   QSharedPointer<Symbol>::create("a"),
-                                   QSharedPointer<Symbol>::create("b")
-                               }),
-                               globalEnv
-                               ));
+Value Script::execute(const Value& expr, CodeBlock* code) {
+    if (executionMode == Bytecode) {
+        try {
+            return vm->execute(*code, globalEnv);
+        }
+        catch (...) {
+            vm->reset();
+            throw;
+        }
+    }
+    return evaluateExpression(expr, globalEnv);
+}
+
+Value Script::evaluate(const QString& source) {
+    Heap::Scope scope(heap.data());
+    Actor::Scope acting(actor.data());
+    Profiler::Scope profiling(profiler);
+    // Leaves any frames an error interrupted
+    Profiler::TailScope profile(profiler);
+    Lexer lexer(source);
+    Optimizer optimizer(globalEnv, optimizerPasses);
+    Value result;
+    while (lexer.peek().type != Token::End) {
+        // Between top-level forms the global environment is the only root
+        heap->collectIfNeeded();
+        auto expr = optimizer.optimize(parse(lexer));
+        optimizerStatistics = optimizer.getStatistics();
+        CodeBlock* code = nullptr;
+        if (executionMode == Bytecode) {
+            Compiler compiler;
+            code = compiler.compile(expr);
+        }
+        result = execute(expr, code);
+    }
+    return result;
+}
+
+void Script::load(const QString& source) {
+    Heap::Scope scope(heap.data());
+    Lexer lexer(source);
+    QVector<Value> parsed;
+    while (lexer.peek().type != Token::End) {
+        parsed.append(parse(lexer));
+    }
+    Optimizer optimizer(globalEnv, optimizerPasses);
+    load(optimizer.optimize(parsed));
+    optimizerStatistics = optimizer.getStatistics();
+}
+
+void Script::load(const QVector<Value>& loaded) {
+    forms = loaded;
+    compiledForms.fill(nullptr, forms.size());
+}
+
+Value Script::run(const std::function<void(int, int)>& progress) {
+    Heap::Scope scope(heap.data());
+    Actor::Scope acting(actor.data());
+    Profiler::Scope profiling(profiler);
+    Profiler::TailScope profile(profiler);
+    globalEnv = Heap::create<Environment>();
+    defineBuiltins();
+    Value result;
+    for (int i = 0; i < forms.size(); ++i) {
+        heap->collectIfNeeded();
+        if (executionMode == Bytecode && !compiledForms[i]) {
+            Compiler compiler;
+            compiledForms[i] = compiler.compile(forms[i]);
+        }
+        result = execute(forms[i], compiledForms[i]);
+        if (progress) {
+            progress(i + 1, forms.size());
+        }
+    }
+    return result;
+}
+
+Value Script::call(const Value& function, const QVector<Value>& args) {
+    Heap::Scope scope(heap.data());
+    Actor::Scope acting(actor.data());
+    Profiler::Scope profiling(profiler);
+    Profiler::TailScope profile(profiler);
+    if (function.is(ExpressionKind::Function)) {
+        return function.as<Function>()->apply(args.constData(), args.size());
+    }
+    if (function.is(ExpressionKind::Primitive)) {
+        Profiler::CallScope primitiveProfile(profiler, function.as<Primitive>());
+        return function.as<Primitive>()->apply(args.constData(), args.size());
+    }
+    qCritical() << "Invalid function call";
+    throw std::runtime_error("Invalid function call");
+}
+
+void Script::setAllocationSiteTracking(bool enabled) {
+    heap->setSiteFunction(enabled ? &Profiler::currentSite : nullptr);
+}
+
+QString Script::heapReport() {
+    QString result;
+    QTextStream out(&result);
+    out << QString("%1 %2 %3 %4  %5\n").arg("allocated", 10).arg("KiB", 10)
+               .arg("live", 10).arg("live KiB", 10).arg("type");
+    for (const auto& stats : heap->getTypeStatistics()) {
+        out << QString("%1 %2 %3 %4  %5\n")
+                   .arg(stats.allocations, 10)
+                   .arg(stats.bytesAllocated / 1024, 10)
+                   .arg(stats.liveObjects, 10)
+                   .arg(stats.liveBytes / 1024, 10)
+                   .arg(stats.name);
+    }
 
+    Heap::Snapshot snapshot = heap->snapshot();
+    out << QString("\n%1 objects, %2 KiB reachable\n").arg(snapshot.objects).arg(snapshot.bytes / 1024);
+    out << QString("%1 %2  %3\n").arg("objects", 10).arg("KiB", 10).arg("type");
+    for (const auto& stats : snapshot.types) {
+        out << QString("%1 %2  %3\n").arg(stats.liveObjects, 10).arg(stats.liveBytes / 1024, 10).arg(stats.name);
+    }
+    if (!snapshot.sites.isEmpty()) {
+        QString sourceName = profiler ? profiler->getSourceName() : QString();
+        out << QString("\n%1 %2  %3\n").arg("objects", 10).arg("KiB", 10).arg("allocated by");
+        for (const auto& stats : snapshot.sites) {
+            out << QString("%1 %2  %3\n")
+                       .arg(stats.objects, 10)
+                       .arg(stats.bytes / 1024, 10)
+                       .arg(Profiler::describeSite(stats.site, sourceName));
+        }
+    }
+    return result;
+}
+
+void Script::interrupt() {
+    actor->interrupt();
+}
+
+void Script::repl() {
     QTextStream qin(stdin);
     QTextStream qout(stdout);
 
@@ -280,12 +782,17 @@ void Script::repl() {
         QString input = qin.readLine();
         if (input == "exit") break;
 
+        // ",mode tree" switches to the reference evaluator, ",mode vm" back
+        if (input.startsWith(",mode ")) {
+            setExecutionMode(input.mid(6).trimmed() == "tree" ? TreeWalking : Bytecode);
+            continue;
+        }
+
         try {
-            auto tokens = tokenize(input);
-            auto it = tokens.begin();
-            auto expr = parse(it, tokens.end());
-            auto result = expr->evaluate(globalEnv);
-            qout << result->toString() << Qt::endl;
+            auto result = evaluate(input);
+            if (!result.isUnbound()) {
+                qout << result.toString() << Qt::endl;
+            }
         }
         catch (const std::exception& e) {
             qCritical() << "Error:" << e.what();
@@ -294,18 +801,7 @@ void Script::repl() {
 }
 
 QString Script::scriptEscapeString(const QString& str) {
-    QString result;
-    for (QChar c : str) {
-        switch (c.unicode()) {
-        case '"': result += "\\\""; break;
-        case '\\': result += "\\\\"; break;
-        case '\n': result += "\\n"; break;
-        case '\r': result += "\\r"; break;
-        case '\t': result += "\\t"; break;
-        default: result += c;
-        }
-    }
-    return result;
+    return escapeString(str);
 }
 
 /*
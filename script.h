@@ -1,124 +1,370 @@
 #ifndef SCRIPT_H
 #define SCRIPT_H
 
+#include "scriptvalue.h"
+#include "scriptheap.h"
+#include "scriptoptimizer.h"
+
 #include <QString>
 #include <QVector>
-#include <QSharedPointer>
-#include <QMap>
+#include <QHash>
 #include <QObject>
+#include <QScopedPointer>
+#include <QSharedPointer>
+
+#include <functional>
 
 class Environment;
+class CodeBlock;
+class Actor;
+class HeapCopier;
+class Lexer;
+class Profiler;
+class VirtualMachine;
 
-// Base class for all expression types
-class Expression {
-public:
-    virtual ~Expression() = default;
-    virtual QString toString() const = 0;
-    virtual QSharedPointer<Expression> evaluate(QSharedPointer<Environment> env) = 0;
-};
+// Tree-walking evaluation of a parsed expression
+Value evaluateExpression(const Value& expr, Environment* env);
 
-// Number expression
-class Number : public Expression {
-    double value;
+// List expression. The empty list is the Nil immediate, so a List always has
+// at least one element; use makeList() to get that normalisation. Lists read
+// by the parser remember the source line they started on.
+class List : public Expression {
+    QVector<Value> elements;
+    int line;
 public:
-    Number(double val);
-    QString toString() const override {
-        return QString::number(value);
-    }
-    QSharedPointer<Expression> evaluate(QSharedPointer<Environment>) override {
-        return QSharedPointer<Number>::create(*this);
-    }
-    double getValue() const { return value; }
+    List(const QVector<Value>& elems, int sourceLine = 0) : elements(elems), line(sourceLine) {}
+    ExpressionKind kind() const override { return ExpressionKind::List; }
+    QString toString() const override;
+    void trace(Heap& heap) const override;
+    // Evaluates the list as a form. Returns true when result is an
+    // expression in tail position that the caller still has to evaluate in
+    // env, which lets evaluateExpression() loop instead of recursing.
+    bool evaluate(Environment*& env, Value& result) const;
+    const QVector<Value>& getElements() const { return elements; }
+    int getLine() const { return line; }
 };
 
-// Symbol expression
-class Symbol : public Expression {
-    QString name;
+Value makeList(const QVector<Value>& elements, int line = 0);
+
+// Immutable string. toString() gives the written form with quotes and
+// escapes; getValue() is what display prints.
+//
+// Long concatenations are kept as a rope: the node only references its two
+// halves, and the characters are copied into place the first time anything
+// reads the value. Repeatedly appending to a growing string then costs one
+// copy at the end instead of one per append.
+class String : public Expression {
+    friend class Heap;
+    mutable QString value;
+    mutable const String* left = nullptr;
+    mutable const String* right = nullptr;
+    qsizetype length;
+
+    String(const String* l, const String* r)
+        : left(l), right(r), length(l->length + r->length) {}
+    void flatten() const;
 public:
-    Symbol(const QString& n) : name(n) {}
-    QString toString() const override {
-        return name;
+    // Joins shorter than this are copied straight away, since a rope node
+    // costs more than copying a few dozen characters
+    static constexpr qsizetype RopeThreshold = 256;
+
+    String(const QString& v) : value(v), length(v.size()) {}
+    // a followed by b, as a rope when the result is long
+    static String* concatenate(const String* a, const String* b);
+    ExpressionKind kind() const override { return ExpressionKind::String; }
+    QString toString() const override;
+    void trace(Heap& heap) const override;
+    qsizetype size() const { return length; }
+    const QString& getValue() const {
+        if (left) {
+            flatten();
+        }
+        return value;
     }
-    QSharedPointer<Expression> evaluate(QSharedPointer<Environment> env) override;
-    const QString& getName() const { return name; }
 };
 
-// List expression
-class List : public Expression {
-    QVector<QSharedPointer<Expression>> elements;
+// Output port collecting everything written to it into a string buffer
+class StringPort : public Expression {
+    QString buffer;
 public:
-    List(const QVector<QSharedPointer<Expression>>& elems) : elements(elems) {}
-    QString toString() const override;
-    QSharedPointer<Expression> evaluate(QSharedPointer<Environment> env) override;
-    const QVector<QSharedPointer<Expression>>& getElements() const { return elements; }
+    ExpressionKind kind() const override { return ExpressionKind::StringPort; }
+    QString toString() const override { return "<string-port>"; }
+    void write(const QString& text) { buffer += text; }
+    const QString& getBuffer() const { return buffer; }
 };
 
-// Function expression
+// Function expression. A function either carries its body as a tree for the
+// tree-walking evaluator, or as bytecode produced by the Compiler. The name
+// and source line are only used to label the function in profiles.
 class Function : public Expression {
-    QVector<QString> parameters;
-    QSharedPointer<Expression> body;
-    QSharedPointer<Environment> closure;
+    friend class HeapCopier;
+    QVector<int> parameters;
+    Value body;
+    CodeBlock* code = nullptr;
+    Environment* closure;
+    int name = -1;
+    int line = 0;
 public:
-    Function(const QVector<QString>& params, QSharedPointer<Expression> bod, QSharedPointer<Environment> env)
-        : parameters(params), body(bod), closure(env) {}
+    Function(const QVector<int>& params, const Value& bod, Environment* env, int sourceLine = 0)
+        : parameters(params), body(bod), closure(env), line(sourceLine) {}
+    Function(CodeBlock* compiled, Environment* env)
+        : code(compiled), closure(env) {}
+    ExpressionKind kind() const override { return ExpressionKind::Function; }
     QString toString() const override {
         return "<function>";
     }
-    QSharedPointer<Expression> evaluate(QSharedPointer<Environment>) override {
-        return QSharedPointer<Function>::create(*this);
+    void trace(Heap& heap) const override;
+    Value apply(const Value* args, int argc);
+    // Tree-walking call: a tree-bodied function hands back its body and new
+    // environment as a tail expression, compiled functions run to completion
+    bool prepareCall(const Value* args, int argc, Environment*& env, Value& result);
+    Environment* bindArguments(const Value* args, int argc) const;
+    CodeBlock* getCode() const { return code; }
+    // Symbol id of the name the function was defined under, or -1
+    int getName() const;
+    int getLine() const;
+    // Names an anonymous function after the variable it is bound to
+    void nameIfAnonymous(int symbol) {
+        if (!code && name < 0) {
+            name = symbol;
+        }
     }
-    QSharedPointer<Expression> apply(const QVector<QSharedPointer<Expression>>& args);
 };
 
-// Class expression
+// Native function implemented in C++. The argument count is checked against
+// the primitive's arity before the callback runs, so callbacks can index
+// their required arguments directly.
+class Primitive : public Expression {
+    friend class HeapCopier;
+public:
+    using Callback = Value (*)(const Value* args, int argc);
+    static constexpr int Variadic = -1;
+private:
+    QString name;
+    int symbol;
+    int minArgs;
+    int maxArgs;
+    Callback callback;
+public:
+    Primitive(const QString& n, int min, int max, Callback cb)
+        : name(n), symbol(SymbolTable::intern(n)), minArgs(min), maxArgs(max), callback(cb) {}
+    ExpressionKind kind() const override { return ExpressionKind::Primitive; }
+    QString toString() const override {
+        return QString("<primitive %1>").arg(name);
+    }
+    Value apply(const Value* args, int argc) const {
+        if (argc < minArgs || (maxArgs != Variadic && argc > maxArgs)) {
+            arityError(argc);
+        }
+        return callback(args, argc);
+    }
+    const QString& getName() const { return name; }
+    int getSymbol() const { return symbol; }
+    [[noreturn]] void arityError(int argc) const;
+};
+
+// Hidden class of instances: the layout of their attribute slots. Every
+// instance starts out with its class's root shape, and adding an attribute
+// moves it to the shape with one more slot, which is shared by all instances
+// of the class that added the same attributes in the same order. A shape
+// thus fixes both the class and the slot of each attribute, so the VM's
+// inline caches only have to compare shapes.
+class Shape : public HeapObject {
+    Shape* parent;
+    QVector<int> names;
+    QHash<int, int> slotIndex;
+    QHash<int, Shape*> transitions;
+public:
+    explicit Shape(Shape* p = nullptr, int symbol = -1);
+    void trace(Heap& heap) const override;
+    const char* typeName() const override { return "Shape"; }
+    // Slot of the attribute named symbol, or -1
+    int slotOf(int symbol) const { return slotIndex.value(symbol, -1); }
+    int slotCount() const { return names.size(); }
+    int nameAt(int slot) const { return names[slot]; }
+    // The shape reached by adding an attribute named symbol
+    Shape* withSlot(int symbol);
+};
+
+// Class expression. Methods are keyed by symbol id and fixed once the class
+// form has been evaluated.
 class Class : public Expression {
-    QMap<QString, QSharedPointer<Expression>> methods;
+    friend class HeapCopier;
+    QHash<int, Value> methods;
+    Shape* rootShape;
 public:
-    void addMethod(const QString& name, QSharedPointer<Expression> method);
+    Class() : rootShape(Heap::create<Shape>()) {}
+    void addMethod(int symbol, const Value& method);
+    ExpressionKind kind() const override { return ExpressionKind::Class; }
     QString toString() const override;
-    QSharedPointer<Expression> evaluate(QSharedPointer<Environment> env) override;
-    QSharedPointer<Expression> getMethod(const QString& name) const;
+    void trace(Heap& heap) const override;
+    // The method named symbol; throws if there is none
+    Value getMethod(int symbol) const;
+    Shape* getRootShape() const { return rootShape; }
 };
 
-// Instance expression
+// Instance expression. Attribute values live in slots laid out by the
+// instance's shape.
 class Instance : public Expression {
-    QSharedPointer<Class> cls;
-    QMap<QString, QSharedPointer<Expression>> attributes;
+    friend class HeapCopier;
+    Class* cls;
+    Shape* shape;
+    QVector<Value> slotValues;
 public:
-    Instance(QSharedPointer<Class> c) : cls(c) {}
+    Instance(Class* c) : cls(c), shape(c ? c->getRootShape() : nullptr) {}
+    ExpressionKind kind() const override { return ExpressionKind::Instance; }
     QString toString() const override {
         return "<instance>";
     }
-    QSharedPointer<Expression> evaluate(QSharedPointer<Environment>) override {
-        return QSharedPointer<Instance>::create(*this);
-    }
-    void setAttribute(const QString& name, QSharedPointer<Expression> value) {
-        attributes[name] = value;
-    }
-    QSharedPointer<Expression> getAttribute(const QString& name) const;
+    void trace(Heap& heap) const override;
+    Class* getClass() const { return cls; }
+    Shape* getShape() const { return shape; }
+    const Value& slotAt(int slot) const { return slotValues[slot]; }
+    void setAttribute(int symbol, const Value& value);
+    // The attribute named symbol, or else the class's method of that name.
+    // Throws if there is neither.
+    Value lookup(int symbol) const;
 };
 
-// Environment to store variable bindings
-class Environment {
-    QMap<QString, QSharedPointer<Expression>> bindings;
-    QSharedPointer<Environment> parent;
+// Environment to store variable bindings. Every environment is a flat vector
+// of values: compiled code addresses local values by (depth, index) as resolved
+// by the Compiler, while the tree-walking evaluator finds them by scanning the
+// parallel vector of symbol ids. The global environment has no parent and
+// indexes its values directly by symbol id.
+class Environment : public HeapObject {
+    friend class HeapCopier;
+    QVector<int> names;
+    QVector<Value> values;
+    Environment* parent;
+    Environment* global;
 public:
-    Environment(QSharedPointer<Environment> p = nullptr) : parent(p) {}
-    void define(const QString& name, QSharedPointer<Expression> value);
-    QSharedPointer<Expression> lookup(const QString& name) const;
+    Environment(Environment* p = nullptr)
+        : parent(p), global(p ? p->global : this) {}
+    Environment(Environment* p, int valueCount)
+        : values(valueCount), parent(p), global(p ? p->global : this) {}
+    void trace(Heap& heap) const override;
+    const char* typeName() const override { return "Environment"; }
+    void define(int symbol, const Value& value);
+    void define(const QString& name, const Value& value) {
+        define(SymbolTable::intern(name), value);
+    }
+    Value lookup(int symbol) const;
+    Value lookup(const QString& name) const {
+        return lookup(SymbolTable::intern(name));
+    }
+
+    Value& local(int depth, int index) {
+        Environment* env = this;
+        while (depth-- > 0) {
+            env = env->parent;
+        }
+        return env->values[index];
+    }
+    void defineGlobal(int symbol, const Value& value) {
+        if (symbol >= global->values.size()) {
+            global->values.resize(symbol + 1);
+        }
+        global->values[symbol] = value;
+    }
+    bool isGlobalDefined(int symbol) const {
+        return symbol < global->values.size() && !global->values[symbol].isUnbound();
+    }
+    const Value& lookupGlobal(int symbol) const {
+        if (isGlobalDefined(symbol)) {
+            return global->values[symbol];
+        }
+        undefinedSymbol(symbol);
+    }
+
+    [[noreturn]] static void undefinedSymbol(int symbol);
 };
 
-// Script manager
-class Script : public QObject {
+// Script manager. Each Script owns the heap its objects live in and roots
+// it with the global environment.
+class Script : public QObject, private HeapRoots {
 
 public:
+    // TreeWalking evaluates the parsed tree directly and is kept as the
+    // reference implementation; Bytecode compiles each form and runs it on
+    // the VirtualMachine.
+    enum ExecutionMode {
+        TreeWalking,
+        Bytecode
+    };
+
     explicit Script(QObject *parent = nullptr);
+    ~Script();
 
-    QVector<QString> tokenize(const QString& str);
-    QSharedPointer<Expression> parse(QVector<QString>::iterator& it, QVector<QString>::iterator end);
+    // Reads the next datum from lexer onto the current heap
+    static Value parse(Lexer& lexer);
+    Value evaluate(const QString& source);
     void repl();
 
+    // Parses every form of source up front so run() can evaluate it again
+    // without reading, parsing or compiling. Throws on a syntax error, in
+    // which case nothing is loaded.
+    void load(const QString& source);
+    // Loads forms that were built on this script's heap
+    void load(const QVector<Value>& forms);
+    const QVector<Value>& getForms() const { return forms; }
+    // Evaluates the loaded forms in a fresh global environment, as if they
+    // were evaluated by a new Script. Bytecode is compiled on first use.
+    // progress, if set, is called after each form with the number of forms
+    // done and the total.
+    Value run(const std::function<void(int, int)>& progress = nullptr);
+    // Applies function to args in the global environment, which is how
+    // spawned actors start
+    Value call(const Value& function, const QVector<Value>& args);
+
+    ExecutionMode getExecutionMode() const { return executionMode; }
+    void setExecutionMode(ExecutionMode mode) { executionMode = mode; }
+
+    Heap* getHeap() const { return heap.data(); }
+    Environment* getGlobalEnvironment() const { return globalEnv; }
+
+    // The script's own mailbox; actors it spawns are its children
+    const QSharedPointer<Actor>& getActor() const { return actor; }
+    // Stops the script and every actor it spawned at their next safe point.
+    // May be called from any thread.
+    void interrupt();
+
+    // Reports calls to profiler while evaluating; nullptr turns it off. The
+    // profiler is not owned, and the caller starts and stops it.
+    Profiler* getProfiler() const { return profiler; }
+    void setProfiler(Profiler* p) { profiler = p; }
+
+    // Records which function allocated each object, so heapReport() can
+    // show what holds on to memory. Sites are only known while a profiler
+    // is set; without one everything counts as top level.
+    void setAllocationSiteTracking(bool enabled);
+    // Allocation counters by type, and what is reachable now by type and
+    // by allocation site
+    QString heapReport();
+
+    // Passes the optimizer runs over forms before they are evaluated. load()
+    // sees the whole program and runs all of them; evaluate() only the
+    // ones that do not depend on later forms.
+    Optimizer::Passes getOptimizerPasses() const { return optimizerPasses; }
+    void setOptimizerPasses(Optimizer::Passes passes) { optimizerPasses = passes; }
+    // What the optimizer did to the last source loaded or evaluated
+    const Optimizer::Statistics& getOptimizerStatistics() const { return optimizerStatistics; }
+
 private:
+    QScopedPointer<Heap> heap;
+    Environment* globalEnv;
+    QScopedPointer<VirtualMachine> vm;
+    ExecutionMode executionMode;
+    Profiler* profiler;
+    Optimizer::Passes optimizerPasses;
+    Optimizer::Statistics optimizerStatistics;
+    QSharedPointer<Actor> actor;
+    QVector<Value> forms;
+    QVector<CodeBlock*> compiledForms;
+
+    void traceRoots(Heap& heap) const override;
+
+    void defineBuiltins();
+    Value execute(const Value& expr, CodeBlock* code);
     QString scriptEscapeString(const QString& str);
 };
 
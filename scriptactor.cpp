@@ -0,0 +1,725 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptactor.cpp
+#include "scriptactor.h"
+#include "script.h"
+#include "scriptcompiler.h"
+#include "scriptdatum.h"
+#include "scripthashtable.h"
+#include "scriptreader.h"
+#include "scriptvector.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QThread>
+#include <algorithm>
+#include <climits>
+#include <deque>
+
+static thread_local Actor* currentActor = nullptr;
+
+//******************************************//
+//***************** Copying ****************//
+//******************************************//
+
+// Copies values from another heap into the current one, keeping shared
+// structure and cycles intact. The source must not change while this runs,
+// which holds for spawn: the spawner copies out of its own heap, on its own
+// thread, into the heap of an actor that has not started yet. A global
+// environment is copied over the target's, so the copy sees every global
+// definition the original did.
+class HeapCopier {
+public:
+    explicit HeapCopier(Environment* global) : targetGlobal(global) {}
+
+    Value copy(const Value& value) {
+        if (!value.isObject()) {
+            return value;
+        }
+        return Value(copyObject(value.asObject()));
+    }
+
+private:
+    Environment* targetGlobal;
+    QHash<const HeapObject*, HeapObject*> copies;
+
+    Expression* copyObject(const Expression* object);
+    Environment* copyEnvironment(const Environment* env);
+    CodeBlock* copyCode(const CodeBlock* code);
+
+    template <typename Vector>
+    Vector* copyVector(const Vector* vector) {
+        auto copied = Heap::create<Vector>(vector->size());
+        std::copy(vector->data(), vector->data() + vector->size(), copied->data());
+        return copied;
+    }
+};
+
+Expression* HeapCopier::copyObject(const Expression* object) {
+    if (HeapObject* done = copies.value(object)) {
+        return static_cast<Expression*>(done);
+    }
+    Expression* copied = nullptr;
+    switch (object->kind()) {
+    case ExpressionKind::List: {
+        const auto& elements = static_cast<const List*>(object)->getElements();
+        QVector<Value> copiedElements;
+        copiedElements.reserve(elements.size());
+        for (const auto& element : elements) {
+            copiedElements.append(copy(element));
+        }
+        copied = Heap::create<List>(copiedElements, static_cast<const List*>(object)->getLine());
+        break;
+    }
+    case ExpressionKind::String:
+        copied = Heap::create<String>(static_cast<const String*>(object)->getValue());
+        break;
+    case ExpressionKind::Function: {
+        // Registered before its closure is copied, which may refer back to it
+        const auto* function = static_cast<const Function*>(object);
+        auto copiedFunction = Heap::create<Function>(function->parameters, Value(), nullptr, function->line);
+        copies.insert(object, copiedFunction);
+        copiedFunction->body = copy(function->body);
+        copiedFunction->code = function->code ? copyCode(function->code) : nullptr;
+        copiedFunction->closure = copyEnvironment(function->closure);
+        copiedFunction->name = function->name;
+        return copiedFunction;
+    }
+    case ExpressionKind::Primitive: {
+        // The target has its own builtins bound already
+        const auto* primitive = static_cast<const Primitive*>(object);
+        if (primitive->symbol < targetGlobal->values.size()) {
+            const Value& bound = targetGlobal->values[primitive->symbol];
+            if (bound.is(ExpressionKind::Primitive) && bound.as<Primitive>()->callback == primitive->callback) {
+                copied = bound.asObject();
+                break;
+            }
+        }
+        copied = Heap::create<Primitive>(primitive->name, primitive->minArgs, primitive->maxArgs, primitive->callback);
+        break;
+    }
+    case ExpressionKind::Class: {
+        // Shapes are not copied; instances copied along rebuild theirs from
+        // the new class's root shape
+        const auto* cls = static_cast<const Class*>(object);
+        auto copiedClass = Heap::create<Class>();
+        copies.insert(object, copiedClass);
+        for (auto it = cls->methods.constBegin(); it != cls->methods.constEnd(); ++it) {
+            copiedClass->methods.insert(it.key(), copy(it.value()));
+        }
+        return copiedClass;
+    }
+    case ExpressionKind::Instance: {
+        const auto* instance = static_cast<const Instance*>(object);
+        auto copiedInstance = Heap::create<Instance>(nullptr);
+        copies.insert(object, copiedInstance);
+        copiedInstance->cls = static_cast<Class*>(copyObject(instance->cls));
+        copiedInstance->shape = copiedInstance->cls->getRootShape();
+        for (int slot = 0; slot < instance->slotValues.size(); ++slot) {
+            copiedInstance->setAttribute(instance->shape->nameAt(slot), copy(instance->slotValues[slot]));
+        }
+        return copiedInstance;
+    }
+    case ExpressionKind::F64Vector:
+        copied = copyVector(static_cast<const F64Vector*>(object));
+        break;
+    case ExpressionKind::S32Vector:
+        copied = copyVector(static_cast<const S32Vector*>(object));
+        break;
+    case ExpressionKind::Actor:
+        copied = Heap::create<ActorReference>(static_cast<const ActorReference*>(object)->getActor());
+        break;
+    case ExpressionKind::DatumFile:
+        // Both actors read from the same file, each datum going to one
+        copied = Heap::create<DatumFileReference>(static_cast<const DatumFileReference*>(object)->getFile());
+        break;
+    case ExpressionKind::StringPort: {
+        // The receiver gets its own port holding what was written so far
+        auto port = Heap::create<StringPort>();
+        port->write(static_cast<const StringPort*>(object)->getBuffer());
+        copied = port;
+        break;
+    }
+    case ExpressionKind::HashTable: {
+        const auto* table = static_cast<const HashTable*>(object);
+        auto copiedTable = Heap::create<HashTable>(table->size());
+        copies.insert(object, copiedTable);
+        table->forEach([this, copiedTable](const Value& key, const Value& value) {
+            copiedTable->insert(copy(key), copy(value));
+        });
+        return copiedTable;
+    }
+    }
+    copies.insert(object, copied);
+    return copied;
+}
+
+Environment* HeapCopier::copyEnvironment(const Environment* env) {
+    if (!env) {
+        return nullptr;
+    }
+    if (HeapObject* done = copies.value(env)) {
+        return static_cast<Environment*>(done);
+    }
+    if (!env->parent) {
+        copies.insert(env, targetGlobal);
+        for (int symbol = 0; symbol < env->values.size(); ++symbol) {
+            if (!env->values[symbol].isUnbound()) {
+                targetGlobal->defineGlobal(symbol, copy(env->values[symbol]));
+            }
+        }
+        return targetGlobal;
+    }
+    auto copied = Heap::create<Environment>();
+    copies.insert(env, copied);
+    copied->parent = copyEnvironment(env->parent);
+    copied->global = copied->parent->global;
+    copied->names = env->names;
+    copied->values.reserve(env->values.size());
+    for (const auto& value : env->values) {
+        copied->values.append(copy(value));
+    }
+    return copied;
+}
+
+CodeBlock* HeapCopier::copyCode(const CodeBlock* code) {
+    if (HeapObject* done = copies.value(code)) {
+        return static_cast<CodeBlock*>(done);
+    }
+    auto copied = Heap::create<CodeBlock>();
+    copies.insert(code, copied);
+    copied->code = code->code;
+    copied->constants.reserve(code->constants.size());
+    for (const auto& constant : code->constants) {
+        copied->constants.append(copy(constant));
+    }
+    // Caches refer to shapes of the source heap, so the copy starts cold
+    copied->caches.resize(code->caches.size());
+    copied->functions.reserve(code->functions.size());
+    for (const CodeBlock* function : code->functions) {
+        copied->functions.append(copyCode(function));
+    }
+    copied->parameterCount = code->parameterCount;
+    copied->frameSize = code->frameSize;
+    copied->maxStack = code->maxStack;
+    copied->name = code->name;
+    copied->line = code->line;
+    return copied;
+}
+
+//******************************************//
+//**************** Messages ****************//
+//******************************************//
+
+namespace {
+
+// Messages are datums, plus actor references written as an index into the
+// message's actor table
+class MessageWriter : public DatumWriter {
+    QVector<QSharedPointer<Actor>>& actors;
+public:
+    MessageWriter(QDataStream& stream, QVector<QSharedPointer<Actor>>& table)
+        : DatumWriter(stream), actors(table) {}
+protected:
+    bool writeExtension(const Value& value) override {
+        if (!value.is(ExpressionKind::Actor)) {
+            return false;
+        }
+        out << quint32(actors.size());
+        actors.append(value.as<ActorReference>()->getActor());
+        return true;
+    }
+};
+
+class MessageReader : public DatumReader {
+    const QVector<QSharedPointer<Actor>>& actors;
+public:
+    MessageReader(QDataStream& stream, const QVector<QSharedPointer<Actor>>& table)
+        : DatumReader(stream), actors(table) {}
+protected:
+    Value readExtension() override {
+        quint32 index = 0;
+        in >> index;
+        if (index < quint32(actors.size())) {
+            return Value(Heap::create<ActorReference>(actors[index]));
+        }
+        in.setStatus(QDataStream::ReadCorruptData);
+        return Value();
+    }
+};
+
+} // namespace
+
+//******************************************//
+//**************** Scheduler ***************//
+//******************************************//
+
+// A spawned actor: its own script and the call it starts with, which stays
+// a root of the script's heap until the actor finishes
+class ActorTask : private HeapRoots {
+public:
+    QScopedPointer<Script> script;
+    Value function;
+    QVector<Value> args;
+
+    ActorTask() : script(new Script) {
+        script->getHeap()->addRoots(this);
+    }
+    ~ActorTask() override {
+        script->getHeap()->removeRoots(this);
+    }
+
+    void run() {
+        try {
+            script->call(function, args);
+        }
+        catch (const Interrupted&) {
+        }
+        catch (const std::exception& e) {
+            qCritical() << "Actor" << script->getActor()->getId() << "failed:" << e.what();
+        }
+    }
+
+private:
+    void traceRoots(Heap& heap) const override {
+        heap.mark(function);
+        for (const auto& arg : args) {
+            heap.mark(arg);
+        }
+    }
+};
+
+// Runs spawned actors on one worker thread per core. Each worker has its own
+// deque of ready actors: it pushes and pops at the back, and a worker that
+// runs dry steals from the front of the others'. Actors run until their
+// function returns.
+//
+// An actor waiting in receive keeps its thread, since its evaluation lives
+// on that thread's stack. While it waits the scheduler counts the thread as
+// blocked and starts a spare thread whenever ready actors would otherwise
+// find fewer running threads than cores. Spare threads only steal, and exit
+// once they find no work while enough others are running again. Actors that
+// all wait on each other therefore cost a thread each, but never deadlock
+// for want of one.
+class ActorScheduler {
+public:
+    static ActorScheduler& instance() {
+        static ActorScheduler scheduler;
+        return scheduler;
+    }
+
+    // Must be called before the first actor is spawned; 0 means one per core
+    static void setWorkerCount(int count) { requestedWorkers = count; }
+
+    void schedule(ActorTask* task);
+
+    // Marks the current thread as blocked for the lifetime of the scope if
+    // it is a scheduler thread
+    class Blocking {
+        bool counted;
+    public:
+        Blocking();
+        ~Blocking();
+    };
+
+private:
+    struct Worker {
+        QMutex mutex;
+        std::deque<ActorTask*> ready;
+        QThread* thread = nullptr;
+    };
+
+    // Spare threads have no deque of their own
+    static constexpr int SpareWorker = -1;
+
+    QVector<Worker*> workers;
+    QAtomicInt readyCount;
+    QAtomicInt nextWorker;
+    QMutex liveMutex;
+    QSet<ActorTask*> live;
+
+    // Guarded by idleMutex
+    QMutex idleMutex;
+    QWaitCondition workAvailable;
+    bool stopping = false;
+    int threadCount = 0;
+    int idleCount = 0;
+    int blockedCount = 0;
+    QVector<QThread*> spareThreads;
+
+    static int requestedWorkers;
+    static thread_local bool onSchedulerThread;
+    static thread_local int currentWorker;
+
+    ActorScheduler();
+    ~ActorScheduler();
+
+    ActorTask* take(int index);
+    void execute(ActorTask* task);
+    void work(int index);
+    void startSpareIfNeeded();
+};
+
+int ActorScheduler::requestedWorkers = 0;
+thread_local bool ActorScheduler::onSchedulerThread = false;
+thread_local int ActorScheduler::currentWorker = ActorScheduler::SpareWorker;
+
+ActorScheduler::ActorScheduler() {
+    int count = requestedWorkers > 0 ? requestedWorkers : qMax(1, QThread::idealThreadCount());
+    threadCount = count;
+    for (int i = 0; i < count; ++i) {
+        workers.append(new Worker);
+    }
+    for (int i = 0; i < count; ++i) {
+        workers[i]->thread = QThread::create([this, i] { work(i); });
+        workers[i]->thread->start();
+    }
+}
+
+ActorScheduler::~ActorScheduler() {
+    {
+        QMutexLocker locker(&liveMutex);
+        for (ActorTask* task : live) {
+            task->script->interrupt();
+        }
+    }
+    {
+        QMutexLocker locker(&idleMutex);
+        stopping = true;
+        workAvailable.wakeAll();
+    }
+    for (Worker* worker : workers) {
+        worker->thread->wait();
+        delete worker->thread;
+    }
+    // No spares start once stopping is set
+    QVector<QThread*> spares;
+    {
+        QMutexLocker locker(&idleMutex);
+        spares = spareThreads;
+    }
+    for (QThread* thread : spares) {
+        thread->wait();
+        delete thread;
+    }
+    for (Worker* worker : workers) {
+        for (ActorTask* task : worker->ready) {
+            delete task;
+        }
+        delete worker;
+    }
+}
+
+void ActorScheduler::schedule(ActorTask* task) {
+    {
+        QMutexLocker locker(&liveMutex);
+        live.insert(task);
+    }
+    int index = currentWorker >= 0 ? currentWorker : int(quint32(nextWorker.fetchAndAddRelaxed(1)) % workers.size());
+    {
+        QMutexLocker locker(&workers[index]->mutex);
+        workers[index]->ready.push_back(task);
+    }
+    readyCount.fetchAndAddRelease(1);
+    QMutexLocker locker(&idleMutex);
+    if (idleCount > 0) {
+        workAvailable.wakeOne();
+    }
+    else {
+        startSpareIfNeeded();
+    }
+}
+
+// Called with idleMutex held
+void ActorScheduler::startSpareIfNeeded() {
+    if (stopping || threadCount - blockedCount >= workers.size()) {
+        return;
+    }
+    // Reaps spares that have exited, so blocking in a loop does not pile
+    // up finished threads
+    for (int i = spareThreads.size() - 1; i >= 0; --i) {
+        if (spareThreads[i]->isFinished()) {
+            delete spareThreads.takeAt(i);
+        }
+    }
+    QThread* thread = QThread::create([this] { work(SpareWorker); });
+    spareThreads.append(thread);
+    threadCount++;
+    thread->start();
+}
+
+ActorScheduler::Blocking::Blocking() : counted(onSchedulerThread) {
+    if (!counted) {
+        return;
+    }
+    ActorScheduler& scheduler = instance();
+    QMutexLocker locker(&scheduler.idleMutex);
+    scheduler.blockedCount++;
+    if (scheduler.idleCount == 0 && scheduler.readyCount.loadAcquire() > 0) {
+        scheduler.startSpareIfNeeded();
+    }
+}
+
+ActorScheduler::Blocking::~Blocking() {
+    if (!counted) {
+        return;
+    }
+    ActorScheduler& scheduler = instance();
+    QMutexLocker locker(&scheduler.idleMutex);
+    scheduler.blockedCount--;
+}
+
+ActorTask* ActorScheduler::take(int index) {
+    if (index >= 0) {
+        Worker* own = workers[index];
+        QMutexLocker locker(&own->mutex);
+        if (!own->ready.empty()) {
+            ActorTask* task = own->ready.back();
+            own->ready.pop_back();
+            readyCount.fetchAndSubRelaxed(1);
+            return task;
+        }
+    }
+    for (int i = index >= 0 ? 1 : 0; i < workers.size(); ++i) {
+        Worker* victim = workers[(qMax(index, 0) + i) % workers.size()];
+        QMutexLocker locker(&victim->mutex);
+        if (!victim->ready.empty()) {
+            ActorTask* task = victim->ready.front();
+            victim->ready.pop_front();
+            readyCount.fetchAndSubRelaxed(1);
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void ActorScheduler::execute(ActorTask* task) {
+    task->run();
+    {
+        QMutexLocker locker(&liveMutex);
+        live.remove(task);
+    }
+    delete task;
+}
+
+void ActorScheduler::work(int index) {
+    onSchedulerThread = true;
+    currentWorker = index;
+    for (;;) {
+        if (ActorTask* task = take(index)) {
+            execute(task);
+            continue;
+        }
+        QMutexLocker locker(&idleMutex);
+        if (stopping) {
+            if (index == SpareWorker) {
+                threadCount--;
+            }
+            return;
+        }
+        if (index == SpareWorker && threadCount - blockedCount > workers.size()) {
+            threadCount--;
+            return;
+        }
+        if (readyCount.loadAcquire() <= 0) {
+            idleCount++;
+            workAvailable.wait(&idleMutex);
+            idleCount--;
+        }
+    }
+}
+
+//******************************************//
+//****************** Actor *****************//
+//******************************************//
+
+static QAtomicInteger<quint64> nextActorId;
+static constexpr int WaitSliceMs = 20;
+
+Actor::Actor(Heap* h) : id(nextActorId.fetchAndAddRelaxed(1) + 1), heap(h) {}
+
+Actor* Actor::current() {
+    return currentActor;
+}
+
+Actor::Scope::Scope(Actor* actor) : previous(currentActor) {
+    currentActor = actor;
+}
+
+Actor::Scope::~Scope() {
+    currentActor = previous;
+}
+
+void Actor::post(Message message) {
+    QMutexLocker locker(&mutex);
+    mailbox.enqueue(std::move(message));
+    arrived.wakeOne();
+}
+
+bool Actor::take(Message& message, int timeoutMs) {
+    {
+        QMutexLocker locker(&mutex);
+        if (!mailbox.isEmpty()) {
+            message = mailbox.dequeue();
+            return true;
+        }
+    }
+    ActorScheduler::Blocking blocking;
+    QElapsedTimer timer;
+    timer.start();
+    for (;;) {
+        {
+            QMutexLocker locker(&mutex);
+            if (!mailbox.isEmpty()) {
+                message = mailbox.dequeue();
+                return true;
+            }
+        }
+        Heap::current()->checkInterrupt();
+        qint64 remaining = -1;
+        if (timeoutMs >= 0) {
+            remaining = timeoutMs - timer.elapsed();
+            if (remaining <= 0) {
+                return false;
+            }
+        }
+        // Waits are sliced so an interrupt that races the wait is seen
+        QMutexLocker locker(&mutex);
+        if (mailbox.isEmpty()) {
+            arrived.wait(&mutex, ulong(remaining < 0 ? WaitSliceMs : qBound<qint64>(1, remaining, WaitSliceMs)));
+        }
+    }
+}
+
+void Actor::addChild(const QSharedPointer<Actor>& child) {
+    QMutexLocker locker(&mutex);
+    children.erase(std::remove_if(children.begin(), children.end(),
+                                  [](const QWeakPointer<Actor>& c) { return c.isNull(); }),
+                   children.end());
+    children.append(child);
+}
+
+void Actor::interrupt() {
+    QVector<QSharedPointer<Actor>> spawned;
+    {
+        QMutexLocker locker(&mutex);
+        if (heap) {
+            heap->interrupt();
+        }
+        for (const auto& child : children) {
+            if (QSharedPointer<Actor> strong = child.toStrongRef()) {
+                spawned.append(strong);
+            }
+        }
+        arrived.wakeAll();
+    }
+    for (const auto& child : spawned) {
+        child->interrupt();
+    }
+}
+
+void Actor::detach() {
+    QMutexLocker locker(&mutex);
+    heap = nullptr;
+}
+
+//******************************************//
+//**************** Primitives **************//
+//******************************************//
+
+[[noreturn]] static void actorError(const QString& message) {
+    qCritical() << message;
+    throw std::runtime_error(message.toStdString());
+}
+
+static Actor* checkCurrentActor(const char* name) {
+    Actor* actor = Actor::current();
+    if (!actor) {
+        actorError(QString("%1 must be called from a running script").arg(name));
+    }
+    return actor;
+}
+
+static Value primitiveSpawn(const Value* args, int argc) {
+    if (!args[0].is(ExpressionKind::Function) && !args[0].is(ExpressionKind::Primitive)) {
+        actorError("First argument to spawn must be a procedure");
+    }
+    Actor* parent = checkCurrentActor("spawn");
+    QScopedPointer<ActorTask> task(new ActorTask);
+    {
+        Heap::Scope scope(task->script->getHeap());
+        HeapCopier copier(task->script->getGlobalEnvironment());
+        task->function = copier.copy(args[0]);
+        for (int i = 1; i < argc; ++i) {
+            task->args.append(copier.copy(args[i]));
+        }
+    }
+    QSharedPointer<Actor> child = task->script->getActor();
+    parent->addChild(child);
+    ActorScheduler::instance().schedule(task.take());
+    return Value(Heap::create<ActorReference>(child));
+}
+
+static Value primitiveSend(const Value* args, int) {
+    if (!args[0].is(ExpressionKind::Actor)) {
+        actorError("First argument to send must be an actor");
+    }
+    Actor::Message message;
+    {
+        QDataStream out(&message.data, QIODevice::WriteOnly);
+        MessageWriter writer(out, message.actors);
+        if (!writer.write(args[1])) {
+            actorError("Only data and actors can be sent to an actor");
+        }
+    }
+    args[0].as<ActorReference>()->getActor()->post(std::move(message));
+    return args[1];
+}
+
+// (receive) waits for the next message; (receive ms) gives up after ms
+// milliseconds and returns #f
+static Value primitiveReceive(const Value* args, int argc) {
+    Actor* actor = checkCurrentActor("receive");
+    int timeoutMs = -1;
+    if (argc > 0) {
+        if (!args[0].isFixnum() || args[0].asFixnum() < 0) {
+            actorError("Argument to receive must be a timeout in milliseconds");
+        }
+        timeoutMs = int(qMin<qint64>(args[0].asFixnum(), INT_MAX));
+    }
+    Actor::Message message;
+    if (!actor->take(message, timeoutMs)) {
+        return Value::boolean(false);
+    }
+    QDataStream in(message.data);
+    MessageReader reader(in, message.actors);
+    return reader.read();
+}
+
+static Value primitiveSelf(const Value*, int) {
+    Actor* actor = checkCurrentActor("self");
+    return Value(Heap::create<ActorReference>(actor->sharedFromThis()));
+}
+
+void defineActorPrimitives(Environment* env) {
+    env->define("spawn", Value(Heap::create<Primitive>("spawn", 1, Primitive::Variadic, primitiveSpawn)));
+    env->define("send", Value(Heap::create<Primitive>("send", 2, 2, primitiveSend)));
+    env->define("receive", Value(Heap::create<Primitive>("receive", 0, 1, primitiveReceive)));
+    env->define("self", Value(Heap::create<Primitive>("self", 0, 0, primitiveSelf)));
+}
+
+void setActorWorkerCount(int count) {
+    ActorScheduler::setWorkerCount(count);
+}
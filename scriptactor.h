@@ -0,0 +1,105 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptactor.h
+#ifndef SCRIPTACTOR_H
+#define SCRIPTACTOR_H
+
+#include "scriptvalue.h"
+
+#include <QByteArray>
+#include <QMutex>
+#include <QQueue>
+#include <QSharedPointer>
+#include <QVector>
+#include <QWaitCondition>
+
+class Environment;
+
+// Mailbox of an actor. Every Script has one, and (spawn f arg ...) starts
+// f on a new Script with its own heap and global environment, which runs on
+// the actor scheduler's worker threads. Actors share nothing but mailboxes:
+// send copies the message out of the sender's heap into a detached Message,
+// and receive builds it again on the receiver's heap, so the evaluators
+// never take a lock.
+class Actor : public QEnableSharedFromThis<Actor> {
+public:
+    // A value detached from any heap. Actor references travel alongside
+    // the data, which refers to them by index.
+    struct Message {
+        QByteArray data;
+        QVector<QSharedPointer<Actor>> actors;
+    };
+
+    explicit Actor(Heap* heap);
+
+    quint64 getId() const { return id; }
+
+    // The actor whose script is running on this thread, or nullptr
+    static Actor* current();
+
+    // Makes an actor current on this thread for the lifetime of the scope
+    class Scope {
+        Actor* previous;
+    public:
+        explicit Scope(Actor* actor);
+        ~Scope();
+    };
+
+    // Safe to call from any thread
+    void post(Message message);
+    // Waits up to timeoutMs for a message, or forever if negative. Only
+    // the actor's own thread takes messages. A scheduler thread waiting
+    // here counts as blocked, so other ready actors get a thread of their
+    // own meanwhile. Throws Interrupted when the actor is.
+    bool take(Message& message, int timeoutMs);
+
+    void addChild(const QSharedPointer<Actor>& child);
+    // Interrupts the actor's script and, recursively, every actor it spawned
+    void interrupt();
+    // Called when the heap goes away with its script; the mailbox may live
+    // on in references held elsewhere
+    void detach();
+
+private:
+    const quint64 id;
+    QMutex mutex;
+    QWaitCondition arrived;
+    QQueue<Message> mailbox;
+    Heap* heap;
+    QVector<QWeakPointer<Actor>> children;
+};
+
+// Script value referring to an actor. It keeps the mailbox alive, not the
+// actor's heap.
+class ActorReference : public Expression {
+    QSharedPointer<Actor> actor;
+public:
+    explicit ActorReference(const QSharedPointer<Actor>& a) : actor(a) {}
+    ExpressionKind kind() const override { return ExpressionKind::Actor; }
+    QString toString() const override {
+        return QString("<actor %1>").arg(actor->getId());
+    }
+    const QSharedPointer<Actor>& getActor() const { return actor; }
+};
+
+// Binds spawn, send, receive and self in the global environment env
+void defineActorPrimitives(Environment* env);
+
+// Number of threads spawned actors run on when none of them is blocked in
+// receive; 0, the default, is one per core. Only takes effect before the
+// first actor is spawned.
+void setActorWorkerCount(int count);
+
+#endif // SCRIPTACTOR_H
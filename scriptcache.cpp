@@ -0,0 +1,239 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptcache.cpp
+#include "scriptcache.h"
+#include "databasemanager.h"
+#include "script.h"
+#include "scriptdatum.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+#include <QDebug>
+
+namespace {
+
+// Bumped when the stored layout, the datum format or what the optimizer
+// does to the forms changes
+const quint32 FormatVersion = 2;
+
+} // namespace
+
+ScriptCache::ScriptCache(QObject *parent)
+    : QObject(parent),
+      database(nullptr),
+      hits(0),
+      databaseHits(0),
+      misses(0)
+{
+    connect(&watcher, &QFileSystemWatcher::fileChanged, this, &ScriptCache::fileChanged);
+}
+
+QSharedPointer<Script> ScriptCache::acquire(const QString &path)
+{
+    QFileInfo info(path);
+    auto it = entries.find(path);
+    if (it != entries.end() && it->verified && it->size == info.size() && it->modified == info.lastModified()) {
+        if (QSharedPointer<Script> script = checkOut(path, *it)) {
+            ++hits;
+            return script;
+        }
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        return QSharedPointer<Script>();
+    }
+    QByteArray content = file.readAll();
+    file.close();
+    QByteArray contentHash = QCryptographicHash::hash(content, QCryptographicHash::Sha1);
+
+    // Saved again without changes, or only touched
+    if (it != entries.end() && it->contentHash == contentHash) {
+        it->size = info.size();
+        it->modified = info.lastModified();
+        it->verified = true;
+        watch(path);
+        if (QSharedPointer<Script> script = checkOut(path, *it)) {
+            ++hits;
+            return script;
+        }
+    }
+
+    QSharedPointer<Script> script(new Script);
+    QByteArray stored;
+    if (database) {
+        stored = database->getValue(databaseKey(path)).toByteArray();
+    }
+    if (readForms(stored, path, contentHash, *script)) {
+        ++databaseHits;
+    }
+    else {
+        ++misses;
+        script->load(QString::fromUtf8(content));
+        stored = writeForms(path, contentHash, *script);
+        if (database && !stored.isEmpty()) {
+            database->setValue(databaseKey(path), stored);
+        }
+    }
+
+    // Without stored forms no copies can be read back, so the script is
+    // handed out untracked and the entry is left as it was
+    if (stored.isEmpty()) {
+        return script;
+    }
+
+    // The same content only needs its forms again; the scripts already out
+    // with it are still taken back
+    if (it != entries.end() && it->contentHash == contentHash) {
+        it->forms = stored;
+        it->checkedOut.insert(script.data());
+        return script;
+    }
+
+    // Replacing the entry drops the idle scripts of the old content, and
+    // scripts still out with it are not taken back
+    Entry entry;
+    entry.contentHash = contentHash;
+    entry.size = info.size();
+    entry.modified = info.lastModified();
+    entry.verified = true;
+    entry.forms = stored;
+    entry.checkedOut.insert(script.data());
+    entries.insert(path, entry);
+    watch(path);
+    return script;
+}
+
+void ScriptCache::release(const QString &path, const QSharedPointer<Script> &script)
+{
+    auto it = entries.find(path);
+    if (it == entries.end() || !it->checkedOut.remove(script.data())) {
+        return;
+    }
+    if (it->idle.size() < QThread::idealThreadCount()) {
+        script->setProfiler(nullptr);
+        it->idle.append(script);
+    }
+}
+
+void ScriptCache::invalidate(const QString &path)
+{
+    entries.remove(path);
+    watcher.removePath(path);
+    if (database) {
+        database->removeValue(databaseKey(path));
+    }
+}
+
+void ScriptCache::clear()
+{
+    entries.clear();
+    if (!watcher.files().isEmpty()) {
+        watcher.removePaths(watcher.files());
+    }
+}
+
+void ScriptCache::fileChanged(const QString &path)
+{
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+        it->verified = false;
+    }
+    // Editors that save by replacing the file drop it from the watcher
+    if (QFileInfo::exists(path)) {
+        watch(path);
+    }
+}
+
+void ScriptCache::watch(const QString &path)
+{
+    if (!watcher.files().contains(path)) {
+        watcher.addPath(path);
+    }
+}
+
+QSharedPointer<Script> ScriptCache::checkOut(const QString &path, Entry &entry)
+{
+    QSharedPointer<Script> script;
+    if (!entry.idle.isEmpty()) {
+        script = entry.idle.takeLast();
+    }
+    else {
+        // Every script running at the same time needs its own heap, so
+        // another copy is read back from the stored forms
+        script.reset(new Script);
+        if (!readForms(entry.forms, path, entry.contentHash, *script)) {
+            return QSharedPointer<Script>();
+        }
+    }
+    entry.checkedOut.insert(script.data());
+    return script;
+}
+
+QString ScriptCache::databaseKey(const QString &path)
+{
+    // Paths contain the '.' the database uses to separate key levels
+    return "scriptcache." + QString::fromLatin1(QCryptographicHash::hash(path.toUtf8(), QCryptographicHash::Sha1).toHex());
+}
+
+bool ScriptCache::readForms(const QByteArray &stored, const QString &path, const QByteArray &contentHash, Script &script)
+{
+    if (stored.isEmpty()) {
+        return false;
+    }
+
+    QDataStream in(stored);
+    in.setVersion(QDataStream::Qt_5_15);
+    quint32 version = 0;
+    QString storedPath;
+    QByteArray storedHash;
+    quint32 count = 0;
+    in >> version >> storedPath >> storedHash >> count;
+    if (in.status() != QDataStream::Ok || version != FormatVersion || storedPath != path || storedHash != contentHash) {
+        return false;
+    }
+
+    Heap::Scope scope(script.getHeap());
+    DatumReader reader(in);
+    QVector<Value> forms;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+        forms.append(reader.read());
+    }
+    if (in.status() != QDataStream::Ok) {
+        qWarning() << "Ignoring corrupt cached script for" << path;
+        return false;
+    }
+    script.load(forms);
+    return true;
+}
+
+QByteArray ScriptCache::writeForms(const QString &path, const QByteArray &contentHash, const Script &script)
+{
+    QByteArray stored;
+    QDataStream out(&stored, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_15);
+    const QVector<Value> &forms = script.getForms();
+    out << FormatVersion << path << contentHash << quint32(forms.size());
+    DatumWriter writer(out);
+    for (const auto &form : forms) {
+        if (!writer.write(form)) {
+            return QByteArray();
+        }
+    }
+    return stored;
+}
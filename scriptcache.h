@@ -0,0 +1,97 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptcache.h
+#ifndef SCRIPTCACHE_H
+#define SCRIPTCACHE_H
+
+#include <QObject>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QDateTime>
+#include <QFileSystemWatcher>
+#include <QSharedPointer>
+
+class DatabaseManager;
+class Script;
+
+// Keeps scripts loaded from files parsed and ready to run, so running the
+// same file again skips reading, parsing and compiling it. Entries are keyed
+// by path and remember the file's content hash: a change reported by the
+// file system watcher, or a size or time stamp that no longer matches, makes
+// the next acquire() hash the file again and reload it only if the content
+// really changed. With a database set, the parsed forms are also stored there
+// by content hash, so a restart only has to read and hash the file.
+//
+// A script is checked out by acquire() until it is given back to release(),
+// so scripts running at the same time on different threads never share an
+// interpreter. Further copies of a file are read back from its stored forms
+// rather than parsed again. The cache itself is only used from the thread
+// that owns it.
+class ScriptCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ScriptCache(QObject *parent = nullptr);
+
+    // Persists parsed forms under the "scriptcache" key; nullptr keeps the
+    // cache in memory only
+    void setDatabase(DatabaseManager *manager) { database = manager; }
+
+    // Returns a script with the file loaded and ready to run(), or a null
+    // pointer if the file cannot be read. Throws on a syntax error. Scripts
+    // are reused across runs, so callers set up the profiler and execution
+    // mode on every run.
+    QSharedPointer<Script> acquire(const QString &path);
+    // Takes back a script from acquire() once it has finished running.
+    // Scripts loaded from content that has changed since are dropped.
+    void release(const QString &path, const QSharedPointer<Script> &script);
+    void invalidate(const QString &path);
+    void clear();
+
+    int getHits() const { return hits; }
+    int getDatabaseHits() const { return databaseHits; }
+    int getMisses() const { return misses; }
+
+private slots:
+    void fileChanged(const QString &path);
+
+private:
+    struct Entry {
+        QByteArray contentHash;
+        qint64 size;
+        QDateTime modified;
+        bool verified;
+        QByteArray forms;   // as stored in the database
+        QVector<QSharedPointer<Script>> idle;
+        QSet<const Script*> checkedOut;
+    };
+
+    QHash<QString, Entry> entries;
+    QFileSystemWatcher watcher;
+    DatabaseManager *database;
+    int hits;
+    int databaseHits;
+    int misses;
+
+    void watch(const QString &path);
+    QSharedPointer<Script> checkOut(const QString &path, Entry &entry);
+    static QString databaseKey(const QString &path);
+    static bool readForms(const QByteArray &stored, const QString &path, const QByteArray &contentHash, Script &script);
+    static QByteArray writeForms(const QString &path, const QByteArray &contentHash, const Script &script);
+};
+
+#endif // SCRIPTCACHE_H
@@ -0,0 +1,429 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptcompiler.cpp
+#include "scriptcompiler.h"
+#include <QDebug>
+
+void CodeBlock::trace(Heap& heap) const {
+    for (const auto& constant : constants) {
+        heap.mark(constant);
+    }
+    for (const CodeBlock* function : functions) {
+        heap.mark(function);
+    }
+    for (const auto& cache : caches) {
+        heap.mark(cache.shape);
+        heap.mark(cache.method);
+    }
+}
+
+static bool isLambda(const Value& expr) {
+    if (!expr.is(ExpressionKind::List)) {
+        return false;
+    }
+    const Value& head = expr.as<List>()->getElements()[0];
+    return head.isSymbol() && head.asSymbol() == SymbolTable::Lambda;
+}
+
+CodeBlock* Compiler::compile(const Value& expr) {
+    return compileBody(nullptr, expr);
+}
+
+CodeBlock* Compiler::compileBody(const QVector<int>* params, const Value& body) {
+    Scope* enclosing = scope;
+    Scope current;
+    current.block = Heap::create<CodeBlock>();
+    current.enclosing = enclosing;
+    if (params) {
+        current.global = false;
+        current.locals = *params;
+        current.block->parameterCount = params->size();
+        collectDefines(body, current.locals);
+        current.block->frameSize = current.locals.size();
+    }
+    scope = &current;
+
+    try {
+        compileExpression(body, true);
+        emitOp(OpCode::Return, -1);
+    }
+    catch (...) {
+        scope = enclosing;
+        throw;
+    }
+
+    scope = enclosing;
+    return current.block;
+}
+
+// Finds the names a lambda body defines, so they get slots in its frame.
+// Nested lambdas get their own frames and are not searched.
+void Compiler::collectDefines(const Value& expr, QVector<int>& locals) {
+    if (!expr.is(ExpressionKind::List)) {
+        return;
+    }
+    const auto& elements = expr.as<List>()->getElements();
+    if (elements[0].isSymbol()) {
+        int form = elements[0].asSymbol();
+        if (form == SymbolTable::Quote || form == SymbolTable::Lambda) {
+            return;
+        }
+        if (form == SymbolTable::Define && elements.size() == 3 && elements[1].isSymbol()) {
+            int name = elements[1].asSymbol();
+            if (!locals.contains(name)) {
+                locals.append(name);
+            }
+        }
+    }
+    for (const auto& element : elements) {
+        collectDefines(element, locals);
+    }
+}
+
+// tail is set when the value of expr is what the enclosing body returns, so
+// a call there can reuse the current frame
+void Compiler::compileExpression(const Value& expr, bool tail) {
+    if (expr.isSymbol()) {
+        compileVariable(expr.asSymbol());
+    }
+    else if (expr.is(ExpressionKind::List)) {
+        compileList(*expr.as<List>(), tail);
+    }
+    else {
+        emitOp(OpCode::Constant, 1);
+        emitOperand(addConstant(expr));
+    }
+}
+
+void Compiler::compileVariable(int symbol) {
+    int depth = 0;
+    for (Scope* current = scope; !current->global; current = current->enclosing) {
+        int index = current->locals.indexOf(symbol);
+        if (index >= 0) {
+            emitOp(OpCode::LoadLocal, 1);
+            emitOperand(depth);
+            emitOperand(index);
+            emitOperand(symbol);
+            return;
+        }
+        depth++;
+    }
+    emitOp(OpCode::LoadGlobal, 1);
+    emitOperand(symbol);
+}
+
+void Compiler::compileList(const List& list, bool tail) {
+    const auto& elements = list.getElements();
+    if (elements[0].isSymbol()) {
+        int form = elements[0].asSymbol();
+        if (form == SymbolTable::Define) {
+            compileDefine(list);
+            return;
+        }
+        else if (form == SymbolTable::Lambda) {
+            compileLambda(list);
+            return;
+        }
+        else if (form == SymbolTable::Class) {
+            compileClass(list);
+            return;
+        }
+        else if (form == SymbolTable::New) {
+            compileNew(list);
+            return;
+        }
+        else if (form == SymbolTable::Quote) {
+            if (elements.size() != 2) {
+                qCritical() << "Incorrect number of arguments for quote";
+                throw std::runtime_error("Incorrect number of arguments for quote");
+            }
+            emitOp(OpCode::Constant, 1);
+            emitOperand(addConstant(elements[1]));
+            return;
+        }
+        else if (form == SymbolTable::If) {
+            compileIf(list, tail);
+            return;
+        }
+        else if (form == SymbolTable::Begin) {
+            compileBegin(list, tail);
+            return;
+        }
+        else if (form == SymbolTable::Cond) {
+            compileCond(list, tail);
+            return;
+        }
+        else if (form == SymbolTable::Let) {
+            compileLet(list, tail);
+            return;
+        }
+    }
+
+    compileCall(list, tail);
+}
+
+void Compiler::compileCall(const List& list, bool tail) {
+    const auto& elements = list.getElements();
+    compileExpression(elements[0]);
+
+    // The first argument doubles as the method name when the callee turns out
+    // to be an Instance, which is only known at run time
+    for (int i = 1; i < elements.size(); ++i) {
+        if (i == 1 && elements[i].isSymbol()) {
+            emitOp(OpCode::Selector, 0);
+            emitOperand(addConstant(elements[i]));
+            emitOperand(0);
+            int target = scope->block->code.size() - 1;
+            emitOperand(scope->block->caches.size());
+            scope->block->caches.append(InlineCache());
+            compileVariable(elements[i].asSymbol());
+            patchJump(target);
+        }
+        else {
+            compileExpression(elements[i]);
+        }
+    }
+
+    int argc = elements.size() - 1;
+    emitOp(tail ? OpCode::TailCall : OpCode::Call, -argc);
+    emitOperand(argc);
+}
+
+void Compiler::compileDefine(const List& list) {
+    const auto& elements = list.getElements();
+    if (elements.size() != 3) {
+        qCritical() << "Incorrect number of arguments for define";
+        throw std::runtime_error("Incorrect number of arguments for define");
+    }
+    if (!elements[1].isSymbol()) {
+        qCritical() << "First argument to define must be a symbol";
+        throw std::runtime_error("First argument to define must be a symbol");
+    }
+    compileExpression(elements[2]);
+    int name = elements[1].asSymbol();
+    if (isLambda(elements[2])) {
+        scope->block->functions.last()->name = name;
+    }
+    if (scope->global) {
+        emitOp(OpCode::DefineGlobal, 0);
+        emitOperand(name);
+    }
+    else {
+        emitOp(OpCode::DefineLocal, 0);
+        emitOperand(scope->locals.indexOf(name));
+    }
+}
+
+void Compiler::compileLambda(const List& list) {
+    const auto& elements = list.getElements();
+    if (elements.size() != 3) {
+        qCritical() << "Incorrect number of arguments for lambda";
+        throw std::runtime_error("Incorrect number of arguments for lambda");
+    }
+    if (!elements[1].is(ExpressionKind::List) && !elements[1].isNil()) {
+        qCritical() << "Second argument to lambda must be a list of parameters";
+        throw std::runtime_error("Second argument to lambda must be a list of parameters");
+    }
+    QVector<int> paramNames;
+    if (!elements[1].isNil()) {
+        for (const auto& param : elements[1].as<List>()->getElements()) {
+            if (!param.isSymbol()) {
+                qCritical() << "Lambda parameters must be symbols";
+                throw std::runtime_error("Lambda parameters must be symbols");
+            }
+            paramNames.append(param.asSymbol());
+        }
+    }
+
+    auto function = compileBody(&paramNames, elements[2]);
+    function->line = list.getLine();
+    scope->block->functions.append(function);
+    emitOp(OpCode::MakeClosure, 1);
+    emitOperand(scope->block->functions.size() - 1);
+}
+
+void Compiler::compileClass(const List& list) {
+    const auto& elements = list.getElements();
+    if (elements.size() < 2) {
+        qCritical() << "Incorrect number of arguments for class";
+        throw std::runtime_error("Incorrect number of arguments for class");
+    }
+    QVector<int> methodNames;
+    for (int i = 1; i < elements.size(); i += 2) {
+        if (!elements[i].isSymbol() || i + 1 >= elements.size()) {
+            qCritical() << "Invalid class definition";
+            throw std::runtime_error("Invalid class definition");
+        }
+        methodNames.append(addConstant(elements[i]));
+        compileExpression(elements[i + 1]);
+        if (isLambda(elements[i + 1])) {
+            scope->block->functions.last()->name = elements[i].asSymbol();
+        }
+    }
+
+    emitOp(OpCode::MakeClass, 1 - methodNames.size());
+    emitOperand(methodNames.size());
+    for (int name : methodNames) {
+        emitOperand(name);
+    }
+}
+
+void Compiler::compileNew(const List& list) {
+    const auto& elements = list.getElements();
+    if (elements.size() != 2) {
+        qCritical() << "Incorrect number of arguments for new";
+        throw std::runtime_error("Incorrect number of arguments for new");
+    }
+    compileExpression(elements[1]);
+    emitOp(OpCode::New, 0);
+}
+
+void Compiler::compileIf(const List& list, bool tail) {
+    const auto& elements = list.getElements();
+    if (elements.size() != 3 && elements.size() != 4) {
+        qCritical() << "Incorrect number of arguments for if";
+        throw std::runtime_error("Incorrect number of arguments for if");
+    }
+    compileExpression(elements[1]);
+    int elseJump = emitJump(OpCode::JumpIfFalse, -1);
+    compileExpression(elements[2], tail);
+    int endJump = emitJump(OpCode::Jump, 0);
+
+    // Only one branch runs, so the else branch starts from the same depth
+    scope->depth--;
+    patchJump(elseJump);
+    if (elements.size() == 4) {
+        compileExpression(elements[3], tail);
+    }
+    else {
+        emitOp(OpCode::Constant, 1);
+        emitOperand(addConstant(Value::nil()));
+    }
+    patchJump(endJump);
+}
+
+void Compiler::compileBegin(const List& list, bool tail) {
+    const auto& elements = list.getElements();
+    if (elements.size() < 2) {
+        qCritical() << "Incorrect number of arguments for begin";
+        throw std::runtime_error("Incorrect number of arguments for begin");
+    }
+    compileSequence(elements, 1, tail);
+}
+
+// Compiles elements[first..] in order, keeping only the last value
+void Compiler::compileSequence(const QVector<Value>& elements, int first, bool tail) {
+    for (int i = first; i < elements.size(); ++i) {
+        bool last = i == elements.size() - 1;
+        compileExpression(elements[i], tail && last);
+        if (!last) {
+            emitOp(OpCode::Pop, -1);
+        }
+    }
+}
+
+void Compiler::compileCond(const List& list, bool tail) {
+    const auto& elements = list.getElements();
+    QVector<int> endJumps;
+    bool hasElse = false;
+    for (int i = 1; i < elements.size(); ++i) {
+        if (!elements[i].is(ExpressionKind::List) || elements[i].as<List>()->getElements().size() < 2) {
+            qCritical() << "Each cond clause must be a test followed by expressions";
+            throw std::runtime_error("Each cond clause must be a test followed by expressions");
+        }
+        const auto& clause = elements[i].as<List>()->getElements();
+        if (clause[0].isSymbol() && clause[0].asSymbol() == SymbolTable::Else) {
+            if (i != elements.size() - 1) {
+                qCritical() << "else must be the last cond clause";
+                throw std::runtime_error("else must be the last cond clause");
+            }
+            compileSequence(clause, 1, tail);
+            hasElse = true;
+            break;
+        }
+        compileExpression(clause[0]);
+        int nextClause = emitJump(OpCode::JumpIfFalse, -1);
+        compileSequence(clause, 1, tail);
+        endJumps.append(emitJump(OpCode::Jump, 0));
+        // Only one clause body runs, so the next test starts from the same depth
+        scope->depth--;
+        patchJump(nextClause);
+    }
+    if (!hasElse) {
+        emitOp(OpCode::Constant, 1);
+        emitOperand(addConstant(Value::nil()));
+    }
+    for (int jump : endJumps) {
+        patchJump(jump);
+    }
+}
+
+// (let ((name init) ...) body ...) is compiled as the application
+// ((lambda (name ...) (begin body ...)) init ...)
+void Compiler::compileLet(const List& list, bool tail) {
+    const auto& elements = list.getElements();
+    if (elements.size() < 3 || (!elements[1].is(ExpressionKind::List) && !elements[1].isNil())) {
+        qCritical() << "let needs a list of bindings and a body";
+        throw std::runtime_error("let needs a list of bindings and a body");
+    }
+    QVector<Value> names;
+    QVector<Value> call;
+    if (!elements[1].isNil()) {
+        for (const auto& binding : elements[1].as<List>()->getElements()) {
+            if (!binding.is(ExpressionKind::List) || binding.as<List>()->getElements().size() != 2
+                || !binding.as<List>()->getElements()[0].isSymbol()) {
+                qCritical() << "Each let binding must be a symbol and an expression";
+                throw std::runtime_error("Each let binding must be a symbol and an expression");
+            }
+            names.append(binding.as<List>()->getElements()[0]);
+            call.append(binding.as<List>()->getElements()[1]);
+        }
+    }
+    Value body = elements[2];
+    if (elements.size() > 3) {
+        QVector<Value> sequence = elements.mid(2);
+        sequence.prepend(Value::symbol(SymbolTable::Begin));
+        body = makeList(sequence);
+    }
+    call.prepend(makeList({ Value::symbol(SymbolTable::Lambda), makeList(names), body }));
+    compileCall(*makeList(call).as<List>(), tail);
+}
+
+void Compiler::emitOp(OpCode op, int stackEffect) {
+    scope->block->code.append(static_cast<qint32>(op));
+    scope->depth += stackEffect;
+    if (scope->depth > scope->block->maxStack) {
+        scope->block->maxStack = scope->depth;
+    }
+}
+
+void Compiler::emitOperand(qint32 operand) {
+    scope->block->code.append(operand);
+}
+
+int Compiler::emitJump(OpCode op, int stackEffect) {
+    emitOp(op, stackEffect);
+    emitOperand(0);
+    return scope->block->code.size() - 1;
+}
+
+void Compiler::patchJump(int operandIndex) {
+    scope->block->code[operandIndex] = scope->block->code.size();
+}
+
+int Compiler::addConstant(const Value& value) {
+    scope->block->constants.append(value);
+    return scope->block->constants.size() - 1;
+}
@@ -0,0 +1,118 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptcompiler.h
+#ifndef SCRIPTCOMPILER_H
+#define SCRIPTCOMPILER_H
+
+#include "script.h"
+
+#include <QVector>
+#include <QString>
+
+// Instruction set of the VirtualMachine. Operands follow the opcode inline
+// in the code stream.
+enum class OpCode : qint32 {
+    Constant,          // index into constants; pushes the constant
+    LoadLocal,         // depth, slot, symbol id; pushes a lexically addressed
+                       // variable, the id is only used for error messages
+    LoadGlobal,        // symbol id; pushes a global variable
+    DefineLocal,       // slot; binds the top of stack in the current frame, leaves it
+    DefineGlobal,      // symbol id; binds the top of stack globally, leaves it
+    Selector,          // constant index, target, cache index; when the callee
+                       // below is an Instance, looks up the method named by
+                       // the constant, makes it the callee with the instance
+                       // as first argument and jumps past the load that follows
+    Pop,
+    Jump,              // absolute target
+    JumpIfFalse,       // absolute target; pops the condition
+    MakeClosure,       // index into functions
+    MakeClass,         // method count, followed by that many constant indices
+                       // holding the method name symbols
+    New,
+    Call,              // argument count; callee sits below the arguments
+    TailCall,          // argument count; a Call in tail position that
+                       // replaces the current frame
+    Return
+};
+
+// Per call site memory of a Selector: what the method name resolved to on
+// the last instance seen there. A slot of -1 means the class method in
+// method, anything else an attribute slot. Valid for instances of shape.
+struct InlineCache {
+    const Shape* shape = nullptr;
+    int slot = -1;
+    Value method;
+};
+
+// Compiled form of one top-level expression or lambda body. A lambda's frame
+// holds its parameters in the first slots followed by its internal defines.
+class CodeBlock : public HeapObject {
+public:
+    QVector<qint32> code;
+    QVector<Value> constants;
+    QVector<CodeBlock*> functions;
+    mutable QVector<InlineCache> caches;
+    int parameterCount = 0;
+    int frameSize = 0;
+    int maxStack = 0;
+    int name = -1;          // symbol a lambda was defined as, for profiles
+    int line = 0;           // source line of the lambda
+
+    void trace(Heap& heap) const override;
+    const char* typeName() const override { return "CodeBlock"; }
+};
+
+// Translates parsed expressions into CodeBlocks. Variable references are
+// resolved at compile time: names bound by an enclosing lambda become
+// (depth, slot) pairs, everything else is looked up by symbol id in the
+// global environment.
+class Compiler {
+public:
+    CodeBlock* compile(const Value& expr);
+
+private:
+    struct Scope {
+        CodeBlock* block = nullptr;
+        QVector<int> locals;
+        bool global = true;
+        int depth = 0;
+        Scope* enclosing = nullptr;
+    };
+    Scope* scope = nullptr;
+
+    CodeBlock* compileBody(const QVector<int>* params, const Value& body);
+    void collectDefines(const Value& expr, QVector<int>& locals);
+    void compileExpression(const Value& expr, bool tail = false);
+    void compileVariable(int symbol);
+    void compileList(const List& list, bool tail);
+    void compileCall(const List& list, bool tail);
+    void compileDefine(const List& list);
+    void compileLambda(const List& list);
+    void compileClass(const List& list);
+    void compileNew(const List& list);
+    void compileIf(const List& list, bool tail);
+    void compileBegin(const List& list, bool tail);
+    void compileCond(const List& list, bool tail);
+    void compileLet(const List& list, bool tail);
+    void compileSequence(const QVector<Value>& elements, int first, bool tail);
+
+    void emitOp(OpCode op, int stackEffect);
+    void emitOperand(qint32 operand);
+    int emitJump(OpCode op, int stackEffect);
+    void patchJump(int operandIndex);
+    int addConstant(const Value& value);
+};
+
+#endif // SCRIPTCOMPILER_H
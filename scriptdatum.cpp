@@ -0,0 +1,198 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptdatum.cpp
+#include "scriptdatum.h"
+#include "script.h"
+#include "scriptvector.h"
+
+namespace {
+
+enum DatumTag : quint8 {
+    NilDatum,
+    BooleanDatum,
+    FixnumDatum,
+    FlonumDatum,
+    CharacterDatum,
+    SymbolDatum,
+    NewSymbolDatum,
+    StringDatum,
+    ListDatum,
+    F64VectorDatum,
+    S32VectorDatum,
+    ExtensionDatum
+};
+
+template <typename Vector>
+void writeVector(QDataStream& out, const Vector* vector) {
+    out << quint32(vector->size());
+    for (qsizetype i = 0; i < vector->size(); ++i) {
+        out << vector->data()[i];
+    }
+}
+
+template <typename Vector>
+Value readVector(QDataStream& in) {
+    quint32 size;
+    in >> size;
+    if (in.status() != QDataStream::Ok) {
+        return Value();
+    }
+    auto vector = Heap::create<Vector>(qsizetype(size));
+    for (quint32 i = 0; i < size; ++i) {
+        in >> vector->data()[i];
+    }
+    return Value(vector);
+}
+
+} // namespace
+
+bool DatumWriter::write(const Value& value) {
+    switch (value.getType()) {
+    case Value::Nil:
+        out << quint8(NilDatum);
+        return true;
+    case Value::Boolean:
+        out << quint8(BooleanDatum) << value.asBoolean();
+        return true;
+    case Value::Fixnum:
+        out << quint8(FixnumDatum) << value.asFixnum();
+        return true;
+    case Value::Flonum:
+        out << quint8(FlonumDatum) << value.asFlonum();
+        return true;
+    case Value::Character:
+        out << quint8(CharacterDatum) << quint32(value.asCharacter());
+        return true;
+    case Value::Symbol: {
+        auto it = symbols.constFind(value.asSymbol());
+        if (it != symbols.constEnd()) {
+            out << quint8(SymbolDatum) << it.value();
+        }
+        else {
+            symbols.insert(value.asSymbol(), quint32(symbols.size()));
+            out << quint8(NewSymbolDatum) << SymbolTable::name(value.asSymbol());
+        }
+        return true;
+    }
+    case Value::Object:
+        switch (value.asObject()->kind()) {
+        case ExpressionKind::String:
+            out << quint8(StringDatum) << value.as<String>()->getValue();
+            return true;
+        case ExpressionKind::List: {
+            const List* list = value.as<List>();
+            out << quint8(ListDatum) << qint32(list->getLine()) << quint32(list->getElements().size());
+            for (const auto& element : list->getElements()) {
+                if (!write(element)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case ExpressionKind::F64Vector:
+            out << quint8(F64VectorDatum);
+            writeVector(out, value.as<F64Vector>());
+            return true;
+        case ExpressionKind::S32Vector:
+            out << quint8(S32VectorDatum);
+            writeVector(out, value.as<S32Vector>());
+            return true;
+        default:
+            out << quint8(ExtensionDatum);
+            return writeExtension(value);
+        }
+    case Value::Unbound:
+        break;
+    }
+    return false;
+}
+
+bool DatumWriter::writeExtension(const Value& value) {
+    Q_UNUSED(value);
+    return false;
+}
+
+Value DatumReader::read() {
+    quint8 tag = 0;
+    in >> tag;
+    switch (tag) {
+    case NilDatum:
+        return Value::nil();
+    case BooleanDatum: {
+        bool value;
+        in >> value;
+        return Value::boolean(value);
+    }
+    case FixnumDatum: {
+        qint64 value;
+        in >> value;
+        return Value::fromFixnum(value);
+    }
+    case FlonumDatum: {
+        double value;
+        in >> value;
+        return Value::fromFlonum(value);
+    }
+    case CharacterDatum: {
+        quint32 value;
+        in >> value;
+        return Value::character(char32_t(value));
+    }
+    case SymbolDatum: {
+        quint32 index;
+        in >> index;
+        if (index < quint32(symbols.size())) {
+            return Value::symbol(symbols[index]);
+        }
+        break;
+    }
+    case NewSymbolDatum: {
+        QString name;
+        in >> name;
+        symbols.append(SymbolTable::intern(name));
+        return Value::symbol(symbols.last());
+    }
+    case StringDatum: {
+        QString value;
+        in >> value;
+        return Value(Heap::create<String>(value));
+    }
+    case ListDatum: {
+        qint32 line;
+        quint32 count;
+        in >> line >> count;
+        QVector<Value> elements;
+        for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+            elements.append(read());
+        }
+        return makeList(elements, line);
+    }
+    case F64VectorDatum:
+        return readVector<F64Vector>(in);
+    case S32VectorDatum:
+        return readVector<S32Vector>(in);
+    case ExtensionDatum:
+        return readExtension();
+    default:
+        break;
+    }
+    in.setStatus(QDataStream::ReadCorruptData);
+    return Value();
+}
+
+Value DatumReader::readExtension() {
+    in.setStatus(QDataStream::ReadCorruptData);
+    return Value();
+}
@@ -0,0 +1,68 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptdatum.h
+#ifndef SCRIPTDATUM_H
+#define SCRIPTDATUM_H
+
+#include "scriptvalue.h"
+
+#include <QDataStream>
+#include <QHash>
+#include <QVector>
+
+// Writes script data as a tree of tagged datums that a DatumReader can build
+// again on any heap: immediates, strings, lists and numeric vectors. Symbol
+// names are written once and referred to by index afterwards, since the ids
+// SymbolTable hands out differ between runs of the program. Other heap
+// objects are left to writeExtension().
+class DatumWriter {
+public:
+    explicit DatumWriter(QDataStream& stream) : out(stream) {}
+    virtual ~DatumWriter() = default;
+
+    // Returns false if value holds something the writer cannot store, in
+    // which case the stream holds a partial datum
+    bool write(const Value& value);
+
+protected:
+    QDataStream& out;
+
+    // Writes the payload of an object the format does not know, after its
+    // tag. Returns false to refuse the object.
+    virtual bool writeExtension(const Value& value);
+
+private:
+    QHash<int, quint32> symbols;
+};
+
+// Reads what a DatumWriter wrote, allocating on the current heap. Bad input
+// sets the stream's status to ReadCorruptData.
+class DatumReader {
+public:
+    explicit DatumReader(QDataStream& stream) : in(stream) {}
+    virtual ~DatumReader() = default;
+
+    Value read();
+
+protected:
+    QDataStream& in;
+
+    virtual Value readExtension();
+
+private:
+    QVector<int> symbols;
+};
+
+#endif // SCRIPTDATUM_H
@@ -0,0 +1,209 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptexecutor.cpp
+#include "scriptexecutor.h"
+#include "script.h"
+#include "scriptprofiler.h"
+
+#include <QElapsedTimer>
+#include <QRunnable>
+#include <QTimer>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// CPU time used by the calling thread so far
+static qint64 threadCpuTimeNs()
+{
+#if defined(Q_OS_WIN)
+    FILETIME creation, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel, &user)) {
+        return 0;
+    }
+    auto ticks = [](const FILETIME &time) {
+        return (qint64(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+    };
+    // FILETIME counts 100 ns ticks
+    return (ticks(kernel) + ticks(user)) * 100;
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0) {
+        return 0;
+    }
+    return qint64(time.tv_sec) * 1000000000 + time.tv_nsec;
+#endif
+}
+
+// Runs one ScriptRun on a pool thread. The run outlives the task: it only
+// deletes itself once the completion posted at the end has been delivered.
+class ScriptTask : public QRunnable
+{
+public:
+    explicit ScriptTask(ScriptRun *run) : handle(run), script(run->script), profiler(run->profiler) {}
+
+    void run() override
+    {
+        // A cancel that arrived after the previous run of this script ended
+        // would otherwise interrupt this one
+        script->getHeap()->clearInterrupt();
+        if (handle->cancelRequested.loadRelaxed()) {
+            post(ScriptRun::Cancelled, QString(), 0, 0);
+            return;
+        }
+
+        QMetaObject::invokeMethod(handle, [target = handle] { target->markStarted(); }, Qt::QueuedConnection);
+        if (profiler) {
+            profiler->start();
+        }
+        ScriptRun::State outcome = ScriptRun::Finished;
+        QString text;
+        QElapsedTimer wallClock;
+        wallClock.start();
+        qint64 cpuStart = threadCpuTimeNs();
+        try {
+            Value result = script->run([target = handle](int done, int total) {
+                QMetaObject::invokeMethod(target, [target, done, total] {
+                    emit target->progress(done, total);
+                }, Qt::QueuedConnection);
+            });
+            if (!result.isUnbound()) {
+                text = result.toString();
+            }
+        }
+        catch (const Interrupted &) {
+            outcome = ScriptRun::Cancelled;
+        }
+        catch (const std::exception &e) {
+            // A failed run still has a profile up to the error
+            outcome = ScriptRun::Failed;
+            text = e.what();
+        }
+        qint64 wallNs = wallClock.nsecsElapsed();
+        qint64 cpuNs = threadCpuTimeNs() - cpuStart;
+        if (profiler) {
+            profiler->stop();
+        }
+        post(outcome, text, wallNs, cpuNs);
+    }
+
+private:
+    ScriptRun *handle;
+    QSharedPointer<Script> script;
+    Profiler *profiler;
+
+    void post(ScriptRun::State outcome, const QString &text, qint64 wallNs, qint64 cpuNs)
+    {
+        QMetaObject::invokeMethod(handle, [target = handle, outcome, text, wallNs, cpuNs] {
+            target->complete(outcome, text, wallNs, cpuNs);
+        }, Qt::QueuedConnection);
+    }
+};
+
+ScriptRun::ScriptRun(const QString &n, const QSharedPointer<Script> &s, Profiler *p, int timeout, QObject *parent)
+    : QObject(parent),
+      name(n),
+      script(s),
+      profiler(p),
+      timeoutMs(timeout),
+      state(Queued),
+      timeoutExpired(false),
+      wallTimeNs(0),
+      cpuTimeNs(0)
+{
+}
+
+void ScriptRun::cancel()
+{
+    if (isDone()) {
+        return;
+    }
+    cancelRequested.storeRelaxed(1);
+    script->interrupt();
+}
+
+void ScriptRun::markStarted()
+{
+    if (isDone()) {
+        return;
+    }
+    state = Running;
+    if (timeoutMs > 0) {
+        QTimer::singleShot(timeoutMs, this, [this] {
+            if (state == Running) {
+                timeoutExpired = true;
+                script->interrupt();
+            }
+        });
+    }
+    emit started();
+}
+
+void ScriptRun::complete(State outcome, const QString &text, qint64 wallNs, qint64 cpuNs)
+{
+    if (outcome == Cancelled && timeoutExpired) {
+        outcome = TimedOut;
+    }
+    state = outcome;
+    wallTimeNs = wallNs;
+    cpuTimeNs = cpuNs;
+    switch (outcome) {
+    case Finished:
+        emit finished(text);
+        break;
+    case Failed:
+        emit failed(text);
+        break;
+    case Cancelled:
+        emit cancelled();
+        break;
+    case TimedOut:
+        emit timedOut();
+        break;
+    case Queued:
+    case Running:
+        break;
+    }
+    emit completed();
+    deleteLater();
+}
+
+ScriptExecutor::ScriptExecutor(QObject *parent)
+    : QObject(parent)
+{
+}
+
+ScriptExecutor::~ScriptExecutor()
+{
+    cancelAll();
+    pool.waitForDone();
+}
+
+ScriptRun *ScriptExecutor::submit(const QString &name, const QSharedPointer<Script> &script,
+                                  Profiler *profiler, int timeoutMs)
+{
+    ScriptRun *run = new ScriptRun(name, script, profiler, timeoutMs, this);
+    pool.start(new ScriptTask(run));
+    return run;
+}
+
+void ScriptExecutor::cancelAll()
+{
+    for (ScriptRun *run : getRuns()) {
+        run->cancel();
+    }
+}
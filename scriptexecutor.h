@@ -0,0 +1,118 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptexecutor.h
+#ifndef SCRIPTEXECUTOR_H
+#define SCRIPTEXECUTOR_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QSharedPointer>
+#include <QThreadPool>
+
+class Profiler;
+class Script;
+
+// Handle to one script submitted to a ScriptExecutor. Signals are delivered
+// on the thread the executor lives on, normally the UI thread. Exactly one of
+// finished(), failed(), cancelled() or timedOut() is emitted, followed by
+// completed(), after which the run deletes itself.
+class ScriptRun : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum State {
+        Queued,
+        Running,
+        Finished,
+        Failed,
+        Cancelled,
+        TimedOut
+    };
+
+    const QString &getName() const { return name; }
+    QSharedPointer<Script> getScript() const { return script; }
+    State getState() const { return state; }
+    bool isDone() const { return state != Queued && state != Running; }
+    // Wall and CPU time of the run on its worker thread, known once it has
+    // completed. CPU time is the worker's own, so actors the script spawned
+    // are not included.
+    qint64 getWallTimeNs() const { return wallTimeNs; }
+    qint64 getCpuTimeNs() const { return cpuTimeNs; }
+
+public slots:
+    // A queued run never starts; a running one stops at its next safe point
+    void cancel();
+
+signals:
+    void started();
+    // Top-level forms evaluated so far, out of total
+    void progress(int done, int total);
+    void finished(const QString &result);
+    void failed(const QString &error);
+    void cancelled();
+    void timedOut();
+    void completed();
+
+private:
+    friend class ScriptExecutor;
+    friend class ScriptTask;
+
+    ScriptRun(const QString &name, const QSharedPointer<Script> &script, Profiler *profiler, int timeoutMs, QObject *parent);
+
+    QString name;
+    QSharedPointer<Script> script;
+    Profiler *profiler;
+    int timeoutMs;
+    State state;
+    QAtomicInt cancelRequested;
+    bool timeoutExpired;
+    qint64 wallTimeNs;
+    qint64 cpuTimeNs;
+
+    // Called through queued connections from the worker thread
+    void markStarted();
+    void complete(State outcome, const QString &text, qint64 wallNs, qint64 cpuNs);
+};
+
+// Runs scripts on a pool of worker threads so the UI stays responsive.
+// Every run needs its own Script, as a Script is only ever used by one
+// thread at a time; ScriptCache hands out scripts that way.
+class ScriptExecutor : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ScriptExecutor(QObject *parent = nullptr);
+    // Cancels what is still running and waits for it
+    ~ScriptExecutor();
+
+    // Queues script to run on a worker thread. profiler, if set, is started
+    // and stopped around the run on that thread and must outlive the run.
+    // A run taking longer than timeoutMs, when positive, is interrupted.
+    ScriptRun *submit(const QString &name, const QSharedPointer<Script> &script,
+                      Profiler *profiler = nullptr, int timeoutMs = 0);
+
+    QList<ScriptRun *> getRuns() const { return findChildren<ScriptRun *>(QString(), Qt::FindDirectChildrenOnly); }
+    void cancelAll();
+
+    int getMaxThreads() const { return pool.maxThreadCount(); }
+    void setMaxThreads(int count) { pool.setMaxThreadCount(count); }
+
+private:
+    QThreadPool pool;
+};
+
+#endif // SCRIPTEXECUTOR_H
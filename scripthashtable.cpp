@@ -0,0 +1,329 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scripthashtable.cpp
+#include "scripthashtable.h"
+#include "script.h"
+#include <QDebug>
+#include <QHash>
+#include <algorithm>
+#include <cstring>
+
+//******************************************//
+//***************** Storage ****************//
+//******************************************//
+
+static constexpr qsizetype MinimumCapacity = 8;
+
+// Tables grow once they are three quarters full, which keeps probe
+// sequences short without wasting much of the array
+static bool overLoaded(qsizetype count, qsizetype capacity) {
+    return count * 4 > capacity * 3;
+}
+
+static qsizetype capacityFor(qsizetype expected) {
+    qsizetype capacity = MinimumCapacity;
+    while (overLoaded(expected, capacity)) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static quint32 hashOf(const Value& key) {
+    quint64 bits;
+    switch (key.getType()) {
+    case Value::Flonum: {
+        // 0.0 and -0.0 are eqv?, so they must hash alike
+        double value = key.asFlonum() == 0 ? 0.0 : key.asFlonum();
+        std::memcpy(&bits, &value, sizeof(bits));
+        break;
+    }
+    case Value::Object:
+        if (key.is(ExpressionKind::String)) {
+            return quint32(qHash(key.as<String>()->getValue()));
+        }
+        bits = quint64(quintptr(key.asObject()));
+        break;
+    default:
+        bits = quint64(key.asFixnum());
+        break;
+    }
+    // Symbol ids and fixnums are small and sequential, so mix every bit
+    // into the low ones the table is indexed by
+    bits ^= quint64(key.getType()) << 56;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return quint32(bits);
+}
+
+static bool sameKey(const Value& a, const Value& b) {
+    if (a.isObject() && b.isObject() && a.is(ExpressionKind::String) && b.is(ExpressionKind::String)) {
+        return a.as<String>()->getValue() == b.as<String>()->getValue();
+    }
+    return a.isIdentical(b);
+}
+
+HashTable::HashTable(qsizetype expected) {
+    if (expected > 0) {
+        capacity = capacityFor(expected);
+        entries = new Entry[capacity];
+    }
+}
+
+HashTable::~HashTable() {
+    delete[] entries;
+}
+
+QString HashTable::toString() const {
+    return QString("<hash-table %1>").arg(count);
+}
+
+void HashTable::trace(Heap& heap) const {
+    forEach([&heap](const Value& key, const Value& value) {
+        heap.mark(key);
+        heap.mark(value);
+    });
+}
+
+qsizetype HashTable::slotOf(const Value& key, quint32 hash) const {
+    qsizetype mask = capacity - 1;
+    qsizetype slot = hash & mask;
+    if (!key.isObject()) {
+        // Immediates, symbols above all, are equal exactly when identical
+        while (!entries[slot].key.isUnbound()
+               && !(entries[slot].hash == hash && entries[slot].key.isIdentical(key))) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+    while (!entries[slot].key.isUnbound()
+           && !(entries[slot].hash == hash && sameKey(entries[slot].key, key))) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+const Value* HashTable::find(const Value& key) const {
+    if (count == 0) {
+        return nullptr;
+    }
+    const Entry& entry = entries[slotOf(key, hashOf(key))];
+    return entry.key.isUnbound() ? nullptr : &entry.value;
+}
+
+void HashTable::insert(const Value& key, const Value& value) {
+    if (capacity == 0 || overLoaded(count + 1, capacity)) {
+        resize(capacity == 0 ? MinimumCapacity : capacity * 2);
+    }
+    quint32 hash = hashOf(key);
+    Entry& entry = entries[slotOf(key, hash)];
+    if (entry.key.isUnbound()) {
+        entry.key = key;
+        entry.hash = hash;
+        count++;
+    }
+    entry.value = value;
+}
+
+bool HashTable::remove(const Value& key) {
+    if (count == 0) {
+        return false;
+    }
+    qsizetype mask = capacity - 1;
+    qsizetype hole = slotOf(key, hashOf(key));
+    if (entries[hole].key.isUnbound()) {
+        return false;
+    }
+    // Shift later entries of the probe sequence back into the hole, so
+    // lookups never need tombstones to step over
+    for (qsizetype next = (hole + 1) & mask; !entries[next].key.isUnbound(); next = (next + 1) & mask) {
+        qsizetype home = entries[next].hash & mask;
+        bool stays = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+        if (!stays) {
+            entries[hole] = entries[next];
+            hole = next;
+        }
+    }
+    entries[hole] = Entry();
+    count--;
+    return true;
+}
+
+void HashTable::clear() {
+    std::fill(entries, entries + capacity, Entry());
+    count = 0;
+}
+
+void HashTable::resize(qsizetype newCapacity) {
+    Entry* oldEntries = entries;
+    qsizetype oldCapacity = capacity;
+    entries = new Entry[newCapacity];
+    capacity = newCapacity;
+    qsizetype mask = capacity - 1;
+    for (qsizetype i = 0; i < oldCapacity; ++i) {
+        if (!oldEntries[i].key.isUnbound()) {
+            qsizetype slot = oldEntries[i].hash & mask;
+            while (!entries[slot].key.isUnbound()) {
+                slot = (slot + 1) & mask;
+            }
+            entries[slot] = oldEntries[i];
+        }
+    }
+    delete[] oldEntries;
+    Heap::current()->externalSizeChanged(this, (newCapacity - oldCapacity) * qint64(sizeof(Entry)));
+}
+
+//******************************************//
+//**************** Primitives **************//
+//******************************************//
+
+[[noreturn]] static void hashTableError(const QString& message) {
+    qCritical() << message;
+    throw std::runtime_error(message.toStdString());
+}
+
+static HashTable* checkTable(const Value* args, int i, const char* name) {
+    if (!args[i].is(ExpressionKind::HashTable)) {
+        hashTableError(QString("Arguments to %1 must be hash tables").arg(name));
+    }
+    return args[i].as<HashTable>();
+}
+
+// (make-hash-table [size]) takes the number of entries expected, which
+// saves the resizes on the way there
+static Value primitiveMakeHashTable(const Value* args, int argc) {
+    qint64 expected = 0;
+    if (argc > 0) {
+        if (!args[0].isFixnum() || args[0].asFixnum() < 0) {
+            hashTableError("The size passed to make-hash-table must be a non-negative exact integer");
+        }
+        expected = args[0].asFixnum();
+    }
+    return Value(Heap::create<HashTable>(qsizetype(expected)));
+}
+
+static Value primitiveHashTableP(const Value* args, int) {
+    return Value::boolean(args[0].is(ExpressionKind::HashTable));
+}
+
+static Value primitiveHashTableRef(const Value* args, int) {
+    const Value* value = checkTable(args, 0, "hash-table-ref")->find(args[1]);
+    if (!value) {
+        hashTableError(QString("hash-table-ref: no entry for %1").arg(args[1].toString()));
+    }
+    return *value;
+}
+
+static Value primitiveHashTableRefDefault(const Value* args, int) {
+    const Value* value = checkTable(args, 0, "hash-table-ref/default")->find(args[1]);
+    return value ? *value : args[2];
+}
+
+static Value primitiveHashTableSet(const Value* args, int) {
+    checkTable(args, 0, "hash-table-set!")->insert(args[1], args[2]);
+    return Value::nil();
+}
+
+static Value primitiveHashTableDelete(const Value* args, int) {
+    checkTable(args, 0, "hash-table-delete!")->remove(args[1]);
+    return Value::nil();
+}
+
+static Value primitiveHashTableContains(const Value* args, int) {
+    return Value::boolean(checkTable(args, 0, "hash-table-contains?")->find(args[1]) != nullptr);
+}
+
+static Value primitiveHashTableSize(const Value* args, int) {
+    return Value::fromFixnum(checkTable(args, 0, "hash-table-size")->size());
+}
+
+static Value primitiveHashTableClear(const Value* args, int) {
+    checkTable(args, 0, "hash-table-clear!")->clear();
+    return Value::nil();
+}
+
+static Value primitiveHashTableCopy(const Value* args, int) {
+    const HashTable* table = checkTable(args, 0, "hash-table-copy");
+    HashTable* copy = Heap::create<HashTable>(table->size());
+    table->forEach([copy](const Value& key, const Value& value) {
+        copy->insert(key, value);
+    });
+    return Value(copy);
+}
+
+static Value primitiveHashTableKeys(const Value* args, int) {
+    const HashTable* table = checkTable(args, 0, "hash-table-keys");
+    QVector<Value> keys;
+    keys.reserve(table->size());
+    table->forEach([&keys](const Value& key, const Value&) {
+        keys.append(key);
+    });
+    return makeList(keys);
+}
+
+static Value primitiveHashTableValues(const Value* args, int) {
+    const HashTable* table = checkTable(args, 0, "hash-table-values");
+    QVector<Value> values;
+    values.reserve(table->size());
+    table->forEach([&values](const Value&, const Value& value) {
+        values.append(value);
+    });
+    return makeList(values);
+}
+
+// Lists have no dotted pairs, so each association is a (key value) list
+static Value primitiveHashTableToAlist(const Value* args, int) {
+    const HashTable* table = checkTable(args, 0, "hash-table->alist");
+    QVector<Value> entries;
+    entries.reserve(table->size());
+    table->forEach([&entries](const Value& key, const Value& value) {
+        entries.append(makeList({key, value}));
+    });
+    return makeList(entries);
+}
+
+namespace {
+struct HashTablePrimitiveDefinition {
+    const char* name;
+    int minArgs;
+    int maxArgs;
+    Primitive::Callback callback;
+};
+}
+
+static const HashTablePrimitiveDefinition hashTablePrimitiveTable[] = {
+    { "make-hash-table", 0, 1, primitiveMakeHashTable },
+    { "hash-table?", 1, 1, primitiveHashTableP },
+    { "hash-table-ref", 2, 2, primitiveHashTableRef },
+    { "hash-table-ref/default", 3, 3, primitiveHashTableRefDefault },
+    { "hash-table-set!", 3, 3, primitiveHashTableSet },
+    { "hash-table-delete!", 2, 2, primitiveHashTableDelete },
+    { "hash-table-contains?", 2, 2, primitiveHashTableContains },
+    { "hash-table-exists?", 2, 2, primitiveHashTableContains },
+    { "hash-table-size", 1, 1, primitiveHashTableSize },
+    { "hash-table-clear!", 1, 1, primitiveHashTableClear },
+    { "hash-table-copy", 1, 1, primitiveHashTableCopy },
+    { "hash-table-keys", 1, 1, primitiveHashTableKeys },
+    { "hash-table-values", 1, 1, primitiveHashTableValues },
+    { "hash-table->alist", 1, 1, primitiveHashTableToAlist },
+};
+
+void defineHashTablePrimitives(Environment* env) {
+    for (const auto& definition : hashTablePrimitiveTable) {
+        env->define(definition.name, Value(Heap::create<Primitive>(definition.name, definition.minArgs, definition.maxArgs, definition.callback)));
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scripthashtable.h
+#ifndef SCRIPTHASHTABLE_H
+#define SCRIPTHASHTABLE_H
+
+#include "scriptvalue.h"
+
+class Environment;
+
+// SRFI-69 style hash table. The entries live in one open-addressing array
+// outside the heap cell and are probed linearly from the key's hash, so a
+// lookup usually touches a single cache line instead of chasing tree nodes.
+// Strings are compared by contents and every other key like eqv?, which
+// lets symbol and number keys compare without looking at an object.
+class HashTable : public Expression {
+public:
+    // Empty entries have an unbound key
+    struct Entry {
+        Value key;
+        Value value;
+        quint32 hash = 0;
+    };
+
+    // Room for expected entries before the first resize
+    explicit HashTable(qsizetype expected = 0);
+    ~HashTable() override;
+    ExpressionKind kind() const override { return ExpressionKind::HashTable; }
+    QString toString() const override;
+    void trace(Heap& heap) const override;
+    qint64 externalSize() const override { return capacity * qint64(sizeof(Entry)); }
+
+    qsizetype size() const { return count; }
+    // The value stored under key, or nullptr. Valid until the next insert
+    // or remove.
+    const Value* find(const Value& key) const;
+    void insert(const Value& key, const Value& value);
+    bool remove(const Value& key);
+    void clear();
+
+    template <typename F>
+    void forEach(F visit) const {
+        for (qsizetype i = 0; i < capacity; ++i) {
+            if (!entries[i].key.isUnbound()) {
+                visit(entries[i].key, entries[i].value);
+            }
+        }
+    }
+
+private:
+    Entry* entries = nullptr;
+    qsizetype capacity = 0;
+    qsizetype count = 0;
+
+    // Index of the entry holding key, or of the empty entry it would go in
+    qsizetype slotOf(const Value& key, quint32 hash) const;
+    void resize(qsizetype newCapacity);
+};
+
+// Binds the hash-table primitives in the global environment env
+void defineHashTablePrimitives(Environment* env);
+
+#endif // SCRIPTHASHTABLE_H
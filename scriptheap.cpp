@@ -0,0 +1,258 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptheap.cpp
+#include "scriptheap.h"
+#include "scriptvalue.h"
+#include <QMutex>
+#include <algorithm>
+
+static thread_local Heap* currentHeap = nullptr;
+
+// Names of the registered types, shared by every heap in the process
+static QMutex typeNamesMutex;
+static QVector<const char*> typeNames;
+
+static const char* typeNameOf(quint16 type) {
+    QMutexLocker locker(&typeNamesMutex);
+    return typeNames[type];
+}
+
+Heap::Heap() = default;
+
+Heap::~Heap() {
+    while (objects) {
+        HeapObject* object = objects;
+        objects = object->nextObject;
+        destroy(object);
+    }
+    for (char* chunk : chunks) {
+        ::operator delete(chunk);
+    }
+}
+
+Heap* Heap::current() {
+    Q_ASSERT(currentHeap);
+    return currentHeap;
+}
+
+Heap::Scope::Scope(Heap* heap) : previous(currentHeap) {
+    currentHeap = heap;
+}
+
+Heap::Scope::~Scope() {
+    currentHeap = previous;
+}
+
+void* Heap::allocate(quint32 size) {
+    if (size > LargeObjectSize) {
+        return ::operator new(size);
+    }
+    FreeCell*& freeList = freeLists[size / Granule];
+    if (freeList) {
+        FreeCell* cell = freeList;
+        freeList = cell->next;
+        return cell;
+    }
+    if (limit - bump < qptrdiff(size)) {
+        // The tail of the old chunk is abandoned; it is at most one small cell
+        bump = static_cast<char*>(::operator new(ChunkSize));
+        limit = bump + ChunkSize;
+        chunks.append(bump);
+    }
+    void* memory = bump;
+    bump += size;
+    return memory;
+}
+
+void Heap::release(void* memory, quint32 size) {
+    if (size > LargeObjectSize) {
+        ::operator delete(memory);
+        return;
+    }
+    FreeCell* cell = static_cast<FreeCell*>(memory);
+    cell->next = freeLists[size / Granule];
+    freeLists[size / Granule] = cell;
+}
+
+quint16 Heap::registerType(const char* name) {
+    QMutexLocker locker(&typeNamesMutex);
+    typeNames.append(name);
+    return quint16(typeNames.size() - 1);
+}
+
+void Heap::track(HeapObject* object, quint32 size, quint16 type) {
+    object->cellSize = size;
+    object->type = type;
+    object->nextObject = objects;
+    objects = object;
+    objectCount++;
+    qint64 bytes = size + object->externalSize();
+    bytesInUse += bytes;
+    allocatedSinceCollection += bytes;
+    allocationCount++;
+    bytesAllocated += bytes;
+    if (type >= types.size()) {
+        types.resize(type + 1);
+    }
+    TypeStatistics& stats = types[type];
+    stats.allocations++;
+    stats.bytesAllocated += bytes;
+    stats.liveObjects++;
+    stats.liveBytes += bytes;
+    if (siteFunction) {
+        sites.insert(object, siteFunction());
+    }
+}
+
+void Heap::externalSizeChanged(const HeapObject* object, qint64 delta) {
+    TypeStatistics& stats = types[object->type];
+    stats.liveBytes += delta;
+    bytesInUse += delta;
+    if (delta > 0) {
+        stats.bytesAllocated += delta;
+        allocatedSinceCollection += delta;
+        bytesAllocated += delta;
+    }
+}
+
+void Heap::destroy(HeapObject* object) {
+    quint32 size = object->cellSize;
+    qint64 bytes = size + object->externalSize();
+    TypeStatistics& stats = types[object->type];
+    stats.liveObjects--;
+    stats.liveBytes -= bytes;
+    if (!sites.isEmpty()) {
+        sites.remove(object);
+    }
+    object->~HeapObject();
+    release(object, size);
+    objectCount--;
+    bytesInUse -= bytes;
+}
+
+QVector<Heap::TypeStatistics> Heap::getTypeStatistics() const {
+    QVector<TypeStatistics> result;
+    for (int type = 0; type < types.size(); ++type) {
+        if (types[type].allocations > 0) {
+            result.append(types[type]);
+            result.last().name = typeNameOf(quint16(type));
+        }
+    }
+    return result;
+}
+
+Heap::Snapshot Heap::snapshot() {
+    markRoots();
+    Snapshot result;
+    QVector<TypeStatistics> reachable(types.size());
+    QHash<quint64, SiteStatistics> bySite;
+    for (HeapObject* object = objects; object; object = object->nextObject) {
+        if (!object->marked) {
+            continue;
+        }
+        object->marked = false;
+        qint64 bytes = object->cellSize + object->externalSize();
+        result.objects++;
+        result.bytes += bytes;
+        reachable[object->type].liveObjects++;
+        reachable[object->type].liveBytes += bytes;
+        auto site = sites.constFind(object);
+        if (site != sites.constEnd()) {
+            SiteStatistics& stats = bySite[site.value()];
+            stats.site = site.value();
+            stats.objects++;
+            stats.bytes += bytes;
+        }
+    }
+    for (int type = 0; type < reachable.size(); ++type) {
+        if (reachable[type].liveObjects > 0) {
+            result.types.append(reachable[type]);
+            result.types.last().name = typeNameOf(quint16(type));
+        }
+    }
+    for (const SiteStatistics& stats : bySite) {
+        result.sites.append(stats);
+    }
+    std::sort(result.types.begin(), result.types.end(), [](const TypeStatistics& a, const TypeStatistics& b) {
+        return a.liveBytes > b.liveBytes;
+    });
+    std::sort(result.sites.begin(), result.sites.end(), [](const SiteStatistics& a, const SiteStatistics& b) {
+        return a.bytes > b.bytes;
+    });
+    return result;
+}
+
+void Heap::setSiteFunction(SiteFunction function) {
+    siteFunction = function;
+    if (!function) {
+        sites.clear();
+    }
+}
+
+void Heap::addRoots(const HeapRoots* set) {
+    roots.append(set);
+}
+
+void Heap::removeRoots(const HeapRoots* set) {
+    roots.removeOne(set);
+}
+
+void Heap::mark(const Value& value) {
+    if (value.isObject()) {
+        mark(value.asObject());
+    }
+}
+
+int Heap::pin(const Value& value) {
+    return pin(value.isObject() ? value.asObject() : nullptr);
+}
+
+void Heap::repin(int slot, const Value& value) {
+    repin(slot, value.isObject() ? value.asObject() : nullptr);
+}
+
+void Heap::markRoots() {
+    // Mark everything reachable, using an explicit stack so that long lists
+    // and environment chains cannot overflow the C++ stack
+    for (const HeapRoots* set : roots) {
+        set->traceRoots(*this);
+    }
+    for (const HeapObject* object : pinned) {
+        mark(object);
+    }
+    while (!grayStack.isEmpty()) {
+        grayStack.takeLast()->trace(*this);
+    }
+}
+
+void Heap::collect() {
+    markRoots();
+
+    HeapObject** link = &objects;
+    while (HeapObject* object = *link) {
+        if (object->marked) {
+            object->marked = false;
+            link = &object->nextObject;
+        }
+        else {
+            *link = object->nextObject;
+            destroy(object);
+        }
+    }
+
+    collectionCount++;
+    allocatedSinceCollection = 0;
+    threshold = qMax(MinimumThreshold, bytesInUse);
+}
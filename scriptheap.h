@@ -0,0 +1,261 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptheap.h
+#ifndef SCRIPTHEAP_H
+#define SCRIPTHEAP_H
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QVector>
+#include <QtGlobal>
+
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+class Heap;
+class Value;
+
+// Base of everything the script heap manages. Subclasses report the heap
+// objects they reference from trace(); anything not reached from a root
+// during a collection is destroyed.
+class HeapObject {
+public:
+    HeapObject() = default;
+    HeapObject(const HeapObject&) = delete;
+    HeapObject& operator=(const HeapObject&) = delete;
+    virtual ~HeapObject() = default;
+    virtual void trace(Heap& heap) const { Q_UNUSED(heap); }
+    // Bytes owned outside the cell, such as a vector's element buffer, so
+    // the collector sees their pressure. Must not change after construction
+    // unless the change is reported through Heap::externalSizeChanged().
+    virtual qint64 externalSize() const { return 0; }
+    // Name the heap statistics count objects of this type under; the same
+    // for every object of a C++ type
+    virtual const char* typeName() const { return "Object"; }
+
+private:
+    friend class Heap;
+    HeapObject* nextObject = nullptr;
+    quint32 cellSize = 0;
+    quint16 type = 0;
+    mutable bool marked = false;
+};
+
+// Something outside the heap that holds references into it, such as the
+// global environment or an evaluator stack
+class HeapRoots {
+public:
+    virtual ~HeapRoots() = default;
+    virtual void traceRoots(Heap& heap) const = 0;
+};
+
+// Thrown from a safe point once the heap has been interrupted
+class Interrupted : public std::runtime_error {
+public:
+    Interrupted() : std::runtime_error("Script interrupted") {}
+};
+
+// Arena allocator with a mark-sweep collector. Small objects are carved from
+// large chunks by bumping a pointer, and cells freed by a sweep are reused
+// through per-size free lists. Collections only happen at safe points chosen
+// by the evaluators, where every live reference is reachable from a
+// registered root.
+class Heap {
+public:
+    Heap();
+    ~Heap();
+
+    // The heap that create() allocates from on the current thread
+    static Heap* current();
+
+    // Makes a heap current on this thread for the lifetime of the scope
+    class Scope {
+        Heap* previous;
+    public:
+        explicit Scope(Heap* heap);
+        ~Scope();
+    };
+
+    // Releases the pins taken inside the scope when it ends
+    class PinScope {
+        Heap* heap;
+        int count;
+    public:
+        explicit PinScope(Heap* h) : heap(h), count(h->pinned.size()) {}
+        ~PinScope() { heap->pinned.resize(count); }
+    };
+
+    template <typename T, typename... Args>
+    static T* create(Args&&... args) {
+        Heap* heap = current();
+        quint32 size = cellSizeFor(sizeof(T));
+        void* memory = heap->allocate(size);
+        T* object;
+        try {
+            object = new (memory) T(std::forward<Args>(args)...);
+        }
+        catch (...) {
+            heap->release(memory, size);
+            throw;
+        }
+        // Types are numbered on their first allocation in the process
+        static const quint16 type = registerType(object->typeName());
+        heap->track(object, size, type);
+        return object;
+    }
+
+    // Accounts for an object's externalSize() having grown or shrunk by delta
+    void externalSizeChanged(const HeapObject* object, qint64 delta);
+
+    void addRoots(const HeapRoots* roots);
+    void removeRoots(const HeapRoots* roots);
+
+    void mark(const HeapObject* object) {
+        if (object && !object->marked) {
+            object->marked = true;
+            grayStack.append(object);
+        }
+    }
+    void mark(const Value& value);
+
+    // Pins keep objects that are only referenced from C++ locals alive
+    // across safe points. pin() returns a slot that repin() can reuse, so a
+    // loop can track a changing object without growing the pin stack.
+    int pin(const HeapObject* object) {
+        pinned.append(object);
+        return pinned.size() - 1;
+    }
+    int pin(const Value& value);
+    void repin(int slot, const HeapObject* object) { pinned[slot] = object; }
+    void repin(int slot, const Value& value);
+
+    bool shouldCollect() const {
+        return allocatedSinceCollection >= threshold;
+    }
+    // Makes the next safe point throw Interrupted, which is how a script
+    // running on another thread is cancelled. Unlike the rest of the heap
+    // these may be called from any thread.
+    void interrupt() { interruptRequested.storeRelaxed(1); }
+    void clearInterrupt() { interruptRequested.storeRelaxed(0); }
+    // Throws Interrupted if interrupt() was called since the last check.
+    // Primitives that block call this without being safe points.
+    void checkInterrupt() {
+        if (interruptRequested.loadRelaxed()) {
+            clearInterrupt();
+            throw Interrupted();
+        }
+    }
+
+    // Called by the evaluators at safe points
+    void collectIfNeeded() {
+        checkInterrupt();
+        if (shouldCollect()) {
+            collect();
+        }
+    }
+    void collect();
+
+    qint64 getObjectCount() const { return objectCount; }
+    qint64 getBytesInUse() const { return bytesInUse; }
+    qint64 getCollectionCount() const { return collectionCount; }
+    // Running totals since the heap was created, freed objects included
+    qint64 getAllocationCount() const { return allocationCount; }
+    qint64 getBytesAllocated() const { return bytesAllocated; }
+
+    // Counters for one type of object. Live objects are the ones not yet
+    // freed, which includes garbage the next collection would free.
+    struct TypeStatistics {
+        const char* name = nullptr;
+        qint64 allocations = 0;
+        qint64 bytesAllocated = 0;
+        qint64 liveObjects = 0;
+        qint64 liveBytes = 0;
+    };
+    // Objects allocated at one site that are still reachable
+    struct SiteStatistics {
+        quint64 site = 0;
+        qint64 objects = 0;
+        qint64 bytes = 0;
+    };
+    // What is reachable from the roots at one point. Types only have live
+    // counts, and sites only cover objects allocated while site tracking
+    // was on; both are sorted by bytes, largest first.
+    struct Snapshot {
+        QVector<TypeStatistics> types;
+        QVector<SiteStatistics> sites;
+        qint64 objects = 0;
+        qint64 bytes = 0;
+    };
+
+    // Every type allocated on this heap so far, in registration order
+    QVector<TypeStatistics> getTypeStatistics() const;
+    // Marks from the roots without collecting, so it is safe anywhere the
+    // heap is not being collected. Objects only referenced from unpinned
+    // C++ locals are left out.
+    Snapshot snapshot();
+
+    // While a site function is set, each allocation records the site it
+    // returns, such as the function being evaluated. Turning it off forgets
+    // the recorded sites.
+    using SiteFunction = quint64 (*)();
+    void setSiteFunction(SiteFunction function);
+    bool isTrackingSites() const { return siteFunction != nullptr; }
+
+private:
+    static constexpr quint32 Granule = 16;
+    static constexpr quint32 LargeObjectSize = 512;
+    static constexpr int ChunkSize = 256 * 1024;
+    static constexpr qint64 MinimumThreshold = 4 * 1024 * 1024;
+
+    struct FreeCell {
+        FreeCell* next;
+    };
+
+    static quint32 cellSizeFor(size_t size) {
+        return quint32((size + Granule - 1) / Granule * Granule);
+    }
+
+    void* allocate(quint32 size);
+    void release(void* memory, quint32 size);
+    static quint16 registerType(const char* name);
+    void track(HeapObject* object, quint32 size, quint16 type);
+    void destroy(HeapObject* object);
+    void markRoots();
+
+    QVector<char*> chunks;
+    char* bump = nullptr;
+    char* limit = nullptr;
+    FreeCell* freeLists[LargeObjectSize / Granule + 1] = {};
+
+    HeapObject* objects = nullptr;
+    QVector<const HeapObject*> grayStack;
+    QVector<const HeapRoots*> roots;
+    QVector<const HeapObject*> pinned;
+
+    qint64 objectCount = 0;
+    qint64 bytesInUse = 0;
+    qint64 allocatedSinceCollection = 0;
+    qint64 threshold = MinimumThreshold;
+    qint64 collectionCount = 0;
+    qint64 allocationCount = 0;
+    qint64 bytesAllocated = 0;
+    QVector<TypeStatistics> types;
+    SiteFunction siteFunction = nullptr;
+    QHash<const HeapObject*, quint64> sites;
+    QAtomicInt interruptRequested;
+};
+
+#endif // SCRIPTHEAP_H
@@ -0,0 +1,152 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptlexer.cpp
+#include "scriptlexer.h"
+#include <QDebug>
+
+Token Lexer::next() {
+    if (hasLookahead) {
+        hasLookahead = false;
+        return lookahead;
+    }
+    return scan();
+}
+
+const Token& Lexer::peek() {
+    if (!hasLookahead) {
+        lookahead = scan();
+        hasLookahead = true;
+    }
+    return lookahead;
+}
+
+Token Lexer::scan() {
+    const qsizetype length = source.size();
+    while (position < length && source[position].isSpace()) {
+        position++;
+    }
+
+    Token token;
+    token.offset = position;
+    if (position == length) {
+        token.type = Token::End;
+        return token;
+    }
+
+    QChar c = source[position];
+    if (c == '(' || c == ')') {
+        token.type = c == '(' ? Token::LeftParen : Token::RightParen;
+        token.text = source.mid(position, 1);
+        position++;
+        return token;
+    }
+    if (c == '"') {
+        qsizetype start = position + 1;
+        qsizetype end = start;
+        while (end < length && source[end] != '"') {
+            // Skip the escaped character so an escaped quote does not end the string
+            end += source[end] == '\\' ? 2 : 1;
+        }
+        end = qMin(end, length);
+        if (end == length && partial) {
+            position = length;
+            token.type = Token::End;
+            return token;
+        }
+        if (end == length) {
+            QString where = describeLocation(token.offset);
+            qCritical() << "Unterminated string at" << where;
+            throw std::runtime_error(QString("Unterminated string at %1").arg(where).toStdString());
+        }
+        token.type = Token::String;
+        token.text = source.mid(start, end - start);
+        position = end + 1;
+        return token;
+    }
+
+    qsizetype end = position;
+    if (source.mid(position, 2) == u"#\\" && position + 2 < length) {
+        // A character literal such as #\( may name a delimiter
+        end = position + 3;
+    }
+    while (end < length) {
+        QChar d = source[end];
+        if (d.isSpace() || d == '(' || d == ')' || d == '"') {
+            break;
+        }
+        end++;
+    }
+    token.type = Token::Atom;
+    token.text = source.mid(position, end - position);
+    position = end;
+    return token;
+}
+
+qsizetype Lexer::datumEnd() {
+    partial = true;
+    qsizetype end = -1;
+    int depth = 0;
+    for (Token token = next(); token.type != Token::End; token = next()) {
+        if (token.type == Token::LeftParen) {
+            depth++;
+            continue;
+        }
+        if (token.type == Token::RightParen && depth > 0) {
+            depth--;
+        }
+        else if (token.type == Token::Atom && position == source.size()) {
+            break;
+        }
+        if (depth == 0) {
+            end = position;
+            break;
+        }
+    }
+    partial = false;
+    return end;
+}
+
+void Lexer::location(qsizetype offset, int& line, int& column) const {
+    line = 1;
+    column = 1;
+    for (qsizetype i = 0; i < offset && i < source.size(); ++i) {
+        if (source[i] == '\n') {
+            line++;
+            column = 1;
+        }
+        else {
+            column++;
+        }
+    }
+}
+
+QString Lexer::describeLocation(qsizetype offset) const {
+    int line, column;
+    location(offset, line, column);
+    return QString("line %1, column %2").arg(line).arg(column);
+}
+
+int Lexer::line(qsizetype offset) {
+    if (offset < lineOffset) {
+        lineOffset = 0;
+        lineNumber = 1;
+    }
+    for (; lineOffset < offset && lineOffset < source.size(); ++lineOffset) {
+        if (source[lineOffset] == '\n') {
+            lineNumber++;
+        }
+    }
+    return lineNumber;
+}
@@ -0,0 +1,76 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptlexer.h
+#ifndef SCRIPTLEXER_H
+#define SCRIPTLEXER_H
+
+#include <QString>
+#include <QStringView>
+
+// A token is a span of the source text. Nothing is copied while lexing; the
+// parser only makes a QString when it needs one, e.g. to intern a symbol.
+struct Token {
+    enum Type {
+        LeftParen,
+        RightParen,
+        Atom,
+        String,     // text is the contents between the quotes, still escaped
+        End
+    };
+
+    Type type = End;
+    QStringView text;
+    qsizetype offset = 0;   // position of the token's first character in the source
+};
+
+// Streaming lexer over a source string, which must outlive it. Tokens are
+// produced one at a time as the parser asks for them, and line/column
+// positions are only worked out when a message needs one.
+class Lexer {
+public:
+    explicit Lexer(QStringView text) : source(text) {}
+
+    Token next();
+    const Token& peek();
+
+    // 1-based line and column of a source offset
+    void location(qsizetype offset, int& line, int& column) const;
+    QString describeLocation(qsizetype offset) const;
+    // 1-based line of a source offset. Counts on from the previous call, so
+    // it is cheap when the offsets only move forward, as they do while parsing.
+    int line(qsizetype offset);
+
+    // Offset just past the first datum of a source that may only be the
+    // start of a longer input, or -1 if the datum may continue past the end
+    // of the source. An atom running up to the end could, as could an open
+    // list or string. A stray ')' counts as a datum, for the parser to
+    // report. Consumes the lexer.
+    qsizetype datumEnd();
+
+private:
+    QStringView source;
+    qsizetype position = 0;
+    Token lookahead;
+    bool hasLookahead = false;
+    // Set by datumEnd(): an unterminated string ends the input instead of
+    // being an error
+    bool partial = false;
+    qsizetype lineOffset = 0;
+    int lineNumber = 1;
+
+    Token scan();
+};
+
+#endif // SCRIPTLEXER_H
@@ -0,0 +1,591 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptoptimizer.cpp
+#include "scriptoptimizer.h"
+#include "script.h"
+
+#include <QSet>
+
+#include <stdexcept>
+
+namespace {
+
+// Primitives without side effects, whose result depends only on their
+// arguments. Ones that build new lists or strings are pure too, but folding
+// them would make every evaluation share one object, so results are only
+// folded when they are immediates.
+const QSet<QString>& pureNames() {
+    static const QSet<QString> names = {
+        "+", "-", "*", "/", "quotient", "remainder", "modulo", "abs", "min", "max",
+        "floor", "ceiling", "round", "truncate", "sqrt", "expt",
+        "exact->inexact", "inexact->exact",
+        "=", "<", ">", "<=", ">=", "eq?", "eqv?", "equal?", "not",
+        "number?", "integer?", "zero?", "positive?", "negative?", "boolean?",
+        "symbol?", "string?", "procedure?", "null?", "pair?", "list?",
+        "car", "cdr", "length", "list-ref",
+        "string-length", "string=?", "string<?", "string->symbol", "string->number",
+        "string-split", "string-join"
+    };
+    return names;
+}
+
+bool isForm(const Value& expr, int form) {
+    return expr.is(ExpressionKind::List)
+        && expr.as<List>()->getElements()[0].isSymbol()
+        && expr.as<List>()->getElements()[0].asSymbol() == form;
+}
+
+bool isQuote(const Value& expr) {
+    return isForm(expr, SymbolTable::Quote) && expr.as<List>()->getElements().size() == 2;
+}
+
+// Whether expr evaluates to itself or is quoted, so it has no effects and
+// its value is known now
+bool isConstant(const Value& expr) {
+    return (!expr.isSymbol() && !expr.is(ExpressionKind::List)) || isQuote(expr);
+}
+
+Value constantValue(const Value& expr) {
+    return isQuote(expr) ? expr.as<List>()->getElements()[1] : expr;
+}
+
+// The expression that evaluates to value
+Value constantExpression(const Value& value) {
+    if (value.isSymbol() || value.is(ExpressionKind::List)) {
+        return makeList({ Value::symbol(SymbolTable::Quote), value });
+    }
+    return value;
+}
+
+bool isTrivial(const Value& expr) {
+    return isConstant(expr) || (expr.isSymbol() && expr.asSymbol() >= SymbolTable::KnownSymbolCount);
+}
+
+int expressionSize(const Value& expr) {
+    if (!expr.is(ExpressionKind::List)) {
+        return 1;
+    }
+    int size = 1;
+    for (const auto& element : expr.as<List>()->getElements()) {
+        size += expressionSize(element);
+    }
+    return size;
+}
+
+// Whether expr binds names anywhere, which substitution would have to
+// respect; quoted data is skipped
+bool hasBinders(const Value& expr) {
+    if (!expr.is(ExpressionKind::List) || isQuote(expr)) {
+        return false;
+    }
+    const auto& elements = expr.as<List>()->getElements();
+    if (elements[0].isSymbol()) {
+        int form = elements[0].asSymbol();
+        if (form == SymbolTable::Define || form == SymbolTable::Lambda
+            || form == SymbolTable::Let || form == SymbolTable::Class) {
+            return true;
+        }
+    }
+    for (const auto& element : elements) {
+        if (hasBinders(element)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void collectSymbols(const Value& expr, QVector<int>& symbols) {
+    if (expr.isSymbol()) {
+        symbols.append(expr.asSymbol());
+    }
+    else if (expr.is(ExpressionKind::List) && !isQuote(expr)) {
+        for (const auto& element : expr.as<List>()->getElements()) {
+            collectSymbols(element, symbols);
+        }
+    }
+}
+
+enum class FirstUse {
+    NotReached,
+    Reached,
+    Blocked
+};
+
+// Whether evaluating expr, which binds no names, looks up symbol before
+// anything that could have an effect or raise. Calls evaluate the callee
+// and then the arguments in order, and only branch tests run for certain.
+FirstUse firstUse(const Value& expr, int symbol) {
+    if (expr.isSymbol()) {
+        return expr.asSymbol() == symbol ? FirstUse::Reached : FirstUse::NotReached;
+    }
+    if (isConstant(expr)) {
+        return FirstUse::NotReached;
+    }
+    const auto& elements = expr.as<List>()->getElements();
+    int form = elements[0].isSymbol() ? elements[0].asSymbol() : -1;
+    if (form == SymbolTable::If && elements.size() > 1) {
+        FirstUse use = firstUse(elements[1], symbol);
+        return use == FirstUse::NotReached ? FirstUse::Blocked : use;
+    }
+    if (form == SymbolTable::Begin) {
+        for (int i = 1; i < elements.size(); ++i) {
+            FirstUse use = firstUse(elements[i], symbol);
+            if (use != FirstUse::NotReached) {
+                return use;
+            }
+        }
+        return FirstUse::NotReached;
+    }
+    if (form >= 0 && form < SymbolTable::KnownSymbolCount) {
+        return FirstUse::Blocked;
+    }
+    for (const auto& element : elements) {
+        FirstUse use = firstUse(element, symbol);
+        if (use != FirstUse::NotReached) {
+            return use;
+        }
+    }
+    // The call itself
+    return FirstUse::Blocked;
+}
+
+Value substitute(const Value& expr, const QHash<int, Value>& replacements) {
+    if (expr.isSymbol()) {
+        return replacements.value(expr.asSymbol(), expr);
+    }
+    if (!expr.is(ExpressionKind::List) || isQuote(expr)) {
+        return expr;
+    }
+    const List* list = expr.as<List>();
+    QVector<Value> elements;
+    elements.reserve(list->getElements().size());
+    for (const auto& element : list->getElements()) {
+        elements.append(substitute(element, replacements));
+    }
+    return makeList(elements, list->getLine());
+}
+
+bool parameterNames(const Value& params, QVector<int>& names) {
+    if (params.isNil()) {
+        return true;
+    }
+    if (!params.is(ExpressionKind::List)) {
+        return false;
+    }
+    for (const auto& param : params.as<List>()->getElements()) {
+        if (!param.isSymbol()) {
+            return false;
+        }
+        names.append(param.asSymbol());
+    }
+    return true;
+}
+
+} // namespace
+
+QString Optimizer::Statistics::report() const {
+    return QString("%1 calls folded, %2 calls inlined, %3 beta reductions, "
+                   "%4 branches and %5 expressions eliminated")
+        .arg(foldedCalls).arg(inlinedCalls).arg(betaReductions)
+        .arg(eliminatedBranches).arg(eliminatedExpressions);
+}
+
+Optimizer::Optimizer(Environment* g, Passes p)
+    : global(g), passes(p) {}
+
+QVector<Value> Optimizer::optimize(const QVector<Value>& forms) {
+    wholeProgram = true;
+    definitions.clear();
+    for (int i = 0; i < forms.size(); ++i) {
+        collectDefinitions(forms[i], i, true);
+    }
+    QVector<Value> optimized;
+    optimized.reserve(forms.size());
+    for (formIndex = 0; formIndex < forms.size(); ++formIndex) {
+        optimized.append(optimizeExpression(forms[formIndex]));
+    }
+    wholeProgram = false;
+    return optimized;
+}
+
+Value Optimizer::optimize(const Value& form) {
+    wholeProgram = false;
+    return optimizeExpression(form);
+}
+
+void Optimizer::collectDefinitions(const Value& expr, int index, bool topLevel) {
+    if (!expr.is(ExpressionKind::List) || isQuote(expr)) {
+        return;
+    }
+    const auto& elements = expr.as<List>()->getElements();
+    if (isForm(expr, SymbolTable::Define) && elements.size() == 3 && elements[1].isSymbol()) {
+        Definition& definition = definitions[elements[1].asSymbol()];
+        definition.count++;
+        definition.formIndex = index;
+        // Only a global function defined by a form of its own is inlined
+        definition.lambda = topLevel && isForm(elements[2], SymbolTable::Lambda) ? elements[2] : Value();
+    }
+    for (const auto& element : elements) {
+        collectDefinitions(element, index, false);
+    }
+}
+
+bool Optimizer::isBuiltin(int symbol) const {
+    // Without the whole program a later define could still rebind it
+    return wholeProgram && !isLocal(symbol) && !definitions.contains(symbol)
+        && pureNames().contains(SymbolTable::name(symbol));
+}
+
+bool Optimizer::isPureCall(const Value& expr) const {
+    if (!expr.is(ExpressionKind::List) || isQuote(expr)) {
+        return false;
+    }
+    const auto& elements = expr.as<List>()->getElements();
+    if (!elements[0].isSymbol() || !isBuiltin(elements[0].asSymbol())) {
+        return false;
+    }
+    for (int i = 1; i < elements.size(); ++i) {
+        if (!isTrivial(elements[i]) && !isPureCall(elements[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Optimizer::isPrimitive(int symbol) const {
+    return !isLocal(symbol) && !definitions.contains(symbol) && global->isGlobalDefined(symbol)
+        && global->lookupGlobal(symbol).is(ExpressionKind::Primitive);
+}
+
+bool Optimizer::usedAsMethodName(const Value& expr, int symbol) const {
+    if (!expr.is(ExpressionKind::List) || isQuote(expr)) {
+        return false;
+    }
+    // Unless the callee is known not to be an instance, the second element
+    // of a call may be a method name, which is never evaluated
+    const auto& elements = expr.as<List>()->getElements();
+    bool known = elements[0].isSymbol()
+        && (elements[0].asSymbol() < SymbolTable::KnownSymbolCount || isPrimitive(elements[0].asSymbol()));
+    if (!known && elements.size() > 1 && elements[1].isSymbol() && elements[1].asSymbol() == symbol) {
+        return true;
+    }
+    for (const auto& element : elements) {
+        if (usedAsMethodName(element, symbol)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Value Optimizer::optimizeExpression(const Value& expr) {
+    if (!expr.is(ExpressionKind::List)) {
+        return expr;
+    }
+    const List* list = expr.as<List>();
+    const auto& elements = list->getElements();
+    if (elements[0].isSymbol()) {
+        switch (elements[0].asSymbol()) {
+        case SymbolTable::Quote:
+            return expr;
+        case SymbolTable::Define:
+            if (elements.size() == 3 && elements[1].isSymbol()) {
+                Value value = optimizeExpression(elements[2]);
+                if (!value.isIdentical(elements[2])) {
+                    return makeList({ elements[0], elements[1], value }, list->getLine());
+                }
+            }
+            return expr;
+        case SymbolTable::Lambda:
+            return optimizeLambda(elements, list->getLine());
+        case SymbolTable::If:
+            return optimizeIf(elements, list->getLine());
+        case SymbolTable::Begin:
+            return optimizeBegin(elements, list->getLine());
+        case SymbolTable::Cond:
+            return optimizeCond(elements, list->getLine());
+        case SymbolTable::Let:
+            return optimizeLet(elements, list->getLine());
+        case SymbolTable::Class:
+        case SymbolTable::New: {
+            // Method names and the class are left as they are
+            QVector<Value> optimized = elements;
+            int first = elements[0].asSymbol() == SymbolTable::Class ? 2 : 1;
+            int step = elements[0].asSymbol() == SymbolTable::Class ? 2 : 1;
+            bool changed = false;
+            for (int i = first; i < elements.size(); i += step) {
+                optimized[i] = optimizeExpression(elements[i]);
+                changed = changed || !optimized[i].isIdentical(elements[i]);
+            }
+            return changed ? makeList(optimized, list->getLine()) : expr;
+        }
+        default:
+            break;
+        }
+    }
+    return optimizeCall(elements, list->getLine());
+}
+
+Value Optimizer::optimizeLambda(const QVector<Value>& elements, int line) {
+    QVector<int> params;
+    if (elements.size() != 3 || !parameterNames(elements[1], params)) {
+        return makeList(elements, line);
+    }
+    // Internal defines bind in the function's own frame, so any name the
+    // body defines is treated as local for all of it
+    int bound = locals.size();
+    locals += params;
+    QHash<int, Definition> saved = definitions;
+    definitions.clear();
+    collectDefinitions(elements[2], 0, false);
+    for (auto it = definitions.constBegin(); it != definitions.constEnd(); ++it) {
+        locals.append(it.key());
+    }
+    definitions = saved;
+    lambdaDepth++;
+    Value body = optimizeExpression(elements[2]);
+    lambdaDepth--;
+    locals.resize(bound);
+    if (body.isIdentical(elements[2])) {
+        return makeList(elements, line);
+    }
+    return makeList({ elements[0], elements[1], body }, line);
+}
+
+Value Optimizer::optimizeIf(const QVector<Value>& elements, int line) {
+    if (elements.size() != 3 && elements.size() != 4) {
+        return makeList(elements, line);
+    }
+    Value test = optimizeExpression(elements[1]);
+    if (passes.testFlag(DeadCodeElimination) && isConstant(test)) {
+        statistics.eliminatedBranches++;
+        if (constantValue(test).isTruthy()) {
+            return optimizeExpression(elements[2]);
+        }
+        return elements.size() == 4 ? optimizeExpression(elements[3]) : Value::nil();
+    }
+    QVector<Value> optimized = { elements[0], test };
+    for (int i = 2; i < elements.size(); ++i) {
+        optimized.append(optimizeExpression(elements[i]));
+    }
+    return makeList(optimized, line);
+}
+
+Value Optimizer::optimizeBegin(const QVector<Value>& elements, int line) {
+    if (elements.size() < 2) {
+        return makeList(elements, line);
+    }
+    QVector<Value> optimized = { elements[0] };
+    for (int i = 1; i < elements.size(); ++i) {
+        Value value = optimizeExpression(elements[i]);
+        // Only the last value is kept, so a constant before it does nothing
+        if (passes.testFlag(DeadCodeElimination) && i < elements.size() - 1 && isConstant(value)) {
+            statistics.eliminatedExpressions++;
+            continue;
+        }
+        optimized.append(value);
+    }
+    if (passes.testFlag(DeadCodeElimination) && optimized.size() == 2) {
+        return optimized[1];
+    }
+    return makeList(optimized, line);
+}
+
+Value Optimizer::optimizeCond(const QVector<Value>& elements, int line) {
+    QVector<Value> optimized = { elements[0] };
+    for (int i = 1; i < elements.size(); ++i) {
+        if (!elements[i].is(ExpressionKind::List) || elements[i].as<List>()->getElements().size() < 2) {
+            return makeList(elements, line);
+        }
+        const List* clause = elements[i].as<List>();
+        QVector<Value> parts = clause->getElements();
+        bool isElse = parts[0].isSymbol() && parts[0].asSymbol() == SymbolTable::Else;
+        if (!isElse) {
+            parts[0] = optimizeExpression(parts[0]);
+        }
+        for (int j = 1; j < parts.size(); ++j) {
+            parts[j] = optimizeExpression(parts[j]);
+        }
+        if (passes.testFlag(DeadCodeElimination) && !isElse && isConstant(parts[0])) {
+            if (!constantValue(parts[0]).isTruthy()) {
+                statistics.eliminatedBranches++;
+                continue;
+            }
+            // Always taken: it becomes the else clause and ends the cond
+            parts[0] = Value::symbol(SymbolTable::Else);
+            statistics.eliminatedBranches += elements.size() - 1 - i;
+            optimized.append(makeList(parts, clause->getLine()));
+            break;
+        }
+        optimized.append(makeList(parts, clause->getLine()));
+    }
+    if (optimized.size() == 1) {
+        return Value::nil();
+    }
+    return makeList(optimized, line);
+}
+
+Value Optimizer::optimizeLet(const QVector<Value>& elements, int line) {
+    if (elements.size() < 3 || (!elements[1].is(ExpressionKind::List) && !elements[1].isNil())) {
+        return makeList(elements, line);
+    }
+    QVector<int> names;
+    QVector<Value> bindings;
+    if (!elements[1].isNil()) {
+        for (const auto& binding : elements[1].as<List>()->getElements()) {
+            if (!binding.is(ExpressionKind::List) || binding.as<List>()->getElements().size() != 2
+                || !binding.as<List>()->getElements()[0].isSymbol()) {
+                return makeList(elements, line);
+            }
+            const auto& parts = binding.as<List>()->getElements();
+            names.append(parts[0].asSymbol());
+            // The initialisers are evaluated in the outer scope
+            bindings.append(makeList({ parts[0], optimizeExpression(parts[1]) }, binding.as<List>()->getLine()));
+        }
+    }
+    int bound = locals.size();
+    locals += names;
+    QVector<Value> optimized = { elements[0], makeList(bindings, line) };
+    for (int i = 2; i < elements.size(); ++i) {
+        optimized.append(optimizeExpression(elements[i]));
+    }
+    locals.resize(bound);
+    return makeList(optimized, line);
+}
+
+Value Optimizer::optimizeCall(const QVector<Value>& elements, int line) {
+    QVector<Value> optimized;
+    optimized.reserve(elements.size());
+    for (const auto& element : elements) {
+        optimized.append(optimizeExpression(element));
+    }
+
+    if (passes.testFlag(ConstantFolding)) {
+        Value folded = foldCall(optimized);
+        if (!folded.isUnbound()) {
+            statistics.foldedCalls++;
+            return folded;
+        }
+    }
+
+    if (inlineDepth < MaxInlineDepth) {
+        Value reduced;
+        if (passes.testFlag(Inlining)) {
+            reduced = inlineCall(optimized);
+            if (!reduced.isUnbound()) {
+                statistics.inlinedCalls++;
+            }
+        }
+        if (reduced.isUnbound() && passes.testFlag(BetaReduction) && isForm(optimized[0], SymbolTable::Lambda)) {
+            const auto& lambda = optimized[0].as<List>()->getElements();
+            QVector<int> params;
+            if (lambda.size() == 3 && parameterNames(lambda[1], params)) {
+                reduced = reduce(params, lambda[2], optimized.mid(1));
+                if (!reduced.isUnbound()) {
+                    statistics.betaReductions++;
+                }
+            }
+        }
+        if (!reduced.isUnbound()) {
+            // The arguments may now meet constants in the body
+            inlineDepth++;
+            Value result = optimizeExpression(reduced);
+            inlineDepth--;
+            return result;
+        }
+    }
+    return makeList(optimized, line);
+}
+
+Value Optimizer::foldCall(const QVector<Value>& elements) {
+    if (!elements[0].isSymbol() || !isBuiltin(elements[0].asSymbol())) {
+        return Value();
+    }
+    QVector<Value> args;
+    for (int i = 1; i < elements.size(); ++i) {
+        if (!isConstant(elements[i])) {
+            return Value();
+        }
+        args.append(constantValue(elements[i]));
+    }
+    if (!isPrimitive(elements[0].asSymbol())) {
+        return Value();
+    }
+    Value function = global->lookupGlobal(elements[0].asSymbol());
+    Value result;
+    try {
+        result = function.as<Primitive>()->apply(args.constData(), args.size());
+    }
+    catch (const std::exception&) {
+        // Left for run time, which reports the error if it is reached
+        return Value();
+    }
+    if (result.isObject()) {
+        return Value();
+    }
+    return constantExpression(result);
+}
+
+Value Optimizer::inlineCall(const QVector<Value>& elements) {
+    if (!wholeProgram || !elements[0].isSymbol() || isLocal(elements[0].asSymbol())) {
+        return Value();
+    }
+    int name = elements[0].asSymbol();
+    auto it = definitions.constFind(name);
+    // Top-level code runs in order, so it can only see definitions before it
+    if (it == definitions.constEnd() || it->count != 1 || it->lambda.isUnbound()
+        || (lambdaDepth == 0 && it->formIndex >= formIndex)) {
+        return Value();
+    }
+    const auto& lambda = it->lambda.as<List>()->getElements();
+    QVector<int> params;
+    if (lambda.size() != 3 || !parameterNames(lambda[1], params)
+        || expressionSize(lambda[2]) > MaxInlineSize) {
+        return Value();
+    }
+    // The body's free names refer to globals, which a local binding at the
+    // call site would capture; a recursive call would never finish inlining
+    QVector<int> symbols;
+    collectSymbols(lambda[2], symbols);
+    for (int symbol : symbols) {
+        if (symbol == name || (!params.contains(symbol) && isLocal(symbol))) {
+            return Value();
+        }
+    }
+    return reduce(params, lambda[2], elements.mid(1));
+}
+
+Value Optimizer::reduce(const QVector<int>& params, const Value& body, const QVector<Value>& args) {
+    if (params.size() != args.size() || hasBinders(body)) {
+        return Value();
+    }
+    QVector<int> uses;
+    collectSymbols(body, uses);
+    QHash<int, Value> replacements;
+    for (int i = 0; i < params.size(); ++i) {
+        int param = params[i];
+        if (param < SymbolTable::KnownSymbolCount || replacements.contains(param)
+            || usedAsMethodName(body, param)) {
+            return Value();
+        }
+        // Pure calls can still raise, so one is only substituted where the
+        // body evaluates it exactly once and before anything else
+        if (!isTrivial(args[i])
+            && !(isPureCall(args[i]) && uses.count(param) == 1 && firstUse(body, param) == FirstUse::Reached)) {
+            return Value();
+        }
+        replacements.insert(param, args[i]);
+    }
+    return substitute(body, replacements);
+}
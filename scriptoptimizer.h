@@ -0,0 +1,120 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptoptimizer.h
+#ifndef SCRIPTOPTIMIZER_H
+#define SCRIPTOPTIMIZER_H
+
+#include "scriptvalue.h"
+
+#include <QFlags>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+class Environment;
+
+// Rewrites parsed forms before they are evaluated or compiled. The passes:
+//
+//  - ConstantFolding evaluates calls to pure primitives whose arguments are
+//    all constants, when the result is an immediate
+//  - Inlining replaces calls to small, non-recursive global functions with
+//    their body
+//  - BetaReduction turns ((lambda (x) body) arg) into body with arg
+//    substituted, which is also how inlined calls are finished
+//  - DeadCodeElimination drops if and cond branches behind constant tests
+//    and constants whose value a begin discards
+//
+// Folding and inlining rely on the program not rebinding what they use, so
+// they need the whole program up front and only run from optimize(forms).
+// Substituting an argument never reorders side effects: only constants,
+// variables and calls to pure primitives are substituted, and a call only
+// where its parameter is used at most once.
+class Optimizer {
+public:
+    enum Pass {
+        ConstantFolding = 0x1,
+        Inlining = 0x2,
+        BetaReduction = 0x4,
+        DeadCodeElimination = 0x8,
+        AllPasses = 0xf
+    };
+    Q_DECLARE_FLAGS(Passes, Pass)
+
+    struct Statistics {
+        int foldedCalls = 0;
+        int inlinedCalls = 0;
+        int betaReductions = 0;
+        int eliminatedBranches = 0;
+        int eliminatedExpressions = 0;
+
+        QString report() const;
+    };
+
+    // Primitives for folding are looked up in global
+    explicit Optimizer(Environment* global, Passes passes = AllPasses);
+
+    // Optimizes a whole program, in evaluation order
+    QVector<Value> optimize(const QVector<Value>& forms);
+    // Optimizes one form without knowing the rest of the program, so only
+    // the local passes run
+    Value optimize(const Value& form);
+
+    Passes getPasses() const { return passes; }
+    const Statistics& getStatistics() const { return statistics; }
+
+private:
+    struct Definition {
+        int count = 0;
+        int formIndex = -1;
+        Value lambda;
+    };
+
+    static constexpr int MaxInlineSize = 24;
+    static constexpr int MaxInlineDepth = 4;
+
+    Environment* global;
+    Passes passes;
+    Statistics statistics;
+    bool wholeProgram = false;
+    // Every define in the program, by name
+    QHash<int, Definition> definitions;
+    // Names bound by the enclosing lambdas and lets, innermost last
+    QVector<int> locals;
+    int formIndex = 0;
+    int lambdaDepth = 0;
+    int inlineDepth = 0;
+
+    void collectDefinitions(const Value& expr, int index, bool topLevel);
+    bool isLocal(int symbol) const { return locals.contains(symbol); }
+    bool isBuiltin(int symbol) const;
+    bool isPrimitive(int symbol) const;
+    bool usedAsMethodName(const Value& expr, int symbol) const;
+    bool isPureCall(const Value& expr) const;
+
+    Value optimizeExpression(const Value& expr);
+    Value optimizeLambda(const QVector<Value>& elements, int line);
+    Value optimizeIf(const QVector<Value>& elements, int line);
+    Value optimizeBegin(const QVector<Value>& elements, int line);
+    Value optimizeCond(const QVector<Value>& elements, int line);
+    Value optimizeLet(const QVector<Value>& elements, int line);
+    Value optimizeCall(const QVector<Value>& elements, int line);
+    Value foldCall(const QVector<Value>& elements);
+    Value inlineCall(const QVector<Value>& elements);
+    Value reduce(const QVector<int>& params, const Value& body, const QVector<Value>& args);
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(Optimizer::Passes)
+
+#endif // SCRIPTOPTIMIZER_H
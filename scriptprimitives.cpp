@@ -0,0 +1,867 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptprimitives.cpp
+#include "scriptprimitives.h"
+#include "script.h"
+#include "scriptprofiler.h"
+#include <QDebug>
+#include <QMutex>
+#include <QTextStream>
+#include <QtMath>
+
+//******************************************//
+//***************** Helpers ****************//
+//******************************************//
+
+[[noreturn]] static void typeError(const char* name, const char* expected) {
+    qCritical() << "Arguments to" << name << "must be" << expected;
+    throw std::runtime_error(QString("Arguments to %1 must be %2").arg(name, expected).toStdString());
+}
+
+static void checkNumber(const Value* args, int i, const char* name) {
+    if (!args[i].isNumber()) {
+        typeError(name, "numbers");
+    }
+}
+
+static qint64 checkFixnum(const Value* args, int i, const char* name) {
+    if (!args[i].isFixnum()) {
+        typeError(name, "exact integers");
+    }
+    return args[i].asFixnum();
+}
+
+// The string object itself, for callers that must not flatten a rope
+static String* checkStringObject(const Value* args, int i, const char* name) {
+    if (!args[i].is(ExpressionKind::String)) {
+        typeError(name, "strings");
+    }
+    return args[i].as<String>();
+}
+
+static const QString& checkString(const Value* args, int i, const char* name) {
+    return checkStringObject(args, i, name)->getValue();
+}
+
+// The elements of a proper list; the empty list has none
+static const QVector<Value>& checkList(const Value* args, int i, const char* name) {
+    static const QVector<Value> empty;
+    if (args[i].isNil()) {
+        return empty;
+    }
+    if (!args[i].is(ExpressionKind::List)) {
+        typeError(name, "lists");
+    }
+    return args[i].as<List>()->getElements();
+}
+
+static Value makeString(const QString& value) {
+    return Value(Heap::create<String>(value));
+}
+
+//******************************************//
+//**************** Arithmetic **************//
+//******************************************//
+
+// Fixnum arithmetic stays exact while the result fits; anything else, or any
+// flonum operand, falls back to double precision
+static Value primitiveAdd(const Value* args, int argc) {
+    qint64 exact = 0;
+    int i = 0;
+    for (; i < argc; ++i) {
+        checkNumber(args, i, "+");
+        if (!args[i].isFixnum()) {
+            break;
+        }
+        exact += args[i].asFixnum();
+        if (exact > Value::FixnumMax || exact < Value::FixnumMin) {
+            break;
+        }
+    }
+    if (i == argc) {
+        return Value::fromFixnum(exact);
+    }
+    double result = 0;
+    for (int j = 0; j < argc; ++j) {
+        checkNumber(args, j, "+");
+        result += args[j].toDouble();
+    }
+    return Value::fromFlonum(result);
+}
+
+static Value primitiveMultiply(const Value* args, int argc) {
+    qint64 exact = 1;
+    int i = 0;
+    for (; i < argc; ++i) {
+        checkNumber(args, i, "*");
+        if (!args[i].isFixnum()) {
+            break;
+        }
+        qint64 factor = args[i].asFixnum();
+        if (factor != 0 && qAbs(exact) > Value::FixnumMax / qAbs(factor)) {
+            break;
+        }
+        exact *= factor;
+    }
+    if (i == argc) {
+        return Value::fromFixnum(exact);
+    }
+    double result = 1;
+    for (int j = 0; j < argc; ++j) {
+        checkNumber(args, j, "*");
+        result *= args[j].toDouble();
+    }
+    return Value::fromFlonum(result);
+}
+
+static Value primitiveSubtract(const Value* args, int argc) {
+    checkNumber(args, 0, "-");
+    if (argc == 1) {
+        return args[0].isFixnum() ? Value::fromNumber(-args[0].asFixnum()) : Value::fromFlonum(-args[0].asFlonum());
+    }
+    bool exact = args[0].isFixnum();
+    for (int i = 1; i < argc; ++i) {
+        checkNumber(args, i, "-");
+        exact = exact && args[i].isFixnum();
+    }
+    if (exact) {
+        qint64 result = args[0].asFixnum();
+        int i = 1;
+        for (; i < argc && result >= Value::FixnumMin && result <= Value::FixnumMax; ++i) {
+            result -= args[i].asFixnum();
+        }
+        if (i == argc) {
+            return Value::fromNumber(result);
+        }
+    }
+    double result = args[0].toDouble();
+    for (int i = 1; i < argc; ++i) {
+        result -= args[i].toDouble();
+    }
+    return Value::fromFlonum(result);
+}
+
+[[noreturn]] static void divisionByZero(const char* name) {
+    qCritical() << "Division by zero in" << name;
+    throw std::runtime_error(QString("Division by zero in %1").arg(name).toStdString());
+}
+
+static Value primitiveDivide(const Value* args, int argc) {
+    checkNumber(args, 0, "/");
+    // Only flonums divide by zero to an infinity or NaN
+    bool allFixnums = true;
+    for (int i = 0; i < argc && allFixnums; ++i) {
+        checkNumber(args, i, "/");
+        allFixnums = args[i].isFixnum();
+    }
+    if (allFixnums) {
+        for (int i = argc == 1 ? 0 : 1; i < argc; ++i) {
+            if (args[i].asFixnum() == 0) {
+                divisionByZero("/");
+            }
+        }
+    }
+    if (argc == 1) {
+        return Value::fromFlonum(1 / args[0].toDouble());
+    }
+    // Exact while every division leaves no remainder
+    bool exact = args[0].isFixnum();
+    qint64 quotient = args[0].asFixnum();
+    double result = args[0].toDouble();
+    for (int i = 1; i < argc; ++i) {
+        checkNumber(args, i, "/");
+        if (exact && args[i].isFixnum() && args[i].asFixnum() != 0 && quotient % args[i].asFixnum() == 0) {
+            quotient /= args[i].asFixnum();
+        }
+        else {
+            exact = false;
+        }
+        result /= args[i].toDouble();
+    }
+    return exact ? Value::fromNumber(quotient) : Value::fromFlonum(result);
+}
+
+static qint64 checkDivisor(const Value* args, const char* name) {
+    qint64 divisor = checkFixnum(args, 1, name);
+    if (divisor == 0) {
+        divisionByZero(name);
+    }
+    return divisor;
+}
+
+static Value primitiveQuotient(const Value* args, int) {
+    qint64 divisor = checkDivisor(args, "quotient");
+    return Value::fromNumber(checkFixnum(args, 0, "quotient") / divisor);
+}
+
+static Value primitiveRemainder(const Value* args, int) {
+    qint64 divisor = checkDivisor(args, "remainder");
+    return Value::fromFixnum(checkFixnum(args, 0, "remainder") % divisor);
+}
+
+static Value primitiveModulo(const Value* args, int) {
+    qint64 divisor = checkDivisor(args, "modulo");
+    qint64 result = checkFixnum(args, 0, "modulo") % divisor;
+    // The result takes the sign of the divisor
+    if (result != 0 && (result < 0) != (divisor < 0)) {
+        result += divisor;
+    }
+    return Value::fromFixnum(result);
+}
+
+static Value primitiveAbs(const Value* args, int) {
+    checkNumber(args, 0, "abs");
+    return args[0].isFixnum() ? Value::fromNumber(qAbs(args[0].asFixnum())) : Value::fromFlonum(qAbs(args[0].asFlonum()));
+}
+
+template <typename Pick>
+static Value pickNumber(const Value* args, int argc, const char* name, Pick pick) {
+    bool exact = true;
+    int best = 0;
+    for (int i = 0; i < argc; ++i) {
+        checkNumber(args, i, name);
+        exact = exact && args[i].isFixnum();
+        if (pick(args[i].toDouble(), args[best].toDouble())) {
+            best = i;
+        }
+    }
+    // Any inexact argument makes the result inexact
+    return exact ? args[best] : Value::fromFlonum(args[best].toDouble());
+}
+
+static Value primitiveMin(const Value* args, int argc) {
+    return pickNumber(args, argc, "min", [](double a, double b) { return a < b; });
+}
+
+static Value primitiveMax(const Value* args, int argc) {
+    return pickNumber(args, argc, "max", [](double a, double b) { return a > b; });
+}
+
+// Rounding keeps fixnums as they are and turns flonums into integral flonums
+template <typename Round>
+static Value roundNumber(const Value* args, const char* name, Round round) {
+    checkNumber(args, 0, name);
+    return args[0].isFixnum() ? args[0] : Value::fromFlonum(round(args[0].asFlonum()));
+}
+
+static Value primitiveFloor(const Value* args, int) {
+    return roundNumber(args, "floor", [](double x) { return std::floor(x); });
+}
+
+static Value primitiveCeiling(const Value* args, int) {
+    return roundNumber(args, "ceiling", [](double x) { return std::ceil(x); });
+}
+
+static Value primitiveRound(const Value* args, int) {
+    // Scheme rounds halves to even
+    return roundNumber(args, "round", [](double x) { return std::nearbyint(x); });
+}
+
+static Value primitiveTruncate(const Value* args, int) {
+    return roundNumber(args, "truncate", [](double x) { return std::trunc(x); });
+}
+
+static Value primitiveSqrt(const Value* args, int) {
+    checkNumber(args, 0, "sqrt");
+    double root = qSqrt(args[0].toDouble());
+    // Exact squares of exact integers stay exact
+    if (args[0].isFixnum() && root == std::floor(root) && qint64(root) * qint64(root) == args[0].asFixnum()) {
+        return Value::fromFixnum(qint64(root));
+    }
+    return Value::fromFlonum(root);
+}
+
+static Value primitiveExpt(const Value* args, int) {
+    checkNumber(args, 0, "expt");
+    checkNumber(args, 1, "expt");
+    if (args[0].isFixnum() && args[1].isFixnum() && args[1].asFixnum() >= 0) {
+        qint64 base = args[0].asFixnum();
+        qint64 exponent = args[1].asFixnum();
+        // These never overflow, so squaring would not stop early for them
+        if (base == 0) {
+            return Value::fromFixnum(exponent == 0 ? 1 : 0);
+        }
+        if (base == 1 || base == -1) {
+            return Value::fromFixnum(exponent % 2 == 0 ? 1 : base);
+        }
+        // Squaring, falling back to flonums once a product would leave
+        // the fixnum range
+        qint64 result = 1;
+        for (;;) {
+            if (exponent & 1) {
+                if (qAbs(result) > Value::FixnumMax / qAbs(base)) {
+                    break;
+                }
+                result *= base;
+            }
+            exponent >>= 1;
+            if (exponent == 0) {
+                return Value::fromFixnum(result);
+            }
+            if (qAbs(base) > Value::FixnumMax / qAbs(base)) {
+                break;
+            }
+            base *= base;
+        }
+    }
+    return Value::fromFlonum(qPow(args[0].toDouble(), args[1].toDouble()));
+}
+
+static Value primitiveExactToInexact(const Value* args, int) {
+    checkNumber(args, 0, "exact->inexact");
+    return Value::fromFlonum(args[0].toDouble());
+}
+
+static Value primitiveInexactToExact(const Value* args, int) {
+    checkNumber(args, 0, "inexact->exact");
+    if (args[0].isFixnum()) {
+        return args[0];
+    }
+    double value = args[0].asFlonum();
+    if (value != std::trunc(value) || value > double(Value::FixnumMax) || value < double(Value::FixnumMin)) {
+        qCritical() << "inexact->exact: no exact representation for" << args[0].toString();
+        throw std::runtime_error(QString("inexact->exact: no exact representation for %1").arg(args[0].toString()).toStdString());
+    }
+    return Value::fromFixnum(qint64(value));
+}
+
+//******************************************//
+//**************** Comparison **************//
+//******************************************//
+
+template <typename Compare>
+static Value compareNumbers(const Value* args, int argc, const char* name, Compare compare) {
+    for (int i = 0; i < argc; ++i) {
+        checkNumber(args, i, name);
+    }
+    for (int i = 0; i + 1 < argc; ++i) {
+        bool holds = args[i].isFixnum() && args[i + 1].isFixnum()
+                         ? compare(args[i].asFixnum(), args[i + 1].asFixnum())
+                         : compare(args[i].toDouble(), args[i + 1].toDouble());
+        if (!holds) {
+            return Value::boolean(false);
+        }
+    }
+    return Value::boolean(true);
+}
+
+static Value primitiveEqual(const Value* args, int argc) {
+    return compareNumbers(args, argc, "=", [](auto a, auto b) { return a == b; });
+}
+
+static Value primitiveLess(const Value* args, int argc) {
+    return compareNumbers(args, argc, "<", [](auto a, auto b) { return a < b; });
+}
+
+static Value primitiveGreater(const Value* args, int argc) {
+    return compareNumbers(args, argc, ">", [](auto a, auto b) { return a > b; });
+}
+
+static Value primitiveLessOrEqual(const Value* args, int argc) {
+    return compareNumbers(args, argc, "<=", [](auto a, auto b) { return a <= b; });
+}
+
+static Value primitiveGreaterOrEqual(const Value* args, int argc) {
+    return compareNumbers(args, argc, ">=", [](auto a, auto b) { return a >= b; });
+}
+
+// equal? compares lists and strings by contents, everything else like eqv?
+static bool isEqual(const Value& a, const Value& b) {
+    if (a.is(ExpressionKind::List) && b.is(ExpressionKind::List)) {
+        const auto& left = a.as<List>()->getElements();
+        const auto& right = b.as<List>()->getElements();
+        if (left.size() != right.size()) {
+            return false;
+        }
+        for (int i = 0; i < left.size(); ++i) {
+            if (!isEqual(left[i], right[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (a.is(ExpressionKind::String) && b.is(ExpressionKind::String)) {
+        return a.as<String>()->getValue() == b.as<String>()->getValue();
+    }
+    return a.isIdentical(b);
+}
+
+static Value primitiveEqv(const Value* args, int) {
+    return Value::boolean(args[0].isIdentical(args[1]));
+}
+
+static Value primitiveEqualP(const Value* args, int) {
+    return Value::boolean(isEqual(args[0], args[1]));
+}
+
+static Value primitiveNot(const Value* args, int) {
+    return Value::boolean(!args[0].isTruthy());
+}
+
+//******************************************//
+//*************** Predicates ***************//
+//******************************************//
+
+static Value primitiveNumberP(const Value* args, int) {
+    return Value::boolean(args[0].isNumber());
+}
+
+static Value primitiveIntegerP(const Value* args, int) {
+    return Value::boolean(args[0].isFixnum() || (args[0].isFlonum() && args[0].asFlonum() == std::trunc(args[0].asFlonum())));
+}
+
+static Value primitiveZeroP(const Value* args, int) {
+    checkNumber(args, 0, "zero?");
+    return Value::boolean(args[0].toDouble() == 0);
+}
+
+static Value primitivePositiveP(const Value* args, int) {
+    checkNumber(args, 0, "positive?");
+    return Value::boolean(args[0].toDouble() > 0);
+}
+
+static Value primitiveNegativeP(const Value* args, int) {
+    checkNumber(args, 0, "negative?");
+    return Value::boolean(args[0].toDouble() < 0);
+}
+
+static Value primitiveBooleanP(const Value* args, int) {
+    return Value::boolean(args[0].isBoolean());
+}
+
+static Value primitiveSymbolP(const Value* args, int) {
+    return Value::boolean(args[0].isSymbol());
+}
+
+static Value primitiveStringP(const Value* args, int) {
+    return Value::boolean(args[0].is(ExpressionKind::String));
+}
+
+static Value primitiveProcedureP(const Value* args, int) {
+    return Value::boolean(args[0].is(ExpressionKind::Function) || args[0].is(ExpressionKind::Primitive));
+}
+
+static Value primitiveNullP(const Value* args, int) {
+    return Value::boolean(args[0].isNil());
+}
+
+static Value primitivePairP(const Value* args, int) {
+    return Value::boolean(args[0].is(ExpressionKind::List));
+}
+
+static Value primitiveListP(const Value* args, int) {
+    return Value::boolean(args[0].isNil() || args[0].is(ExpressionKind::List));
+}
+
+//******************************************//
+//****************** Lists *****************//
+//******************************************//
+
+// Lists are vector-backed, so cons and cdr build a new list; the cdr of a
+// cons must itself be a list
+static Value primitiveCar(const Value* args, int) {
+    if (!args[0].is(ExpressionKind::List)) {
+        typeError("car", "non-empty lists");
+    }
+    return args[0].as<List>()->getElements().first();
+}
+
+static Value primitiveCdr(const Value* args, int) {
+    if (!args[0].is(ExpressionKind::List)) {
+        typeError("cdr", "non-empty lists");
+    }
+    return makeList(args[0].as<List>()->getElements().mid(1));
+}
+
+static Value primitiveCons(const Value* args, int) {
+    const auto& tail = checkList(args, 1, "cons");
+    QVector<Value> elements;
+    elements.reserve(tail.size() + 1);
+    elements.append(args[0]);
+    elements.append(tail);
+    return makeList(elements);
+}
+
+static Value primitiveList(const Value* args, int argc) {
+    return makeList(QVector<Value>(args, args + argc));
+}
+
+static Value primitiveLength(const Value* args, int) {
+    return Value::fromFixnum(checkList(args, 0, "length").size());
+}
+
+static Value primitiveAppend(const Value* args, int argc) {
+    QVector<Value> elements;
+    for (int i = 0; i < argc; ++i) {
+        elements.append(checkList(args, i, "append"));
+    }
+    return makeList(elements);
+}
+
+static Value primitiveReverse(const Value* args, int) {
+    QVector<Value> elements = checkList(args, 0, "reverse");
+    std::reverse(elements.begin(), elements.end());
+    return makeList(elements);
+}
+
+static Value primitiveListRef(const Value* args, int) {
+    const auto& elements = checkList(args, 0, "list-ref");
+    qint64 index = checkFixnum(args, 1, "list-ref");
+    if (index < 0 || index >= elements.size()) {
+        qCritical() << "list-ref: index" << index << "out of range";
+        throw std::runtime_error(QString("list-ref: index %1 out of range").arg(index).toStdString());
+    }
+    return elements[index];
+}
+
+//******************************************//
+//***************** Strings ****************//
+//******************************************//
+
+static Value primitiveStringLength(const Value* args, int) {
+    return Value::fromFixnum(checkStringObject(args, 0, "string-length")->size());
+}
+
+static Value primitiveStringAppend(const Value* args, int argc) {
+    if (argc == 0) {
+        return makeString(QString());
+    }
+    String* result = checkStringObject(args, 0, "string-append");
+    for (int i = 1; i < argc; ++i) {
+        result = String::concatenate(result, checkStringObject(args, i, "string-append"));
+    }
+    return Value(result);
+}
+
+static Value primitiveSubstring(const Value* args, int argc) {
+    const QString& str = checkString(args, 0, "substring");
+    qint64 start = checkFixnum(args, 1, "substring");
+    qint64 end = argc > 2 ? checkFixnum(args, 2, "substring") : str.size();
+    if (start < 0 || end < start || end > str.size()) {
+        qCritical() << "substring: range" << start << "to" << end << "out of bounds";
+        throw std::runtime_error(QString("substring: range %1 to %2 out of bounds").arg(start).arg(end).toStdString());
+    }
+    return makeString(str.mid(start, end - start));
+}
+
+static Value primitiveStringEqual(const Value* args, int argc) {
+    for (int i = 0; i + 1 < argc; ++i) {
+        if (checkString(args, i, "string=?") != checkString(args, i + 1, "string=?")) {
+            return Value::boolean(false);
+        }
+    }
+    return Value::boolean(true);
+}
+
+static Value primitiveStringLess(const Value* args, int argc) {
+    for (int i = 0; i + 1 < argc; ++i) {
+        if (!(checkString(args, i, "string<?") < checkString(args, i + 1, "string<?"))) {
+            return Value::boolean(false);
+        }
+    }
+    return Value::boolean(true);
+}
+
+static Value primitiveStringSplit(const Value* args, int) {
+    const QString& str = checkString(args, 0, "string-split");
+    const QString& separator = checkString(args, 1, "string-split");
+    if (separator.isEmpty()) {
+        qCritical() << "string-split: separator must not be empty";
+        throw std::runtime_error("string-split: separator must not be empty");
+    }
+    QVector<Value> parts;
+    qsizetype start = 0;
+    for (;;) {
+        qsizetype end = str.indexOf(separator, start);
+        if (end < 0) {
+            break;
+        }
+        parts.append(makeString(str.mid(start, end - start)));
+        start = end + separator.size();
+    }
+    parts.append(makeString(str.mid(start)));
+    return makeList(parts);
+}
+
+static Value primitiveStringJoin(const Value* args, int argc) {
+    const auto& elements = checkList(args, 0, "string-join");
+    QString separator = argc > 1 ? checkString(args, 1, "string-join") : QString();
+    qsizetype length = 0;
+    for (int i = 0; i < elements.size(); ++i) {
+        length += checkStringObject(elements.constData(), i, "string-join")->size();
+    }
+    if (!elements.isEmpty()) {
+        length += separator.size() * (elements.size() - 1);
+    }
+    QString result;
+    result.reserve(length);
+    for (int i = 0; i < elements.size(); ++i) {
+        if (i > 0) {
+            result += separator;
+        }
+        result += elements[i].as<String>()->getValue();
+    }
+    return makeString(result);
+}
+
+static Value primitiveStringUpcase(const Value* args, int) {
+    return makeString(checkString(args, 0, "string-upcase").toUpper());
+}
+
+static Value primitiveStringDowncase(const Value* args, int) {
+    return makeString(checkString(args, 0, "string-downcase").toLower());
+}
+
+static Value primitiveStringToSymbol(const Value* args, int) {
+    return Value::symbol(SymbolTable::intern(checkString(args, 0, "string->symbol")));
+}
+
+static Value primitiveSymbolToString(const Value* args, int) {
+    if (!args[0].isSymbol()) {
+        typeError("symbol->string", "symbols");
+    }
+    return makeString(SymbolTable::name(args[0].asSymbol()));
+}
+
+static Value primitiveNumberToString(const Value* args, int) {
+    checkNumber(args, 0, "number->string");
+    return makeString(args[0].toString());
+}
+
+static Value primitiveStringToNumber(const Value* args, int) {
+    const QString& str = checkString(args, 0, "string->number");
+    bool ok;
+    qint64 integer = str.toLongLong(&ok);
+    if (ok) {
+        return Value::fromNumber(integer);
+    }
+    double value = str.toDouble(&ok);
+    return ok ? Value::fromFlonum(value) : Value::boolean(false);
+}
+
+//******************************************//
+//***************** Objects ****************//
+//******************************************//
+
+static Instance* checkInstance(const Value* args, const char* name) {
+    if (!args[0].is(ExpressionKind::Instance) || !args[1].isSymbol()) {
+        typeError(name, "an instance and a symbol");
+    }
+    return args[0].as<Instance>();
+}
+
+// Attributes shadow methods of the same name, as in method calls
+static Value primitiveSlotRef(const Value* args, int) {
+    return checkInstance(args, "slot-ref")->lookup(args[1].asSymbol());
+}
+
+static Value primitiveSlotSet(const Value* args, int) {
+    checkInstance(args, "slot-set!")->setAttribute(args[1].asSymbol(), args[2]);
+    return args[2];
+}
+
+//******************************************//
+//****************** Heap ******************//
+//******************************************//
+
+// One list per type: (type allocations bytes-allocated live-objects live-bytes)
+static Value primitiveHeapStats(const Value*, int) {
+    QVector<Value> types;
+    for (const auto& stats : Heap::current()->getTypeStatistics()) {
+        types.append(makeList({
+            Value::symbol(SymbolTable::intern(stats.name)),
+            Value::fromNumber(stats.allocations),
+            Value::fromNumber(stats.bytesAllocated),
+            Value::fromNumber(stats.liveObjects),
+            Value::fromNumber(stats.liveBytes)
+        }));
+    }
+    return makeList(types);
+}
+
+// One list per allocation site, largest first: (site objects bytes). Sites
+// are only recorded while allocation site tracking is on.
+static Value primitiveHeapSnapshot(const Value*, int) {
+    Heap::Snapshot snapshot = Heap::current()->snapshot();
+    Profiler* profiler = Profiler::current();
+    QString sourceName = profiler ? profiler->getSourceName() : QString();
+    QVector<Value> sites;
+    for (const auto& stats : snapshot.sites) {
+        sites.append(makeList({
+            Value(Heap::create<String>(Profiler::describeSite(stats.site, sourceName))),
+            Value::fromNumber(stats.objects),
+            Value::fromNumber(stats.bytes)
+        }));
+    }
+    return makeList(sites);
+}
+
+//******************************************//
+//****************** Output ****************//
+//******************************************//
+
+// Scripts on executor threads and actor workers share standard output, so
+// writes to it go through outputMutex
+static QMutex outputMutex;
+
+static QTextStream& standardOutput() {
+    static QTextStream out(stdout);
+    return out;
+}
+
+// Writes text to the string port in args[i], or to standard output when
+// the argument was left out
+static void writeOutput(const Value* args, int argc, int i, const char* name, const QString& text) {
+    if (i >= argc) {
+        QMutexLocker locker(&outputMutex);
+        standardOutput() << text;
+        standardOutput().flush();
+        return;
+    }
+    if (!args[i].is(ExpressionKind::StringPort)) {
+        typeError(name, "string ports");
+    }
+    args[i].as<StringPort>()->write(text);
+}
+
+static Value primitiveDisplay(const Value* args, int argc) {
+    if (args[0].is(ExpressionKind::String)) {
+        writeOutput(args, argc, 1, "display", args[0].as<String>()->getValue());
+    }
+    else {
+        writeOutput(args, argc, 1, "display", args[0].toString());
+    }
+    return Value::nil();
+}
+
+static Value primitiveNewline(const Value* args, int argc) {
+    writeOutput(args, argc, 0, "newline", "\n");
+    return Value::nil();
+}
+
+static Value primitiveWriteString(const Value* args, int argc) {
+    writeOutput(args, argc, 1, "write-string", checkString(args, 0, "write-string"));
+    return Value::nil();
+}
+
+static Value primitiveOpenOutputString(const Value*, int) {
+    return Value(Heap::create<StringPort>());
+}
+
+static Value primitiveGetOutputString(const Value* args, int) {
+    if (!args[0].is(ExpressionKind::StringPort)) {
+        typeError("get-output-string", "string ports");
+    }
+    return makeString(args[0].as<StringPort>()->getBuffer());
+}
+
+//******************************************//
+//****************** Table *****************//
+//******************************************//
+
+namespace {
+struct PrimitiveDefinition {
+    const char* name;
+    int minArgs;
+    int maxArgs;
+    Primitive::Callback callback;
+};
+}
+
+static const PrimitiveDefinition primitiveTable[] = {
+    { "+", 0, Primitive::Variadic, primitiveAdd },
+    { "-", 1, Primitive::Variadic, primitiveSubtract },
+    { "*", 0, Primitive::Variadic, primitiveMultiply },
+    { "/", 1, Primitive::Variadic, primitiveDivide },
+    { "quotient", 2, 2, primitiveQuotient },
+    { "remainder", 2, 2, primitiveRemainder },
+    { "modulo", 2, 2, primitiveModulo },
+    { "abs", 1, 1, primitiveAbs },
+    { "min", 1, Primitive::Variadic, primitiveMin },
+    { "max", 1, Primitive::Variadic, primitiveMax },
+    { "floor", 1, 1, primitiveFloor },
+    { "ceiling", 1, 1, primitiveCeiling },
+    { "round", 1, 1, primitiveRound },
+    { "truncate", 1, 1, primitiveTruncate },
+    { "sqrt", 1, 1, primitiveSqrt },
+    { "expt", 2, 2, primitiveExpt },
+    { "exact->inexact", 1, 1, primitiveExactToInexact },
+    { "inexact->exact", 1, 1, primitiveInexactToExact },
+
+    { "=", 1, Primitive::Variadic, primitiveEqual },
+    { "<", 1, Primitive::Variadic, primitiveLess },
+    { ">", 1, Primitive::Variadic, primitiveGreater },
+    { "<=", 1, Primitive::Variadic, primitiveLessOrEqual },
+    { ">=", 1, Primitive::Variadic, primitiveGreaterOrEqual },
+    { "eq?", 2, 2, primitiveEqv },
+    { "eqv?", 2, 2, primitiveEqv },
+    { "equal?", 2, 2, primitiveEqualP },
+    { "not", 1, 1, primitiveNot },
+
+    { "number?", 1, 1, primitiveNumberP },
+    { "integer?", 1, 1, primitiveIntegerP },
+    { "zero?", 1, 1, primitiveZeroP },
+    { "positive?", 1, 1, primitivePositiveP },
+    { "negative?", 1, 1, primitiveNegativeP },
+    { "boolean?", 1, 1, primitiveBooleanP },
+    { "symbol?", 1, 1, primitiveSymbolP },
+    { "string?", 1, 1, primitiveStringP },
+    { "procedure?", 1, 1, primitiveProcedureP },
+    { "null?", 1, 1, primitiveNullP },
+    { "pair?", 1, 1, primitivePairP },
+    { "list?", 1, 1, primitiveListP },
+
+    { "car", 1, 1, primitiveCar },
+    { "cdr", 1, 1, primitiveCdr },
+    { "cons", 2, 2, primitiveCons },
+    { "list", 0, Primitive::Variadic, primitiveList },
+    { "length", 1, 1, primitiveLength },
+    { "append", 0, Primitive::Variadic, primitiveAppend },
+    { "reverse", 1, 1, primitiveReverse },
+    { "list-ref", 2, 2, primitiveListRef },
+
+    { "string-length", 1, 1, primitiveStringLength },
+    { "string-append", 0, Primitive::Variadic, primitiveStringAppend },
+    { "substring", 2, 3, primitiveSubstring },
+    { "string-split", 2, 2, primitiveStringSplit },
+    { "string-join", 1, 2, primitiveStringJoin },
+    { "string=?", 1, Primitive::Variadic, primitiveStringEqual },
+    { "string<?", 1, Primitive::Variadic, primitiveStringLess },
+    { "string-upcase", 1, 1, primitiveStringUpcase },
+    { "string-downcase", 1, 1, primitiveStringDowncase },
+    { "string->symbol", 1, 1, primitiveStringToSymbol },
+    { "symbol->string", 1, 1, primitiveSymbolToString },
+    { "number->string", 1, 1, primitiveNumberToString },
+    { "string->number", 1, 1, primitiveStringToNumber },
+
+    { "slot-ref", 2, 2, primitiveSlotRef },
+    { "slot-set!", 3, 3, primitiveSlotSet },
+
+    { "heap-stats", 0, 0, primitiveHeapStats },
+    { "heap-snapshot", 0, 0, primitiveHeapSnapshot },
+
+    { "display", 1, 2, primitiveDisplay },
+    { "newline", 0, 1, primitiveNewline },
+    { "write-string", 1, 2, primitiveWriteString },
+    { "open-output-string", 0, 0, primitiveOpenOutputString },
+    { "get-output-string", 1, 1, primitiveGetOutputString },
+};
+
+void definePrimitives(Environment* env) {
+    for (const auto& definition : primitiveTable) {
+        auto primitive = Heap::create<Primitive>(definition.name, definition.minArgs, definition.maxArgs, definition.callback);
+        env->define(definition.name, Value(primitive));
+    }
+}
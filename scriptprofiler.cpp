@@ -0,0 +1,315 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptprofiler.cpp
+#include "scriptprofiler.h"
+#include "script.h"
+#include <QDebug>
+#include <QFile>
+#include <QTextStream>
+#include <QThread>
+#include <algorithm>
+
+static thread_local Profiler* currentProfiler = nullptr;
+
+// Frames are encoded as the site's name symbol in the high half and its
+// source line in the low half. Primitives have no line and use -1.
+static constexpr qint32 PrimitiveLine = -1;
+
+static quint64 makeSite(int name, int line) {
+    return (quint64(quint32(name)) << 32) | quint32(line);
+}
+
+// Ticks the owning profiler at its sample interval until asked to stop
+namespace {
+class SamplerThread : public QThread {
+    QAtomicInt& ticks;
+    QAtomicInt& stopRequested;
+    int intervalUs;
+public:
+    SamplerThread(QAtomicInt& t, QAtomicInt& stop, int interval)
+        : ticks(t), stopRequested(stop), intervalUs(interval) {}
+protected:
+    void run() override {
+        while (!stopRequested.loadRelaxed()) {
+            QThread::usleep(intervalUs);
+            ticks.fetchAndAddRelaxed(1);
+        }
+    }
+};
+}
+
+Profiler::Profiler(Mode m, int interval)
+    : mode(m), sampleIntervalUs(qMax(interval, 1)) {
+    clear();
+}
+
+Profiler::~Profiler() {
+    stop();
+}
+
+Profiler* Profiler::current() {
+    return currentProfiler;
+}
+
+Profiler::Scope::Scope(Profiler* profiler) : previous(currentProfiler) {
+    currentProfiler = profiler;
+}
+
+Profiler::Scope::~Scope() {
+    currentProfiler = previous;
+}
+
+void Profiler::start() {
+    if (running) {
+        return;
+    }
+    running = true;
+    clock.start();
+    if (mode == Sampling) {
+        pendingTicks.storeRelaxed(0);
+        stopRequested.storeRelaxed(0);
+        sampler = new SamplerThread(pendingTicks, stopRequested, sampleIntervalUs);
+        sampler->start();
+    }
+}
+
+void Profiler::stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    if (sampler) {
+        stopRequested.storeRelaxed(1);
+        sampler->wait();
+        delete sampler;
+        sampler = nullptr;
+    }
+    // Ticks that arrived after the last call boundary have nowhere to go
+    pendingTicks.storeRelaxed(0);
+}
+
+void Profiler::clear() {
+    stack.clear();
+    tailBase = 0;
+    samples.clear();
+    activations.clear();
+    totals.clear();
+    nodes.clear();
+    // Node 0 is the top level, outside any function
+    nodes.append({ 0, -1, {}, 0, 0 });
+    clock.start();
+}
+
+quint64 Profiler::siteOf(const Function* function) {
+    return makeSite(function->getName(), function->getLine());
+}
+
+quint64 Profiler::siteOf(const Primitive* primitive) {
+    return makeSite(primitive->getSymbol(), PrimitiveLine);
+}
+
+quint64 Profiler::currentSite() {
+    if (!currentProfiler || currentProfiler->stack.isEmpty()) {
+        return TopLevelSite;
+    }
+    return currentProfiler->stack.last();
+}
+
+//******************************************//
+//**************** Recording ***************//
+//******************************************//
+
+void Profiler::takeSample() {
+    int ticks = pendingTicks.fetchAndStoreRelaxed(0);
+    if (ticks > 0) {
+        samples[stack] += ticks;
+    }
+}
+
+void Profiler::enterExact(quint64 site) {
+    int parent = activations.isEmpty() ? 0 : activations.last().node;
+    int node = nodes[parent].children.value(site, -1);
+    if (node < 0) {
+        node = nodes.size();
+        nodes.append({ site, parent, {}, 0, 0 });
+        nodes[parent].children.insert(site, node);
+    }
+    nodes[node].calls++;
+    SiteTotals& siteTotals = totals[site];
+    siteTotals.calls++;
+    siteTotals.active++;
+    activations.append({ node, clock.nsecsElapsed(), 0 });
+}
+
+void Profiler::leaveExact() {
+    Activation activation = activations.takeLast();
+    qint64 elapsed = clock.nsecsElapsed() - activation.start;
+    qint64 self = elapsed - activation.childNs;
+    Node& node = nodes[activation.node];
+    node.selfNs += self;
+    SiteTotals& siteTotals = totals[node.site];
+    siteTotals.selfNs += self;
+    // Only the outermost activation of a recursive function adds to its
+    // inclusive time, or the time would be counted once per level
+    if (--siteTotals.active == 0) {
+        siteTotals.inclusiveNs += elapsed;
+    }
+    if (!activations.isEmpty()) {
+        activations.last().childNs += elapsed;
+    }
+}
+
+//******************************************//
+//***************** Output *****************//
+//******************************************//
+
+QString Profiler::siteName(quint64 site) const {
+    return describeSite(site, sourceName);
+}
+
+QString Profiler::describeSite(quint64 site, const QString& sourceName) {
+    if (site == TopLevelSite) {
+        return "<top level>";
+    }
+    int name = qint32(site >> 32);
+    int line = qint32(site & 0xffffffff);
+    QString label = name >= 0 ? SymbolTable::name(name) : QString("<lambda>");
+    if (line != PrimitiveLine) {
+        label += QString(" (%1:%2)").arg(sourceName.isEmpty() ? QString("<script>") : sourceName).arg(line);
+    }
+    // ';' separates frames in the collapsed format
+    return label.replace(';', ':');
+}
+
+QString Profiler::stackName(const QVector<quint64>& sites) const {
+    if (sites.isEmpty()) {
+        return "<top level>";
+    }
+    QStringList names;
+    for (quint64 site : sites) {
+        names << siteName(site);
+    }
+    return names.join(';');
+}
+
+QVector<Profiler::FunctionStats> Profiler::functionStats() const {
+    QHash<quint64, FunctionStats> bySite;
+    if (mode == Exact) {
+        for (auto it = totals.begin(); it != totals.end(); ++it) {
+            FunctionStats& stats = bySite[it.key()];
+            stats.calls = it.value().calls;
+            stats.inclusiveNs = it.value().inclusiveNs;
+            stats.selfNs = it.value().selfNs;
+        }
+    }
+    else {
+        for (auto it = samples.begin(); it != samples.end(); ++it) {
+            const QVector<quint64>& sites = it.key();
+            for (int i = 0; i < sites.size(); ++i) {
+                // A recursive function is only counted once per sample
+                if (sites.indexOf(sites[i]) == i) {
+                    bySite[sites[i]].samples += it.value();
+                }
+            }
+            if (!sites.isEmpty()) {
+                bySite[sites.last()].selfSamples += it.value();
+            }
+        }
+    }
+
+    QVector<FunctionStats> result;
+    for (auto it = bySite.begin(); it != bySite.end(); ++it) {
+        it.value().name = siteName(it.key());
+        result.append(it.value());
+    }
+    std::sort(result.begin(), result.end(), [](const FunctionStats& a, const FunctionStats& b) {
+        if (a.selfNs != b.selfNs) {
+            return a.selfNs > b.selfNs;
+        }
+        if (a.selfSamples != b.selfSamples) {
+            return a.selfSamples > b.selfSamples;
+        }
+        return a.name < b.name;
+    });
+    return result;
+}
+
+QString Profiler::collapsedStacks() const {
+    QStringList lines;
+    if (mode == Exact) {
+        // Each node's self time in microseconds, the unit flame graphs expect
+        for (int i = 0; i < nodes.size(); ++i) {
+            qint64 us = nodes[i].selfNs / 1000;
+            if (i == 0 || us <= 0) {
+                continue;
+            }
+            QVector<quint64> sites;
+            for (int n = i; n > 0; n = nodes[n].parent) {
+                sites.prepend(nodes[n].site);
+            }
+            lines << QString("%1 %2").arg(stackName(sites)).arg(us);
+        }
+    }
+    else {
+        for (auto it = samples.begin(); it != samples.end(); ++it) {
+            lines << QString("%1 %2").arg(stackName(it.key())).arg(it.value());
+        }
+    }
+    lines.sort();
+    return lines.isEmpty() ? QString() : lines.join('\n') + '\n';
+}
+
+bool Profiler::writeCollapsedStacks(const QString& path) const {
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text | QIODevice::Truncate)) {
+        qCritical() << "Failed to write profile:" << path;
+        return false;
+    }
+    QTextStream out(&file);
+    out << collapsedStacks();
+    return true;
+}
+
+QString Profiler::report() const {
+    QString result;
+    QTextStream out(&result);
+    auto stats = functionStats();
+    if (mode == Exact) {
+        out << QString("%1 %2 %3  %4\n").arg("calls", 10).arg("incl ms", 11).arg("self ms", 11).arg("function");
+        for (const auto& s : stats) {
+            out << QString("%1 %2 %3  %4\n")
+                       .arg(s.calls, 10)
+                       .arg(s.inclusiveNs / 1e6, 11, 'f', 3)
+                       .arg(s.selfNs / 1e6, 11, 'f', 3)
+                       .arg(s.name);
+        }
+    }
+    else {
+        qint64 total = 0;
+        for (qint64 count : samples) {
+            total += count;
+        }
+        out << QString("%1 %2 %3  %4\n").arg("samples", 10).arg("self %", 8).arg("total %", 8).arg("function");
+        for (const auto& s : stats) {
+            out << QString("%1 %2 %3  %4\n")
+                       .arg(s.samples, 10)
+                       .arg(total ? 100.0 * s.selfSamples / total : 0.0, 8, 'f', 1)
+                       .arg(total ? 100.0 * s.samples / total : 0.0, 8, 'f', 1)
+                       .arg(s.name);
+        }
+        out << QString("%1 samples at %2 us\n").arg(total).arg(sampleIntervalUs);
+    }
+    return result;
+}
@@ -0,0 +1,218 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptprofiler.h
+#ifndef SCRIPTPROFILER_H
+#define SCRIPTPROFILER_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+class Function;
+class Primitive;
+class QThread;
+
+// Attributes the time a script spends to the functions it calls. Both
+// evaluators report every call and return to the profiler that is current
+// on their thread, which keeps a shadow stack of call sites. A site is a
+// function's defined name and source line, or a primitive's name.
+//
+// Sampling mode is the cheap one: a background thread ticks at a fixed
+// interval, and the next call or return after a tick records the shadow
+// stack. Exact mode times every call, giving call counts, inclusive and
+// self time per function. Either mode can write collapsed stacks, one line
+// per stack with frames separated by ';' and a count at the end, as read by
+// flamegraph.pl and similar tools.
+class Profiler {
+public:
+    enum Mode {
+        Sampling,
+        Exact
+    };
+
+    struct FunctionStats {
+        QString name;
+        qint64 calls = 0;           // exact mode only
+        qint64 inclusiveNs = 0;     // exact mode; recursive calls are counted once
+        qint64 selfNs = 0;          // exact mode
+        qint64 samples = 0;         // sampling mode; samples with the function anywhere on the stack
+        qint64 selfSamples = 0;     // sampling mode; samples with the function on top
+    };
+
+    explicit Profiler(Mode mode, int sampleIntervalUs = 1000);
+    ~Profiler();
+
+    // The profiler the evaluators report to on this thread, or nullptr
+    static Profiler* current();
+
+    // Makes a profiler current on this thread for the lifetime of the scope;
+    // a null profiler turns profiling off inside the scope
+    class Scope {
+        Profiler* previous;
+    public:
+        explicit Scope(Profiler* profiler);
+        ~Scope();
+    };
+
+    // Reports one call that runs to completion within the scope
+    class CallScope {
+        Profiler* profiler;
+        int base;
+    public:
+        CallScope(Profiler* p, const Function* callee) : profiler(p) {
+            if (profiler) {
+                base = profiler->depth();
+                profiler->enter(siteOf(callee));
+            }
+        }
+        CallScope(Profiler* p, const Primitive* callee) : profiler(p) {
+            if (profiler) {
+                base = profiler->depth();
+                profiler->enter(siteOf(callee));
+            }
+        }
+        ~CallScope() {
+            if (profiler) {
+                profiler->unwind(base);
+            }
+        }
+    };
+
+    // Covers one loop of the tree-walking evaluator. A tail call made by the
+    // loop replaces the frame of the previous one rather than nesting, and
+    // whatever the loop entered is left when the scope ends.
+    class TailScope {
+        Profiler* profiler;
+        int base;
+        int savedTailBase;
+    public:
+        explicit TailScope(Profiler* p) : profiler(p) {
+            if (profiler) {
+                base = profiler->depth();
+                savedTailBase = profiler->tailBase;
+                profiler->tailBase = base;
+            }
+        }
+        ~TailScope() {
+            if (profiler) {
+                profiler->unwind(base);
+                profiler->tailBase = savedTailBase;
+            }
+        }
+    };
+
+    Mode getMode() const { return mode; }
+    // Labels source lines in the output, e.g. the script's file name
+    void setSourceName(const QString& name) { sourceName = name; }
+    const QString& getSourceName() const { return sourceName; }
+
+    void start();
+    void stop();
+    bool isRunning() const { return running; }
+    void clear();
+
+    // Evaluator hooks. enter() pushes a frame; unwind() pops frames until
+    // the stack is depth frames deep again.
+    int depth() const { return stack.size(); }
+    void enter(quint64 site) {
+        if (mode == Exact) {
+            enterExact(site);
+        }
+        else if (pendingTicks.loadRelaxed()) {
+            takeSample();
+        }
+        stack.append(site);
+    }
+    void enterTail(const Function* callee) {
+        unwind(tailBase);
+        enter(siteOf(callee));
+    }
+    void unwind(int target) {
+        while (stack.size() > target) {
+            if (mode == Exact) {
+                leaveExact();
+            }
+            else if (pendingTicks.loadRelaxed()) {
+                takeSample();
+            }
+            stack.removeLast();
+        }
+    }
+
+    static quint64 siteOf(const Function* function);
+    static quint64 siteOf(const Primitive* primitive);
+    // The site on top of the current profiler's stack, or TopLevelSite when
+    // nothing is being called or no profiler is current. Used as the heap's
+    // site function to attribute allocations.
+    static constexpr quint64 TopLevelSite = ~quint64(0);
+    static quint64 currentSite();
+    // Readable name of a site, labelling lines with sourceName
+    static QString describeSite(quint64 site, const QString& sourceName);
+
+    // Sorted by self time, or self samples, with the most expensive first
+    QVector<FunctionStats> functionStats() const;
+    QString collapsedStacks() const;
+    bool writeCollapsedStacks(const QString& path) const;
+    // Human-readable table of functionStats()
+    QString report() const;
+
+private:
+    // A node of the calling-context tree that exact mode accumulates
+    struct Node {
+        quint64 site;
+        int parent;
+        QHash<quint64, int> children;
+        qint64 calls = 0;
+        qint64 selfNs = 0;
+    };
+    struct Activation {
+        int node;
+        qint64 start;
+        qint64 childNs;
+    };
+    struct SiteTotals {
+        qint64 calls = 0;
+        qint64 inclusiveNs = 0;
+        qint64 selfNs = 0;
+        int active = 0;
+    };
+
+    Mode mode;
+    int sampleIntervalUs;
+    QString sourceName;
+    bool running = false;
+    QVector<quint64> stack;
+    int tailBase = 0;
+
+    QAtomicInt pendingTicks;
+    QAtomicInt stopRequested;
+    QThread* sampler = nullptr;
+    QHash<QVector<quint64>, qint64> samples;
+
+    QElapsedTimer clock;
+    QVector<Node> nodes;
+    QVector<Activation> activations;
+    QHash<quint64, SiteTotals> totals;
+
+    void takeSample();
+    void enterExact(quint64 site);
+    void leaveExact();
+    QString siteName(quint64 site) const;
+    QString stackName(const QVector<quint64>& sites) const;
+};
+
+#endif // SCRIPTPROFILER_H
@@ -0,0 +1,151 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptreader.cpp
+#include "scriptreader.h"
+#include "script.h"
+#include "scriptlexer.h"
+#include <QDebug>
+
+// Length of the longest prefix of bytes that does not end inside a UTF-8
+// sequence, so a window boundary never splits a character
+static qint64 completeUtf8(const uchar* bytes, qint64 length) {
+    qint64 lead = length;
+    while (lead > 0 && (bytes[lead - 1] & 0xC0) == 0x80) {
+        lead--;
+    }
+    if (lead == 0) {
+        return length;
+    }
+    uchar c = bytes[lead - 1];
+    int needed = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return length - (lead - 1) >= needed ? length : lead - 1;
+}
+
+DatumFile::DatumFile(const QString& p) : path(p), file(p) {}
+
+bool DatumFile::open() {
+    QMutexLocker locker(&mutex);
+    return file.open(QIODevice::ReadOnly);
+}
+
+void DatumFile::close() {
+    QMutexLocker locker(&mutex);
+    file.close();
+    text.clear();
+    position = 0;
+}
+
+bool DatumFile::refill() {
+    if (!file.isOpen() || decoded >= file.size()) {
+        return false;
+    }
+    // Parsed text is dropped first, so the buffer only grows past a window
+    // for a datum longer than that
+    text.remove(0, position);
+    position = 0;
+
+    qint64 length = qMin(WindowSize, file.size() - decoded);
+    uchar* window = file.map(decoded, length);
+    if (!window) {
+        QString message = QString("Cannot map %1: %2").arg(path, file.errorString());
+        qCritical() << message;
+        throw std::runtime_error(message.toStdString());
+    }
+    if (decoded + length < file.size()) {
+        length = completeUtf8(window, length);
+    }
+    text += QString::fromUtf8(reinterpret_cast<const char*>(window), length);
+    file.unmap(window);
+    decoded += length;
+    return true;
+}
+
+bool DatumFile::next(Value& datum) {
+    QMutexLocker locker(&mutex);
+    while (true) {
+        QStringView rest = QStringView(text).mid(position);
+        Lexer scanner(rest);
+        qsizetype end = scanner.datumEnd();
+        if (end >= 0) {
+            // Moved past first, so a malformed datum is only reported once
+            position += end;
+            Lexer lexer(rest.left(end));
+            datum = Script::parse(lexer);
+            return true;
+        }
+        if (!refill()) {
+            break;
+        }
+    }
+
+    // The file has ended, so what is left is a last datum ending with the
+    // file, a datum cut short, or nothing
+    QStringView rest = QStringView(text).mid(position);
+    Lexer lexer(rest);
+    if (lexer.peek().type == Token::End) {
+        return false;
+    }
+    datum = Script::parse(lexer);
+    position = text.size();
+    return true;
+}
+
+//******************************************//
+//**************** Primitives **************//
+//******************************************//
+
+[[noreturn]] static void readerError(const QString& message) {
+    qCritical() << message;
+    throw std::runtime_error(message.toStdString());
+}
+
+static Value primitiveOpenDatumFile(const Value* args, int) {
+    if (!args[0].is(ExpressionKind::String)) {
+        readerError("Argument to open-datum-file must be a string");
+    }
+    QString path = args[0].as<String>()->getValue();
+    QSharedPointer<DatumFile> file(new DatumFile(path));
+    if (!file->open()) {
+        readerError(QString("Cannot open %1").arg(path));
+    }
+    return Value(Heap::create<DatumFileReference>(file));
+}
+
+// (read-datum file [end]) returns the next datum, or end, which defaults
+// to #f, once the file is exhausted
+static Value primitiveReadDatum(const Value* args, int argc) {
+    if (!args[0].is(ExpressionKind::DatumFile)) {
+        readerError("First argument to read-datum must be a datum file");
+    }
+    Value datum;
+    if (args[0].as<DatumFileReference>()->getFile()->next(datum)) {
+        return datum;
+    }
+    return argc > 1 ? args[1] : Value::boolean(false);
+}
+
+static Value primitiveCloseDatumFile(const Value* args, int) {
+    if (!args[0].is(ExpressionKind::DatumFile)) {
+        readerError("Argument to close-datum-file must be a datum file");
+    }
+    args[0].as<DatumFileReference>()->getFile()->close();
+    return Value::nil();
+}
+
+void defineReaderPrimitives(Environment* env) {
+    env->define("open-datum-file", Value(Heap::create<Primitive>("open-datum-file", 1, 1, primitiveOpenDatumFile)));
+    env->define("read-datum", Value(Heap::create<Primitive>("read-datum", 1, 2, primitiveReadDatum)));
+    env->define("close-datum-file", Value(Heap::create<Primitive>("close-datum-file", 1, 1, primitiveCloseDatumFile)));
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptreader.h
+#ifndef SCRIPTREADER_H
+#define SCRIPTREADER_H
+
+#include "scriptvalue.h"
+
+#include <QFile>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+
+class Environment;
+
+// Reads S-expression data from a file one datum at a time, for data sets
+// too large to load as a whole. The file is memory-mapped a window at a
+// time and each window is unmapped once decoded, so only the text not yet
+// parsed is held: at most a window plus the longest datum. Datums are
+// found with the script lexer and built by the script parser, onto the heap
+// that is current when next() is called. Safe to share between threads,
+// which is how actors copied a reader take turns at the same file.
+class DatumFile {
+public:
+    explicit DatumFile(const QString& path);
+
+    const QString& getPath() const { return path; }
+    bool open();
+    void close();
+
+    // Parses the next datum into datum. Returns false at the end of the
+    // file or once it is closed. Throws on malformed data.
+    bool next(Value& datum);
+
+private:
+    static constexpr qint64 WindowSize = 1024 * 1024;
+
+    QMutex mutex;
+    QString path;
+    QFile file;
+    qint64 decoded = 0;     // bytes of the file decoded into text so far
+    QString text;           // decoded text, parsed up to position
+    qsizetype position = 0;
+
+    bool refill();
+};
+
+// Script handle to a DatumFile
+class DatumFileReference : public Expression {
+    QSharedPointer<DatumFile> file;
+public:
+    explicit DatumFileReference(const QSharedPointer<DatumFile>& f) : file(f) {}
+    ExpressionKind kind() const override { return ExpressionKind::DatumFile; }
+    QString toString() const override {
+        return QString("<datum-file %1>").arg(file->getPath());
+    }
+    const QSharedPointer<DatumFile>& getFile() const { return file; }
+};
+
+// Binds open-datum-file, read-datum and close-datum-file in env
+void defineReaderPrimitives(Environment* env);
+
+#endif // SCRIPTREADER_H
@@ -0,0 +1,546 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptsimd.cpp
+#include "scriptsimd.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace Simd {
+
+//******************************************//
+//***************** Scalar *****************//
+//******************************************//
+
+// The scalar kernels also finish the elements left over by the wide ones
+
+static void binaryF64Scalar(BinaryOp op, const double* a, const double* b, double* out, qsizetype n) {
+    switch (op) {
+    case BinaryOp::Add:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] + b[i];
+        break;
+    case BinaryOp::Subtract:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] - b[i];
+        break;
+    case BinaryOp::Multiply:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] * b[i];
+        break;
+    case BinaryOp::Divide:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] / b[i];
+        break;
+    }
+}
+
+static void compareF64Scalar(CompareOp op, const double* a, const double* b, qint32* out, qsizetype n) {
+    switch (op) {
+    case CompareOp::Less:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] < b[i];
+        break;
+    case CompareOp::Equal:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] == b[i];
+        break;
+    case CompareOp::Greater:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] > b[i];
+        break;
+    }
+}
+
+static double reduceF64Scalar(ReduceOp op, const double* a, qsizetype n, double initial) {
+    double result = initial;
+    switch (op) {
+    case ReduceOp::Sum:
+        for (qsizetype i = 0; i < n; ++i) result += a[i];
+        break;
+    case ReduceOp::Min:
+        for (qsizetype i = 0; i < n; ++i) result = a[i] < result ? a[i] : result;
+        break;
+    case ReduceOp::Max:
+        for (qsizetype i = 0; i < n; ++i) result = a[i] > result ? a[i] : result;
+        break;
+    }
+    return result;
+}
+
+static double dotF64Scalar(const double* a, const double* b, qsizetype n) {
+    double result = 0;
+    for (qsizetype i = 0; i < n; ++i) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+static void binaryS32Scalar(BinaryOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+    // Unsigned arithmetic gives the wrap-around without signed overflow
+    switch (op) {
+    case BinaryOp::Add:
+        for (qsizetype i = 0; i < n; ++i) out[i] = qint32(quint32(a[i]) + quint32(b[i]));
+        break;
+    case BinaryOp::Subtract:
+        for (qsizetype i = 0; i < n; ++i) out[i] = qint32(quint32(a[i]) - quint32(b[i]));
+        break;
+    case BinaryOp::Multiply:
+        for (qsizetype i = 0; i < n; ++i) out[i] = qint32(quint32(a[i]) * quint32(b[i]));
+        break;
+    case BinaryOp::Divide:
+        Q_UNREACHABLE();
+    }
+}
+
+static void compareS32Scalar(CompareOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+    switch (op) {
+    case CompareOp::Less:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] < b[i];
+        break;
+    case CompareOp::Equal:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] == b[i];
+        break;
+    case CompareOp::Greater:
+        for (qsizetype i = 0; i < n; ++i) out[i] = a[i] > b[i];
+        break;
+    }
+}
+
+static qint64 reduceS32Scalar(ReduceOp op, const qint32* a, qsizetype n, qint64 initial) {
+    qint64 result = initial;
+    switch (op) {
+    case ReduceOp::Sum:
+        for (qsizetype i = 0; i < n; ++i) result += a[i];
+        break;
+    case ReduceOp::Min:
+        for (qsizetype i = 0; i < n; ++i) result = a[i] < result ? a[i] : result;
+        break;
+    case ReduceOp::Max:
+        for (qsizetype i = 0; i < n; ++i) result = a[i] > result ? a[i] : result;
+        break;
+    }
+    return result;
+}
+
+static qint64 dotS32Scalar(const qint32* a, const qint32* b, qsizetype n) {
+    // Each product fits in 64 bits; the unsigned sum wraps like the SIMD lanes
+    quint64 result = 0;
+    for (qsizetype i = 0; i < n; ++i) {
+        result += quint64(qint64(a[i]) * b[i]);
+    }
+    return qint64(result);
+}
+
+#ifdef SIMD_X86
+
+//******************************************//
+//****************** SSE2 ******************//
+//******************************************//
+
+// SSE2 is part of x86-64, so these need no runtime check
+
+static void binaryF64Sse2(BinaryOp op, const double* a, const double* b, double* out, qsizetype n) {
+    qsizetype i = 0;
+    switch (op) {
+    case BinaryOp::Add:
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        break;
+    case BinaryOp::Subtract:
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(out + i, _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        break;
+    case BinaryOp::Multiply:
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        break;
+    case BinaryOp::Divide:
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(out + i, _mm_div_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        break;
+    }
+    binaryF64Scalar(op, a + i, b + i, out + i, n - i);
+}
+
+static void compareF64Sse2(CompareOp op, const double* a, const double* b, qint32* out, qsizetype n) {
+    qsizetype i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        __m128d y = _mm_loadu_pd(b + i);
+        __m128d mask = op == CompareOp::Less ? _mm_cmplt_pd(x, y)
+                       : op == CompareOp::Equal ? _mm_cmpeq_pd(x, y)
+                                                : _mm_cmpgt_pd(x, y);
+        int bits = _mm_movemask_pd(mask);
+        out[i] = bits & 1;
+        out[i + 1] = (bits >> 1) & 1;
+    }
+    compareF64Scalar(op, a + i, b + i, out + i, n - i);
+}
+
+static double reduceF64Sse2(ReduceOp op, const double* a, qsizetype n) {
+    if (n < 2) {
+        return reduceF64Scalar(op, a + 1, n - 1, n ? a[0] : 0);
+    }
+    __m128d acc = op == ReduceOp::Sum ? _mm_setzero_pd() : _mm_loadu_pd(a);
+    qsizetype i = op == ReduceOp::Sum ? 0 : 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        acc = op == ReduceOp::Sum ? _mm_add_pd(acc, x)
+              : op == ReduceOp::Min ? _mm_min_pd(acc, x)
+                                    : _mm_max_pd(acc, x);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    double result = reduceF64Scalar(op, lanes + 1, 1, lanes[0]);
+    return reduceF64Scalar(op, a + i, n - i, result);
+}
+
+static double dotF64Sse2(const double* a, const double* b, qsizetype n) {
+    __m128d acc = _mm_setzero_pd();
+    qsizetype i = 0;
+    for (; i + 2 <= n; i += 2) {
+        acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    return lanes[0] + lanes[1] + dotF64Scalar(a + i, b + i, n - i);
+}
+
+static void binaryS32Sse2(BinaryOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+    qsizetype i = 0;
+    // A 32-bit multiply needs SSE4.1, so Multiply stays scalar here
+    if (op == BinaryOp::Add || op == BinaryOp::Subtract) {
+        for (; i + 4 <= n; i += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            __m128i z = op == BinaryOp::Add ? _mm_add_epi32(x, y) : _mm_sub_epi32(x, y);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), z);
+        }
+    }
+    binaryS32Scalar(op, a + i, b + i, out + i, n - i);
+}
+
+static void compareS32Sse2(CompareOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+    const __m128i one = _mm_set1_epi32(1);
+    qsizetype i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i mask = op == CompareOp::Less ? _mm_cmplt_epi32(x, y)
+                       : op == CompareOp::Equal ? _mm_cmpeq_epi32(x, y)
+                                                : _mm_cmpgt_epi32(x, y);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_and_si128(mask, one));
+    }
+    compareS32Scalar(op, a + i, b + i, out + i, n - i);
+}
+
+static qint64 reduceS32Sse2(ReduceOp op, const qint32* a, qsizetype n) {
+    qsizetype i = 0;
+    if (op == ReduceOp::Sum) {
+        // Sign-extend each lane to 64 bits so the sum cannot overflow
+        __m128i acc = _mm_setzero_si128();
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 4 <= n; i += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i sign = _mm_cmpgt_epi32(zero, x);
+            acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(x, sign));
+            acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(x, sign));
+        }
+        qint64 lanes[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+        return reduceS32Scalar(op, a + i, n - i, lanes[0] + lanes[1]);
+    }
+    if (n < 4) {
+        return reduceS32Scalar(op, a + 1, n - 1, a[0]);
+    }
+    // Select with a compare mask, as min/max on 32-bit lanes needs SSE4.1
+    __m128i acc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+    for (i = 4; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i takeX = op == ReduceOp::Min ? _mm_cmplt_epi32(x, acc) : _mm_cmpgt_epi32(x, acc);
+        acc = _mm_or_si128(_mm_and_si128(takeX, x), _mm_andnot_si128(takeX, acc));
+    }
+    qint32 lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    qint64 result = reduceS32Scalar(op, lanes + 1, 3, lanes[0]);
+    return reduceS32Scalar(op, a + i, n - i, result);
+}
+
+//******************************************//
+//****************** AVX2 ******************//
+//******************************************//
+
+TARGET_AVX2 static void binaryF64Avx2(BinaryOp op, const double* a, const double* b, double* out, qsizetype n) {
+    qsizetype i = 0;
+    switch (op) {
+    case BinaryOp::Add:
+        for (; i + 4 <= n; i += 4) _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        break;
+    case BinaryOp::Subtract:
+        for (; i + 4 <= n; i += 4) _mm256_storeu_pd(out + i, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        break;
+    case BinaryOp::Multiply:
+        for (; i + 4 <= n; i += 4) _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        break;
+    case BinaryOp::Divide:
+        for (; i + 4 <= n; i += 4) _mm256_storeu_pd(out + i, _mm256_div_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        break;
+    }
+    binaryF64Scalar(op, a + i, b + i, out + i, n - i);
+}
+
+TARGET_AVX2 static void compareF64Avx2(CompareOp op, const double* a, const double* b, qint32* out, qsizetype n) {
+    qsizetype i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d y = _mm256_loadu_pd(b + i);
+        __m256d mask = op == CompareOp::Less ? _mm256_cmp_pd(x, y, _CMP_LT_OQ)
+                       : op == CompareOp::Equal ? _mm256_cmp_pd(x, y, _CMP_EQ_OQ)
+                                                : _mm256_cmp_pd(x, y, _CMP_GT_OQ);
+        int bits = _mm256_movemask_pd(mask);
+        out[i] = bits & 1;
+        out[i + 1] = (bits >> 1) & 1;
+        out[i + 2] = (bits >> 2) & 1;
+        out[i + 3] = (bits >> 3) & 1;
+    }
+    compareF64Scalar(op, a + i, b + i, out + i, n - i);
+}
+
+TARGET_AVX2 static double reduceF64Avx2(ReduceOp op, const double* a, qsizetype n) {
+    if (n < 4) {
+        return reduceF64Sse2(op, a, n);
+    }
+    // Two accumulators hide the latency of the dependent adds
+    __m256d acc0 = op == ReduceOp::Sum ? _mm256_setzero_pd() : _mm256_loadu_pd(a);
+    __m256d acc1 = acc0;
+    qsizetype i = op == ReduceOp::Sum ? 0 : 4;
+    for (; i + 8 <= n; i += 8) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d y = _mm256_loadu_pd(a + i + 4);
+        if (op == ReduceOp::Sum) {
+            acc0 = _mm256_add_pd(acc0, x);
+            acc1 = _mm256_add_pd(acc1, y);
+        }
+        else if (op == ReduceOp::Min) {
+            acc0 = _mm256_min_pd(acc0, x);
+            acc1 = _mm256_min_pd(acc1, y);
+        }
+        else {
+            acc0 = _mm256_max_pd(acc0, x);
+            acc1 = _mm256_max_pd(acc1, y);
+        }
+    }
+    double lanes[8];
+    _mm256_storeu_pd(lanes, acc0);
+    _mm256_storeu_pd(lanes + 4, acc1);
+    double result = reduceF64Scalar(op, lanes + 1, 7, lanes[0]);
+    return reduceF64Scalar(op, a + i, n - i, result);
+}
+
+TARGET_AVX2 static double dotF64Avx2(const double* a, const double* b, qsizetype n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    qsizetype i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dotF64Scalar(a + i, b + i, n - i);
+}
+
+TARGET_AVX2 static void binaryS32Avx2(BinaryOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+    qsizetype i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i z = op == BinaryOp::Add ? _mm256_add_epi32(x, y)
+                    : op == BinaryOp::Subtract ? _mm256_sub_epi32(x, y)
+                                               : _mm256_mullo_epi32(x, y);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), z);
+    }
+    binaryS32Scalar(op, a + i, b + i, out + i, n - i);
+}
+
+TARGET_AVX2 static void compareS32Avx2(CompareOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+    const __m256i one = _mm256_set1_epi32(1);
+    qsizetype i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i mask = op == CompareOp::Less ? _mm256_cmpgt_epi32(y, x)
+                       : op == CompareOp::Equal ? _mm256_cmpeq_epi32(x, y)
+                                                : _mm256_cmpgt_epi32(x, y);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_and_si256(mask, one));
+    }
+    compareS32Scalar(op, a + i, b + i, out + i, n - i);
+}
+
+TARGET_AVX2 static qint64 reduceS32Avx2(ReduceOp op, const qint32* a, qsizetype n) {
+    qsizetype i = 0;
+    if (op == ReduceOp::Sum) {
+        __m256i acc = _mm256_setzero_si256();
+        for (; i + 4 <= n; i += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(x));
+        }
+        qint64 lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+        return reduceS32Scalar(op, a + i, n - i, lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    }
+    if (n < 8) {
+        return reduceS32Sse2(op, a, n);
+    }
+    __m256i acc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+    for (i = 8; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        acc = op == ReduceOp::Min ? _mm256_min_epi32(acc, x) : _mm256_max_epi32(acc, x);
+    }
+    qint32 lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    qint64 result = reduceS32Scalar(op, lanes + 1, 7, lanes[0]);
+    return reduceS32Scalar(op, a + i, n - i, result);
+}
+
+TARGET_AVX2 static qint64 dotS32Avx2(const qint32* a, const qint32* b, qsizetype n) {
+    // _mm256_mul_epi32 multiplies the even lanes into 64-bit products;
+    // shifting each 64-bit lane down brings the odd lanes into place
+    __m256i acc = _mm256_setzero_si256();
+    qsizetype i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(x, y));
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(y, 32)));
+    }
+    quint64 lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    return qint64(lanes[0] + lanes[1] + lanes[2] + lanes[3] + quint64(dotS32Scalar(a + i, b + i, n - i)));
+}
+
+static bool cpuHasAvx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    // AVX2 needs both the CPU feature and the OS saving the YMM registers
+    int info[4];
+    __cpuid(info, 1);
+    bool osSavesYmm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return osSavesYmm && (info[1] & (1 << 5));
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static Level detectLevel() {
+    return cpuHasAvx2() ? Level::Avx2 : Level::Sse2;
+}
+
+#else
+
+static Level detectLevel() {
+    return Level::Scalar;
+}
+
+#endif // SIMD_X86
+
+//******************************************//
+//**************** Dispatch ****************//
+//******************************************//
+
+static const Level supportedLevel = detectLevel();
+static Level activeLevel = supportedLevel;
+
+Level level() {
+    return activeLevel;
+}
+
+void setLevel(Level requested) {
+    activeLevel = requested < supportedLevel ? requested : supportedLevel;
+}
+
+const char* levelName(Level level) {
+    switch (level) {
+    case Level::Avx2: return "avx2";
+    case Level::Sse2: return "sse2";
+    case Level::Scalar: break;
+    }
+    return "scalar";
+}
+
+void binaryF64(BinaryOp op, const double* a, const double* b, double* out, qsizetype n) {
+#ifdef SIMD_X86
+    if (activeLevel == Level::Avx2) return binaryF64Avx2(op, a, b, out, n);
+    if (activeLevel == Level::Sse2) return binaryF64Sse2(op, a, b, out, n);
+#endif
+    binaryF64Scalar(op, a, b, out, n);
+}
+
+void compareF64(CompareOp op, const double* a, const double* b, qint32* out, qsizetype n) {
+#ifdef SIMD_X86
+    if (activeLevel == Level::Avx2) return compareF64Avx2(op, a, b, out, n);
+    if (activeLevel == Level::Sse2) return compareF64Sse2(op, a, b, out, n);
+#endif
+    compareF64Scalar(op, a, b, out, n);
+}
+
+double reduceF64(ReduceOp op, const double* a, qsizetype n) {
+#ifdef SIMD_X86
+    if (activeLevel == Level::Avx2) return reduceF64Avx2(op, a, n);
+    if (activeLevel == Level::Sse2) return reduceF64Sse2(op, a, n);
+#endif
+    return op == ReduceOp::Sum ? reduceF64Scalar(op, a, n, 0) : reduceF64Scalar(op, a + 1, n - 1, a[0]);
+}
+
+double dotF64(const double* a, const double* b, qsizetype n) {
+#ifdef SIMD_X86
+    if (activeLevel == Level::Avx2) return dotF64Avx2(a, b, n);
+    if (activeLevel == Level::Sse2) return dotF64Sse2(a, b, n);
+#endif
+    return dotF64Scalar(a, b, n);
+}
+
+void binaryS32(BinaryOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+#ifdef SIMD_X86
+    if (activeLevel == Level::Avx2) return binaryS32Avx2(op, a, b, out, n);
+    if (activeLevel == Level::Sse2) return binaryS32Sse2(op, a, b, out, n);
+#endif
+    binaryS32Scalar(op, a, b, out, n);
+}
+
+void compareS32(CompareOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+#ifdef SIMD_X86
+    if (activeLevel == Level::Avx2) return compareS32Avx2(op, a, b, out, n);
+    if (activeLevel == Level::Sse2) return compareS32Sse2(op, a, b, out, n);
+#endif
+    compareS32Scalar(op, a, b, out, n);
+}
+
+qint64 reduceS32(ReduceOp op, const qint32* a, qsizetype n) {
+#ifdef SIMD_X86
+    if (activeLevel == Level::Avx2) return reduceS32Avx2(op, a, n);
+    if (activeLevel == Level::Sse2) return reduceS32Sse2(op, a, n);
+#endif
+    return op == ReduceOp::Sum ? reduceS32Scalar(op, a, n, 0) : reduceS32Scalar(op, a + 1, n - 1, a[0]);
+}
+
+qint64 dotS32(const qint32* a, const qint32* b, qsizetype n) {
+#ifdef SIMD_X86
+    if (activeLevel == Level::Avx2) return dotS32Avx2(a, b, n);
+#endif
+    // Without SSE4.1 there is no signed 32-bit widening multiply
+    return dotS32Scalar(a, b, n);
+}
+
+}
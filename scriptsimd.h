@@ -0,0 +1,72 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptsimd.h
+#ifndef SCRIPTSIMD_H
+#define SCRIPTSIMD_H
+
+#include <QtGlobal>
+
+// Kernels behind the homogeneous numeric vectors. Each operation has AVX2,
+// SSE2 and scalar versions; the widest one the CPU supports is picked at
+// startup. s32 arithmetic wraps around like unsigned 32-bit arithmetic,
+// while s32 sums and dot products accumulate in 64 bits (a dot product of
+// very large vectors can still wrap). Floating-point sums are accumulated
+// in lanes, so their rounding can differ slightly from a strict
+// left-to-right sum.
+namespace Simd {
+
+enum class Level {
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+enum class BinaryOp {
+    Add,
+    Subtract,
+    Multiply,
+    Divide      // f64 only
+};
+
+enum class CompareOp {
+    Less,
+    Equal,
+    Greater
+};
+
+enum class ReduceOp {
+    Sum,
+    Min,        // Min and Max need at least one element
+    Max
+};
+
+Level level();
+// Caps the level at what the CPU supports; used to compare implementations
+void setLevel(Level requested);
+const char* levelName(Level level);
+
+void binaryF64(BinaryOp op, const double* a, const double* b, double* out, qsizetype n);
+void compareF64(CompareOp op, const double* a, const double* b, qint32* out, qsizetype n);
+double reduceF64(ReduceOp op, const double* a, qsizetype n);
+double dotF64(const double* a, const double* b, qsizetype n);
+
+void binaryS32(BinaryOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n);
+void compareS32(CompareOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n);
+qint64 reduceS32(ReduceOp op, const qint32* a, qsizetype n);
+qint64 dotS32(const qint32* a, const qint32* b, qsizetype n);
+
+}
+
+#endif // SCRIPTSIMD_H
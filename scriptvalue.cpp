@@ -0,0 +1,124 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptvalue.cpp
+#include "scriptvalue.h"
+
+SymbolTable::Storage::Storage() {
+    for (const char* name : { "define", "lambda", "class", "new", "quote", "if", "begin", "cond", "let", "else" }) {
+        ids.insert(name, names.size());
+        names.append(name);
+    }
+}
+
+SymbolTable::Storage& SymbolTable::storage() {
+    static Storage instance;
+    return instance;
+}
+
+int SymbolTable::intern(const QString& name) {
+    Storage& table = storage();
+    {
+        QReadLocker locker(&table.lock);
+        auto it = table.ids.constFind(name);
+        if (it != table.ids.constEnd()) {
+            return it.value();
+        }
+    }
+    QWriteLocker locker(&table.lock);
+    auto it = table.ids.constFind(name);
+    if (it != table.ids.constEnd()) {
+        return it.value();
+    }
+    int id = table.names.size();
+    table.names.append(name);
+    table.ids.insert(name, id);
+    return id;
+}
+
+QString SymbolTable::name(int id) {
+    Storage& table = storage();
+    QReadLocker locker(&table.lock);
+    return table.names.value(id);
+}
+
+bool Value::isIdentical(const Value& other) const {
+    if (type != other.type) {
+        return false;
+    }
+    switch (type) {
+    case Flonum:
+        return flonum == other.flonum;
+    case Object:
+        return object == other.object;
+    default:
+        return fixnum == other.fixnum;
+    }
+}
+
+const char* Expression::typeName() const {
+    switch (kind()) {
+    case ExpressionKind::List: return "List";
+    case ExpressionKind::String: return "String";
+    case ExpressionKind::Function: return "Function";
+    case ExpressionKind::Primitive: return "Primitive";
+    case ExpressionKind::Class: return "Class";
+    case ExpressionKind::Instance: return "Instance";
+    case ExpressionKind::F64Vector: return "F64Vector";
+    case ExpressionKind::S32Vector: return "S32Vector";
+    case ExpressionKind::Actor: return "Actor";
+    case ExpressionKind::DatumFile: return "DatumFile";
+    case ExpressionKind::StringPort: return "StringPort";
+    case ExpressionKind::HashTable: return "HashTable";
+    }
+    return "Expression";
+}
+
+QString Value::toString() const {
+    switch (type) {
+    case Unbound:
+        return "#<unbound>";
+    case Nil:
+        return "()";
+    case Boolean:
+        return fixnum ? "#t" : "#f";
+    case Fixnum:
+        return QString::number(fixnum);
+    case Flonum: {
+        // Keep a decimal point on integral flonums so they read back as flonums
+        QString text = QString::number(flonum);
+        for (QChar c : text) {
+            if (!c.isDigit() && c != '-') {
+                return text;
+            }
+        }
+        return text + ".0";
+    }
+    case Character:
+        switch (fixnum) {
+        case ' ': return "#\\space";
+        case '\n': return "#\\newline";
+        case '\t': return "#\\tab";
+        default: {
+            char32_t c = char32_t(fixnum);
+            return "#\\" + QString::fromUcs4(&c, 1);
+        }
+        }
+    case Symbol:
+        return SymbolTable::name(int(fixnum));
+    case Object:
+        return object->toString();
+    }
+    return QString();
+}
@@ -0,0 +1,157 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptvalue.h
+#ifndef SCRIPTVALUE_H
+#define SCRIPTVALUE_H
+
+#include "scriptheap.h"
+
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QReadWriteLock>
+
+// Runtime type tag of heap objects, so hot paths can dispatch without dynamic casts
+enum class ExpressionKind {
+    List,
+    String,
+    Function,
+    Primitive,
+    Class,
+    Instance,
+    F64Vector,
+    S32Vector,
+    Actor,
+    DatumFile,
+    StringPort,
+    HashTable
+};
+
+// Base class for all heap-allocated expression types. Numbers, booleans,
+// characters, symbols and the empty list are immediates and never get here.
+class Expression : public HeapObject {
+public:
+    virtual ExpressionKind kind() const = 0;
+    virtual QString toString() const = 0;
+    const char* typeName() const override;
+};
+
+// Process-wide table mapping symbol names to small integer ids, so bindings
+// and special forms can be matched by comparing ints instead of strings
+class SymbolTable {
+public:
+    // Ids of the special forms, interned first so they are compile-time constants
+    enum KnownSymbol {
+        Define,
+        Lambda,
+        Class,
+        New,
+        Quote,
+        If,
+        Begin,
+        Cond,
+        Let,
+        Else,
+        KnownSymbolCount
+    };
+
+    static int intern(const QString& name);
+    static QString name(int id);
+
+private:
+    struct Storage {
+        QReadWriteLock lock;
+        QHash<QString, int> ids;
+        QVector<QString> names;
+        Storage();
+    };
+    static Storage& storage();
+};
+
+// A script value. Immediates are stored inline; only compound objects are
+// references to a heap Expression. Values are plain data, so copying one
+// never touches the heap; the collector keeps the referenced object alive as
+// long as it is reachable from a root. Unbound marks an empty variable slot
+// and is never visible to scripts.
+class Value {
+public:
+    enum Type : quint8 {
+        Unbound,
+        Nil,
+        Boolean,
+        Fixnum,
+        Flonum,
+        Character,
+        Symbol,
+        Object
+    };
+
+    // Fixnums are limited to 48 bits; results outside this range become flonums
+    static constexpr qint64 FixnumMax = (qint64(1) << 47) - 1;
+    static constexpr qint64 FixnumMin = -(qint64(1) << 47);
+
+    Value() : type(Unbound), fixnum(0) {}
+    Value(Expression* obj) : type(Object), object(obj) {}
+
+    static Value nil() { return Value(Nil); }
+    static Value boolean(bool value) { Value v(Boolean); v.fixnum = value; return v; }
+    static Value fromFixnum(qint64 value) { Value v(Fixnum); v.fixnum = value; return v; }
+    static Value fromFlonum(double value) { Value v(Flonum); v.flonum = value; return v; }
+    static Value character(char32_t value) { Value v(Character); v.fixnum = value; return v; }
+    static Value symbol(int id) { Value v(Symbol); v.fixnum = id; return v; }
+    static Value fromNumber(qint64 value) {
+        return value >= FixnumMin && value <= FixnumMax ? fromFixnum(value) : fromFlonum(double(value));
+    }
+
+    Type getType() const { return type; }
+    bool isUnbound() const { return type == Unbound; }
+    bool isNil() const { return type == Nil; }
+    bool isBoolean() const { return type == Boolean; }
+    bool isFixnum() const { return type == Fixnum; }
+    bool isFlonum() const { return type == Flonum; }
+    bool isNumber() const { return type == Fixnum || type == Flonum; }
+    bool isCharacter() const { return type == Character; }
+    bool isSymbol() const { return type == Symbol; }
+    bool isObject() const { return type == Object; }
+    bool is(ExpressionKind kind) const { return type == Object && object->kind() == kind; }
+
+    bool asBoolean() const { return fixnum != 0; }
+    qint64 asFixnum() const { return fixnum; }
+    double asFlonum() const { return flonum; }
+    double toDouble() const { return type == Fixnum ? double(fixnum) : flonum; }
+    char32_t asCharacter() const { return char32_t(fixnum); }
+    int asSymbol() const { return int(fixnum); }
+    Expression* asObject() const { return object; }
+    template <typename T> T* as() const { return static_cast<T*>(object); }
+
+    // Everything except #f counts as true in a conditional
+    bool isTruthy() const { return type != Boolean || fixnum != 0; }
+    // eqv? semantics: immediates by value, objects by identity
+    bool isIdentical(const Value& other) const;
+
+    QString toString() const;
+
+private:
+    explicit Value(Type t) : type(t), fixnum(0) {}
+
+    Type type;
+    union {
+        qint64 fixnum;
+        double flonum;
+        Expression* object;
+    };
+};
+
+#endif // SCRIPTVALUE_H
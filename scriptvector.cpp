@@ -0,0 +1,333 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptvector.cpp
+#include "scriptvector.h"
+#include "script.h"
+#include "scriptsimd.h"
+#include <QDebug>
+#include <QStringList>
+#include <limits>
+#include <new>
+
+//******************************************//
+//***************** Storage ****************//
+//******************************************//
+
+static constexpr size_t VectorAlignment = 32;
+
+template <typename T, ExpressionKind Kind>
+NumericVector<T, Kind>::NumericVector(qsizetype n, T fill) : length(n) {
+    if (length > 0) {
+        elements = static_cast<T*>(qMallocAligned(size_t(length) * sizeof(T), VectorAlignment));
+        if (!elements) {
+            throw std::bad_alloc();
+        }
+        std::fill(elements, elements + length, fill);
+    }
+}
+
+template <typename T, ExpressionKind Kind>
+NumericVector<T, Kind>::~NumericVector() {
+    qFreeAligned(elements);
+}
+
+template <typename T, ExpressionKind Kind>
+QString NumericVector<T, Kind>::toString() const {
+    QStringList parts;
+    for (qsizetype i = 0; i < length; ++i) {
+        parts << (Kind == ExpressionKind::F64Vector ? Value::fromFlonum(double(elements[i]))
+                                                    : Value::fromFixnum(qint64(elements[i]))).toString();
+    }
+    return QString(Kind == ExpressionKind::F64Vector ? "#f64(%1)" : "#s32(%1)").arg(parts.join(" "));
+}
+
+template class NumericVector<double, ExpressionKind::F64Vector>;
+template class NumericVector<qint32, ExpressionKind::S32Vector>;
+
+//******************************************//
+//***************** Helpers ****************//
+//******************************************//
+
+[[noreturn]] static void vectorError(const QString& message) {
+    qCritical() << message;
+    throw std::runtime_error(message.toStdString());
+}
+
+// What differs between the two vector types: the element conversions and
+// which kernels to call. The primitives below are written once against it.
+template <typename V> struct VectorTraits;
+
+template <> struct VectorTraits<F64Vector> {
+    using Element = double;
+    static constexpr ExpressionKind kind = ExpressionKind::F64Vector;
+    static constexpr const char* name = "f64vector";
+    static constexpr const char* elementName = "numbers";
+    static bool accepts(const Value& value) { return value.isNumber(); }
+    static double fromValue(const Value& value) { return value.toDouble(); }
+    static Value toValue(double element) { return Value::fromFlonum(element); }
+    static void binary(Simd::BinaryOp op, const double* a, const double* b, double* out, qsizetype n) {
+        Simd::binaryF64(op, a, b, out, n);
+    }
+    static void compare(Simd::CompareOp op, const double* a, const double* b, qint32* out, qsizetype n) {
+        Simd::compareF64(op, a, b, out, n);
+    }
+    static Value reduce(Simd::ReduceOp op, const double* a, qsizetype n) {
+        return Value::fromFlonum(Simd::reduceF64(op, a, n));
+    }
+    static Value dot(const double* a, const double* b, qsizetype n) {
+        return Value::fromFlonum(Simd::dotF64(a, b, n));
+    }
+};
+
+template <> struct VectorTraits<S32Vector> {
+    using Element = qint32;
+    static constexpr ExpressionKind kind = ExpressionKind::S32Vector;
+    static constexpr const char* name = "s32vector";
+    static constexpr const char* elementName = "32-bit exact integers";
+    static bool accepts(const Value& value) {
+        return value.isFixnum()
+               && value.asFixnum() >= std::numeric_limits<qint32>::min()
+               && value.asFixnum() <= std::numeric_limits<qint32>::max();
+    }
+    static qint32 fromValue(const Value& value) { return qint32(value.asFixnum()); }
+    static Value toValue(qint32 element) { return Value::fromFixnum(element); }
+    static void binary(Simd::BinaryOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+        Simd::binaryS32(op, a, b, out, n);
+    }
+    static void compare(Simd::CompareOp op, const qint32* a, const qint32* b, qint32* out, qsizetype n) {
+        Simd::compareS32(op, a, b, out, n);
+    }
+    static Value reduce(Simd::ReduceOp op, const qint32* a, qsizetype n) {
+        return Value::fromNumber(Simd::reduceS32(op, a, n));
+    }
+    static Value dot(const qint32* a, const qint32* b, qsizetype n) {
+        return Value::fromNumber(Simd::dotS32(a, b, n));
+    }
+};
+
+// Primitive names are given as patterns such as "%1-ref", which are only
+// expanded when an error message needs them
+template <typename V>
+static QString primitiveName(const char* pattern) {
+    return QString(pattern).arg(VectorTraits<V>::name);
+}
+
+template <typename V>
+static V* checkVector(const Value* args, int i, const char* suffix) {
+    if (!args[i].is(VectorTraits<V>::kind)) {
+        vectorError(QString("Arguments to %1 must be %2s").arg(primitiveName<V>(suffix), VectorTraits<V>::name));
+    }
+    return args[i].as<V>();
+}
+
+template <typename V>
+static typename VectorTraits<V>::Element checkElement(const Value& value, const char* suffix) {
+    if (!VectorTraits<V>::accepts(value)) {
+        vectorError(QString("Elements passed to %1 must be %2").arg(primitiveName<V>(suffix), VectorTraits<V>::elementName));
+    }
+    return VectorTraits<V>::fromValue(value);
+}
+
+template <typename V>
+static qsizetype checkIndex(const Value* args, int i, qsizetype limit, const char* suffix) {
+    if (!args[i].isFixnum() || args[i].asFixnum() < 0 || args[i].asFixnum() >= limit) {
+        vectorError(QString("Index %1 is out of range for %2").arg(args[i].toString(), primitiveName<V>(suffix)));
+    }
+    return qsizetype(args[i].asFixnum());
+}
+
+// Elementwise operations take two vectors of the same length
+template <typename V>
+static qsizetype checkSameLength(const V* a, const V* b, const char* suffix) {
+    if (a->size() != b->size()) {
+        vectorError(QString("Vectors passed to %1 must have the same length").arg(primitiveName<V>(suffix)));
+    }
+    return a->size();
+}
+
+//******************************************//
+//************** Construction **************//
+//******************************************//
+
+template <typename V>
+static Value primitiveMake(const Value* args, int argc) {
+    // The element buffer is limited to what a qsizetype byte count can hold
+    constexpr qint64 maximumLength = std::numeric_limits<qsizetype>::max() / qint64(sizeof(typename VectorTraits<V>::Element));
+    if (!args[0].isFixnum() || args[0].asFixnum() < 0 || args[0].asFixnum() > maximumLength) {
+        vectorError(QString("The length passed to %1 must be a non-negative exact integer").arg(primitiveName<V>("make-%1")));
+    }
+    typename VectorTraits<V>::Element fill{};
+    if (argc > 1) {
+        fill = checkElement<V>(args[1], "make-%1");
+    }
+    return Value(Heap::create<V>(qsizetype(args[0].asFixnum()), fill));
+}
+
+template <typename V>
+static Value primitiveFromArguments(const Value* args, int argc) {
+    V* vector = Heap::create<V>(argc);
+    for (int i = 0; i < argc; ++i) {
+        vector->data()[i] = checkElement<V>(args[i], "%1");
+    }
+    return Value(vector);
+}
+
+template <typename V>
+static Value primitiveFromList(const Value* args, int) {
+    if (args[0].isNil()) {
+        return Value(Heap::create<V>(0));
+    }
+    if (!args[0].is(ExpressionKind::List)) {
+        vectorError(QString("Arguments to %1 must be lists").arg(primitiveName<V>("list->%1")));
+    }
+    const QVector<Value>& elements = args[0].as<List>()->getElements();
+    V* vector = Heap::create<V>(elements.size());
+    for (int i = 0; i < elements.size(); ++i) {
+        vector->data()[i] = checkElement<V>(elements[i], "list->%1");
+    }
+    return Value(vector);
+}
+
+template <typename V>
+static Value primitiveToList(const Value* args, int) {
+    const V* vector = checkVector<V>(args, 0, "%1->list");
+    QVector<Value> elements;
+    elements.reserve(vector->size());
+    for (qsizetype i = 0; i < vector->size(); ++i) {
+        elements.append(VectorTraits<V>::toValue(vector->data()[i]));
+    }
+    return makeList(elements);
+}
+
+//******************************************//
+//***************** Access *****************//
+//******************************************//
+
+template <typename V>
+static Value primitiveLength(const Value* args, int) {
+    return Value::fromFixnum(checkVector<V>(args, 0, "%1-length")->size());
+}
+
+template <typename V>
+static Value primitiveRef(const Value* args, int) {
+    const V* vector = checkVector<V>(args, 0, "%1-ref");
+    return VectorTraits<V>::toValue(vector->data()[checkIndex<V>(args, 1, vector->size(), "%1-ref")]);
+}
+
+template <typename V>
+static Value primitiveSet(const Value* args, int) {
+    V* vector = checkVector<V>(args, 0, "%1-set!");
+    qsizetype index = checkIndex<V>(args, 1, vector->size(), "%1-set!");
+    vector->data()[index] = checkElement<V>(args[2], "%1-set!");
+    return Value::nil();
+}
+
+//******************************************//
+//**************** Kernels *****************//
+//******************************************//
+
+template <typename V, Simd::BinaryOp Op>
+static Value primitiveBinary(const Value* args, int) {
+    static const char* const suffixes[] = { "%1-add", "%1-sub", "%1-mul", "%1-div" };
+    const char* suffix = suffixes[int(Op)];
+    const V* a = checkVector<V>(args, 0, suffix);
+    const V* b = checkVector<V>(args, 1, suffix);
+    qsizetype n = checkSameLength(a, b, suffix);
+    V* result = Heap::create<V>(n);
+    VectorTraits<V>::binary(Op, a->data(), b->data(), result->data(), n);
+    return Value(result);
+}
+
+// Comparisons give an s32vector of 1 where the comparison holds and 0
+// elsewhere, which the s32vector kernels can sum or multiply as a mask
+template <typename V, Simd::CompareOp Op>
+static Value primitiveCompare(const Value* args, int) {
+    static const char* const suffixes[] = { "%1<", "%1=", "%1>" };
+    const char* suffix = suffixes[int(Op)];
+    const V* a = checkVector<V>(args, 0, suffix);
+    const V* b = checkVector<V>(args, 1, suffix);
+    qsizetype n = checkSameLength(a, b, suffix);
+    S32Vector* result = Heap::create<S32Vector>(n);
+    VectorTraits<V>::compare(Op, a->data(), b->data(), result->data(), n);
+    return Value(result);
+}
+
+template <typename V, Simd::ReduceOp Op>
+static Value primitiveReduce(const Value* args, int) {
+    static const char* const suffixes[] = { "%1-sum", "%1-min", "%1-max" };
+    const char* suffix = suffixes[int(Op)];
+    const V* vector = checkVector<V>(args, 0, suffix);
+    if (Op != Simd::ReduceOp::Sum && vector->size() == 0) {
+        vectorError(QString("%1 needs a non-empty vector").arg(primitiveName<V>(suffix)));
+    }
+    return VectorTraits<V>::reduce(Op, vector->data(), vector->size());
+}
+
+template <typename V>
+static Value primitiveDot(const Value* args, int) {
+    const V* a = checkVector<V>(args, 0, "%1-dot");
+    const V* b = checkVector<V>(args, 1, "%1-dot");
+    qsizetype n = checkSameLength(a, b, "%1-dot");
+    return VectorTraits<V>::dot(a->data(), b->data(), n);
+}
+
+//******************************************//
+//****************** Table *****************//
+//******************************************//
+
+namespace {
+struct VectorPrimitiveDefinition {
+    const char* pattern;
+    int minArgs;
+    int maxArgs;
+    Primitive::Callback callback;
+};
+}
+
+// Each pattern has the vector type's name substituted for %1
+template <typename V>
+static void defineVectorType(Environment* env) {
+    const VectorPrimitiveDefinition table[] = {
+        { "make-%1", 1, 2, primitiveMake<V> },
+        { "%1", 0, Primitive::Variadic, primitiveFromArguments<V> },
+        { "%1-length", 1, 1, primitiveLength<V> },
+        { "%1-ref", 2, 2, primitiveRef<V> },
+        { "%1-set!", 3, 3, primitiveSet<V> },
+        { "list->%1", 1, 1, primitiveFromList<V> },
+        { "%1->list", 1, 1, primitiveToList<V> },
+        { "%1-add", 2, 2, primitiveBinary<V, Simd::BinaryOp::Add> },
+        { "%1-sub", 2, 2, primitiveBinary<V, Simd::BinaryOp::Subtract> },
+        { "%1-mul", 2, 2, primitiveBinary<V, Simd::BinaryOp::Multiply> },
+        { "%1-sum", 1, 1, primitiveReduce<V, Simd::ReduceOp::Sum> },
+        { "%1-min", 1, 1, primitiveReduce<V, Simd::ReduceOp::Min> },
+        { "%1-max", 1, 1, primitiveReduce<V, Simd::ReduceOp::Max> },
+        { "%1-dot", 2, 2, primitiveDot<V> },
+        { "%1<", 2, 2, primitiveCompare<V, Simd::CompareOp::Less> },
+        { "%1=", 2, 2, primitiveCompare<V, Simd::CompareOp::Equal> },
+        { "%1>", 2, 2, primitiveCompare<V, Simd::CompareOp::Greater> },
+    };
+    for (const auto& definition : table) {
+        QString name = primitiveName<V>(definition.pattern);
+        env->define(name, Value(Heap::create<Primitive>(name, definition.minArgs, definition.maxArgs, definition.callback)));
+    }
+}
+
+void defineVectorPrimitives(Environment* env) {
+    defineVectorType<F64Vector>(env);
+    defineVectorType<S32Vector>(env);
+    // There is no SIMD integer division, so only f64vectors divide
+    env->define("f64vector-div", Value(Heap::create<Primitive>("f64vector-div", 2, 2,
+                                                               primitiveBinary<F64Vector, Simd::BinaryOp::Divide>)));
+}
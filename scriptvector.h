@@ -0,0 +1,47 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptvector.h
+#ifndef SCRIPTVECTOR_H
+#define SCRIPTVECTOR_H
+
+#include "scriptvalue.h"
+
+class Environment;
+
+// SRFI-4 style homogeneous vector. The elements live unboxed in one
+// 32-byte aligned buffer outside the heap cell, so the SIMD kernels in
+// scriptsimd.h can work on them directly. The length is fixed at creation.
+template <typename T, ExpressionKind Kind>
+class NumericVector : public Expression {
+    T* elements = nullptr;
+    qsizetype length;
+public:
+    explicit NumericVector(qsizetype n, T fill = T());
+    ~NumericVector() override;
+    ExpressionKind kind() const override { return Kind; }
+    QString toString() const override;
+    qint64 externalSize() const override { return length * qint64(sizeof(T)); }
+    T* data() { return elements; }
+    const T* data() const { return elements; }
+    qsizetype size() const { return length; }
+};
+
+using F64Vector = NumericVector<double, ExpressionKind::F64Vector>;
+using S32Vector = NumericVector<qint32, ExpressionKind::S32Vector>;
+
+// Binds the f64vector and s32vector primitives in the global environment env
+void defineVectorPrimitives(Environment* env);
+
+#endif // SCRIPTVECTOR_H
@@ -0,0 +1,264 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptvm.cpp
+#include "scriptvm.h"
+#include "scriptprofiler.h"
+#include <QDebug>
+
+VirtualMachine::VirtualMachine() : heap(Heap::current()) {
+    heap->addRoots(this);
+}
+
+VirtualMachine::~VirtualMachine() {
+    heap->removeRoots(this);
+}
+
+void VirtualMachine::traceRoots(Heap& target) const {
+    for (const auto& value : stack) {
+        target.mark(value);
+    }
+    for (const auto& frame : frames) {
+        target.mark(frame.block);
+        target.mark(frame.env);
+    }
+}
+
+Value VirtualMachine::execute(const CodeBlock& entry, Environment* entryEnv) {
+    Profiler* profiler = Profiler::current();
+    int entryFrame = frames.size();
+    frames.append({ &entry, entry.code.constData(), entryEnv, int(stack.size()), profiler ? profiler->depth() : 0 });
+
+    const CodeBlock* block;
+    const qint32* code;
+    const qint32* ip;
+    Environment* env;
+    // Loads the registers from the innermost frame after a call or return
+    auto resume = [&]() {
+        const Frame& frame = frames.last();
+        block = frame.block;
+        code = block->code.constData();
+        ip = frame.ip;
+        env = frame.env;
+        stack.reserve(stack.size() + block->maxStack);
+    };
+    // Pops the innermost frame and leaves its result where the callee was.
+    // Returns true once the frame this call to execute() pushed is done.
+    auto finishFrame = [&]() {
+        Value result = stack.takeLast();
+        if (profiler) {
+            profiler->unwind(frames.last().profileDepth);
+        }
+        stack.resize(frames.takeLast().base);
+        stack.append(result);
+        if (frames.size() == entryFrame) {
+            return true;
+        }
+        resume();
+        return false;
+    };
+    resume();
+    heap->collectIfNeeded();
+
+    for (;;) {
+        switch (static_cast<OpCode>(*ip++)) {
+        case OpCode::Constant:
+            stack.append(block->constants[*ip++]);
+            break;
+        case OpCode::LoadLocal: {
+            int depth = *ip++;
+            int index = *ip++;
+            int symbol = *ip++;
+            const auto& value = env->local(depth, index);
+            if (value.isUnbound()) {
+                // An internal define that has not run yet
+                Environment::undefinedSymbol(symbol);
+            }
+            stack.append(value);
+            break;
+        }
+        case OpCode::LoadGlobal:
+            stack.append(env->lookupGlobal(*ip++));
+            break;
+        case OpCode::DefineLocal:
+            env->local(0, *ip++) = stack.last();
+            break;
+        case OpCode::DefineGlobal:
+            env->defineGlobal(*ip++, stack.last());
+            break;
+        case OpCode::Selector: {
+            int selector = *ip++;
+            qint32 target = *ip++;
+            InlineCache& cache = block->caches[*ip++];
+            if (stack.last().is(ExpressionKind::Instance)) {
+                Instance* receiver = stack.last().as<Instance>();
+                if (cache.shape != receiver->getShape()) {
+                    int symbol = block->constants[selector].asSymbol();
+                    int slot = receiver->getShape()->slotOf(symbol);
+                    cache.method = slot >= 0 ? Value() : receiver->getClass()->getMethod(symbol);
+                    cache.slot = slot;
+                    cache.shape = receiver->getShape();
+                }
+                Value method = cache.slot >= 0 ? receiver->slotAt(cache.slot) : cache.method;
+                if (!method.is(ExpressionKind::Function)) {
+                    qCritical() << "Invalid method call";
+                    throw std::runtime_error("Invalid method call");
+                }
+                // The method becomes the callee and the instance its first argument
+                stack.last() = method;
+                stack.append(Value(receiver));
+                ip = code + target;
+            }
+            break;
+        }
+        case OpCode::Pop:
+            stack.removeLast();
+            break;
+        case OpCode::Jump:
+            ip = code + *ip;
+            break;
+        case OpCode::JumpIfFalse: {
+            qint32 target = *ip++;
+            if (!stack.takeLast().isTruthy()) {
+                ip = code + target;
+            }
+            break;
+        }
+        case OpCode::MakeClosure: {
+            stack.append(Value(Heap::create<Function>(block->functions[*ip++], env)));
+            break;
+        }
+        case OpCode::MakeClass: {
+            int count = *ip++;
+            int first = stack.size() - count;
+            auto cls = Heap::create<Class>();
+            for (int i = 0; i < count; ++i) {
+                cls->addMethod(block->constants[*ip++].asSymbol(), stack[first + i]);
+            }
+            stack.resize(first);
+            stack.append(Value(cls));
+            break;
+        }
+        case OpCode::New: {
+            Value cls = stack.takeLast();
+            if (!cls.is(ExpressionKind::Class)) {
+                qCritical() << "First argument to new must be a class";
+                throw std::runtime_error("First argument to new must be a class");
+            }
+            stack.append(Value(Heap::create<Instance>(cls.as<Class>())));
+            break;
+        }
+        case OpCode::Call:
+        case OpCode::TailCall: {
+            bool tail = static_cast<OpCode>(ip[-1]) == OpCode::TailCall;
+            int argc = *ip++;
+            int calleeIndex = stack.size() - argc - 1;
+            int argsIndex;
+            Function* function = resolveCallee(calleeIndex, argsIndex, argc);
+            if (!function || !function->getCode()) {
+                // Primitives and tree-walking functions run to completion
+                Value result;
+                if (function) {
+                    result = function->apply(stack.constData() + argsIndex, argc);
+                }
+                else {
+                    const Primitive* primitive = stack[calleeIndex].as<Primitive>();
+                    Profiler::CallScope profile(profiler, primitive);
+                    result = primitive->apply(stack.constData() + argsIndex, argc);
+                }
+                stack.resize(calleeIndex);
+                stack.append(result);
+                if (tail && finishFrame()) {
+                    return stack.takeLast();
+                }
+                break;
+            }
+            Environment* callee = function->bindArguments(stack.constData() + argsIndex, argc);
+            const CodeBlock* calleeBlock = function->getCode();
+            if (tail) {
+                // The caller has nothing left to do, so the callee takes over
+                // its frame and the caller's working values are dropped
+                Frame& frame = frames.last();
+                stack.resize(frame.base);
+                frame.block = calleeBlock;
+                frame.ip = calleeBlock->code.constData();
+                frame.env = callee;
+                if (profiler) {
+                    profiler->unwind(frame.profileDepth);
+                }
+            }
+            else {
+                frames.last().ip = ip;
+                frames.append({ calleeBlock, calleeBlock->code.constData(), callee, calleeIndex,
+                                profiler ? profiler->depth() : 0 });
+            }
+            if (profiler) {
+                profiler->enter(Profiler::siteOf(function));
+            }
+            resume();
+            heap->collectIfNeeded();
+            break;
+        }
+        case OpCode::Return:
+            if (finishFrame()) {
+                return stack.takeLast();
+            }
+            break;
+        }
+    }
+}
+
+// Finds the function a Call invokes. Returns nullptr for primitives, which
+// the caller applies directly. For instance method calls the instance takes
+// the method name's slot as the first argument.
+Function* VirtualMachine::resolveCallee(int calleeIndex, int& argsIndex, int argc) {
+    const Value& callee = stack[calleeIndex];
+    argsIndex = calleeIndex + 1;
+    if (!callee.isObject()) {
+        qCritical() << "Invalid function call";
+        throw std::runtime_error("Invalid function call");
+    }
+    switch (callee.asObject()->kind()) {
+    case ExpressionKind::Primitive:
+        return nullptr;
+    case ExpressionKind::Function:
+        return callee.as<Function>();
+    case ExpressionKind::Instance: {
+        if (argc < 1) {
+            qCritical() << "Method name must be provided when calling instance method";
+            throw std::runtime_error("Method name must be provided when calling instance method");
+        }
+        const Value& methodName = stack[calleeIndex + 1];
+        if (!methodName.isSymbol()) {
+            qCritical() << "Method name must be a symbol";
+            throw std::runtime_error("Method name must be a symbol");
+        }
+        Value method = callee.as<Instance>()->lookup(methodName.asSymbol());
+        if (!method.is(ExpressionKind::Function)) {
+            qCritical() << "Invalid method call";
+            throw std::runtime_error("Invalid method call");
+        }
+        stack[calleeIndex + 1] = callee;
+        return method.as<Function>();
+    }
+    default:
+        qCritical() << "Invalid function call";
+        throw std::runtime_error("Invalid function call");
+    }
+}
+
+void VirtualMachine::reset() {
+    stack.clear();
+    frames.clear();
+}
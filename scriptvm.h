@@ -0,0 +1,54 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// scriptvm.h
+#ifndef SCRIPTVM_H
+#define SCRIPTVM_H
+
+#include "script.h"
+#include "scriptcompiler.h"
+
+#include <QVector>
+
+// Stack machine that runs CodeBlocks produced by the Compiler. Calls between
+// compiled functions push a Frame instead of recursing on the C++ stack, and
+// TailCall reuses the caller's frame, so tail-recursive loops run in
+// constant space. The value stack and the frames are roots of the heap the
+// machine was created on, and the start of every call is a safe point.
+class VirtualMachine : private HeapRoots {
+public:
+    VirtualMachine();
+    ~VirtualMachine();
+
+    Value execute(const CodeBlock& block, Environment* env);
+    void reset();
+
+private:
+    struct Frame {
+        const CodeBlock* block;
+        const qint32* ip;
+        Environment* env;
+        int base;           // stack index the frame's result replaces
+        int profileDepth;   // profiler stack depth the frame's call returns to
+    };
+
+    Heap* heap;
+    QVector<Value> stack;
+    QVector<Frame> frames;
+
+    void traceRoots(Heap& target) const override;
+    Function* resolveCallee(int calleeIndex, int& argsIndex, int argc);
+};
+
+#endif // SCRIPTVM_H
@@ -0,0 +1,52 @@
+/*
+ * This file is part of the PrismaticOutpost project.
+ * Copyright 2024. Isaac Raway. All rights reserved.
+ * This file is licensed under the terms of the AGPL-3.0,
+ * which you can find a copy of in the LICENSE.md file
+ * https://www.gnu.org/licenses/agpl-3.0.md.
+ * IMPORTANT: This license ALSO applies to all scripts
+ * and databases packaged with this distribution of
+ * PrismaticOutpost. If you wish to distribute proprietary
+ * scripts or databases, then they MUST NOT be packaged
+ * with this distribution or any binary distribution built
+ * from this distribution or any derivative of this
+ * distribution.
+ */
+// test_actors.cpp
+//
+// Runs two actors that answer each other's messages on a single scheduler
+// worker. While one waits in receive the other must still get a thread,
+// so this deadlocks if a waiting actor ever holds up the ones it waits for.
+// Exits with status 0 when the exchange completes.
+#include "script.h"
+#include "scriptactor.h"
+#include <QCoreApplication>
+#include <QDebug>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    setActorWorkerCount(1);
+
+    Script script;
+    script.evaluate(R"(
+        (define pong (lambda ()
+          (let ((message (receive)))
+            (if (eq? (car message) (quote stop))
+                (quote stopped)
+                (begin (send (car (cdr message)) (quote pong)) (pong))))))
+        (define ping (lambda (peer n parent)
+          (if (= n 0)
+              (begin (send peer (list (quote stop))) (send parent (quote done)))
+              (begin (send peer (list (quote ping) (self)))
+                     (receive)
+                     (ping peer (- n 1) parent)))))
+    )");
+
+    QString result = script.evaluate("(begin (spawn ping (spawn pong) 1000 (self)) (receive 10000))").toString();
+    if (result != "done") {
+        qCritical() << "ping-pong on one worker returned" << result << "instead of done";
+        return 1;
+    }
+    return 0;
+}
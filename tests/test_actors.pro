@@ -0,0 +1,12 @@
+QT       += core
+QT       -= gui
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = test_actors
+
+include(../benchmarks/script.pri)
+
+SOURCES += \
+    test_actors.cpp
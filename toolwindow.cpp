@@ -85,10 +85,12 @@ void ToolWindow::setupItemContextMenu(QPushButton *button)
 
     QAction *renameAction = contextMenu->addAction("Rename Item");
     QAction *editAction = contextMenu->addAction("Edit Script");
+    QAction *profileAction = contextMenu->addAction("Profile Script...");
     QAction *deleteAction = contextMenu->addAction("Delete Item");
 
     connect(renameAction, &QAction::triggered, this, [this, button]() { this->renameItem(button); });
     connect(editAction, &QAction::triggered, this, [this, button]() { this->editItemScript(button); });
+    connect(profileAction, &QAction::triggered, this, [this, button]() { this->profileItemScript(button); });
     connect(deleteAction, &QAction::triggered, this, [this, button]() { this->deleteItem(button); });
 
     button->setContextMenuPolicy(Qt::CustomContextMenu);
@@ -136,6 +138,15 @@ void ToolWindow::editItemScript(QPushButton* button)
     }
 }
 
+void ToolWindow::profileItemScript(QPushButton* button)
+{
+    if (button) {
+        QString itemName = button->text();
+        QString scriptPath = itemScripts.value(itemName);
+        emit profileScriptRequested(itemName, scriptPath);
+    }
+}
+
 void ToolWindow::deleteItem(QPushButton* button)
 {
     if (button) {
@@ -45,6 +45,7 @@ public:
 signals:
     void itemClicked(const QString &itemText, const QString &scriptPath);
     void editScriptRequested(const QString &itemText, const QString &scriptPath);
+    void profileScriptRequested(const QString &itemText, const QString &scriptPath);
     void deleteItemRequested(const QString &itemText);
     void configurationChanged();
 
@@ -55,6 +56,7 @@ private slots:
     void showItemContextMenu(const QPoint &pos);
     void renameItem(QPushButton* button);
     void editItemScript(QPushButton* button);
+    void profileItemScript(QPushButton* button);
     void deleteItem(QPushButton* button);
 
 private: